@@ -109,6 +109,9 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -116,6 +119,7 @@
 #include <glib/gprintf.h>
 #include <xf86drmMode.h>
 #include <xf86drm.h>
+#include <drm_fourcc.h>
 #include <libkms.h>
 
 #include <gst/gst.h>
@@ -123,6 +127,7 @@
 #include <gst/video/video.h>
 #include <gst/video/video-info.h>
 #include "gstdrmsink.h"
+#include "gstframebuffersinkkernels.h"
 
 /* When LAZY_ALLOCATION is defined, memory buffers are only allocated
    when they are actually mapped for the first time. This solves the
@@ -132,6 +137,12 @@
 
 // #define USE_DRM_PLANES
 
+/* Framebuffer modifiers and the IN_FORMATS plane property require libdrm
+   2.4.83 or later. */
+#if defined (DRM_FORMAT_MOD_LINEAR) && defined (DRM_CAP_ADDFB2_MODIFIERS)
+#define HAVE_DRM_MODIFIERS
+#endif
+
 GST_DEBUG_CATEGORY_STATIC (gst_drmsink_debug_category);
 #define GST_CAT_DEFAULT gst_drmsink_debug_category
 
@@ -152,6 +163,7 @@ static void gst_drmsink_set_property (GObject * object,
     guint property_id, const GValue * value, GParamSpec * pspec);
 static void gst_drmsink_get_property (GObject * object,
     guint property_id, GValue * value, GParamSpec * pspec);
+static void gst_drmsink_finalize (GObject * object);
 
 static gboolean gst_drmsink_open_hardware (GstFramebufferSink *framebuffersink,
     GstVideoInfo *info, gsize *video_memory_size,
@@ -163,20 +175,35 @@ static GstAllocator *gst_drmsink_video_memory_allocator_new (
 static void gst_drmsink_pan_display (GstFramebufferSink *framebuffersink,
     GstMemory *memory);
 static void gst_drmsink_wait_for_vsync (GstFramebufferSink *framebuffersink);
+static gboolean gst_drmsink_frame_queued_for_scanout (
+    GstFramebufferSink *framebuffersink);
+static void gst_drmsink_match_display_mode (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info);
 
 /* Local functions. */
 static void gst_drmsink_reset (GstDrmsink *drmsink);
+static void gst_drmsink_flush_dumb_buffer_cache (GstDrmsink *drmsink);
 static void gst_drmsink_vblank_handler (int fd, unsigned int sequence,
     unsigned int tv_sec, unsigned int tv_usec, void *user_data);
 static void gst_drmsink_page_flip_handler (int fd,  unsigned int sequence,
     unsigned int tv_sec, unsigned int tv_usec, void *user_data);
-static void gst_drmsink_flush_drm_events (GstDrmsink *drmsink);
-static void gst_drmsink_wait_pending_drm_events (GstDrmsink *drmsink);
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+static void gst_drmsink_page_flip_handler2 (int fd,  unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+    void *user_data);
+#endif
+static gboolean gst_drmsink_start_event_thread (GstDrmsink *drmsink);
+static void gst_drmsink_stop_event_thread (GstDrmsink *drmsink);
+static gboolean gst_drmsink_wait_page_flip (GstDrmsink *drmsink,
+    gint64 timeout);
 
 enum
 {
   PROP_0,
   PROP_CONNECTOR,
+  PROP_DUMB_BUFFER_CACHE,
+  PROP_OUTPUTS,
+  PROP_SPAN_OUTPUTS,
 };
 
 #define GST_DRMSINK_TEMPLATE_CAPS \
@@ -213,6 +240,7 @@ gst_drmsink_class_init (GstDrmsinkClass* klass)
 
   gobject_class->set_property = gst_drmsink_set_property;
   gobject_class->get_property = gst_drmsink_get_property;
+  gobject_class->finalize = gst_drmsink_finalize;
 
   /* Setting up pads and setting metadata should be moved to
      base_class_init if you intend to subclass this class. */
@@ -228,6 +256,19 @@ gst_drmsink_class_init (GstDrmsinkClass* klass)
   g_object_class_install_property (gobject_class, PROP_CONNECTOR,
       g_param_spec_int ("connector", "Connector", "DRM connector id",
       0, G_MAXINT32, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DUMB_BUFFER_CACHE,
+      g_param_spec_int ("dumb-buffer-cache", "Dumb buffer cache size",
+      "Amount of freed video memory kept for reuse in MB (0 = disabled)",
+      0, G_MAXINT32, 32, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_OUTPUTS,
+      g_param_spec_string ("outputs", "Extra outputs",
+      "Comma-separated ids of further connectors to drive, or \"all\" for "
+      "every connected connector", NULL,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_SPAN_OUTPUTS,
+      g_param_spec_boolean ("span-outputs", "Span outputs",
+      "Place the extra outputs to the right of the main one instead of "
+      "mirroring it", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   framebuffer_sink_class->open_hardware =
       GST_DEBUG_FUNCPTR (gst_drmsink_open_hardware);
@@ -235,6 +276,10 @@ gst_drmsink_class_init (GstDrmsinkClass* klass)
       GST_DEBUG_FUNCPTR (gst_drmsink_close_hardware);
   framebuffer_sink_class->wait_for_vsync =
       GST_DEBUG_FUNCPTR (gst_drmsink_wait_for_vsync);
+  framebuffer_sink_class->frame_queued_for_scanout =
+      GST_DEBUG_FUNCPTR (gst_drmsink_frame_queued_for_scanout);
+  framebuffer_sink_class->match_display_mode =
+      GST_DEBUG_FUNCPTR (gst_drmsink_match_display_mode);
   framebuffer_sink_class->pan_display =
       GST_DEBUG_FUNCPTR (gst_drmsink_pan_display);
   framebuffer_sink_class->video_memory_allocator_new =
@@ -248,6 +293,11 @@ gst_drmsink_init (GstDrmsink *drmsink) {
   GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (drmsink);
 
   drmsink->fd = -1;
+  drmsink->event_epoll_fd = -1;
+  drmsink->event_wakeup_fd = -1;
+  g_mutex_init (&drmsink->event_lock);
+  g_cond_init (&drmsink->event_cond);
+  g_mutex_init (&drmsink->dumb_buffer_lock);
 
   /* Override the default value of the device property from
      GstFramebufferSink. */
@@ -265,10 +315,26 @@ gst_drmsink_init (GstDrmsink *drmsink) {
 
   /* Set the initial values of the properties.*/
   drmsink->preferred_connector_id = - 1;
+  drmsink->max_dumb_buffer_cache_property = 32;
+  drmsink->outputs_property = NULL;
+  drmsink->span_outputs = FALSE;
 
   gst_drmsink_reset (drmsink);
 }
 
+static void
+gst_drmsink_finalize (GObject * object)
+{
+  GstDrmsink *drmsink = GST_DRMSINK (object);
+
+  g_mutex_clear (&drmsink->event_lock);
+  g_cond_clear (&drmsink->event_cond);
+  g_mutex_clear (&drmsink->dumb_buffer_lock);
+  g_free (drmsink->outputs_property);
+
+  G_OBJECT_CLASS (gst_drmsink_parent_class)->finalize (object);
+}
+
 void
 gst_drmsink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -282,9 +348,23 @@ gst_drmsink_set_property (GObject * object, guint prop_id,
     case PROP_CONNECTOR:
       drmsink->preferred_connector_id = g_value_get_int (value);
       break;
+    case PROP_DUMB_BUFFER_CACHE:
+      drmsink->max_dumb_buffer_cache_property = g_value_get_int (value);
+      break;
+    case PROP_OUTPUTS:
+      g_free (drmsink->outputs_property);
+      drmsink->outputs_property = g_value_dup_string (value);
+      break;
+    case PROP_SPAN_OUTPUTS:
+      drmsink->span_outputs = g_value_get_boolean (value);
+      break;
     default:
       break;
     }
+
+  GST_OBJECT_LOCK (drmsink);
+  gst_framebuffersink_clear_caps_cache (GST_FRAMEBUFFERSINK (drmsink));
+  GST_OBJECT_UNLOCK (drmsink);
 }
 
 static void
@@ -300,11 +380,246 @@ gst_drmsink_get_property (GObject * object, guint prop_id,
     case PROP_CONNECTOR:
       g_value_set_int (value, drmsink->preferred_connector_id);
       break;
+    case PROP_DUMB_BUFFER_CACHE:
+      g_value_set_int (value, drmsink->max_dumb_buffer_cache_property);
+      break;
+    case PROP_OUTPUTS:
+      g_value_set_string (value, drmsink->outputs_property);
+      break;
+    case PROP_SPAN_OUTPUTS:
+      g_value_set_boolean (value, drmsink->span_outputs);
+      break;
     default:
       break;
     }
 }
 
+/* Return the DRM fourcc of a video format, or 0 if there is none. */
+
+static uint32_t
+gst_drmsink_get_drm_format (GstVideoFormat format)
+{
+  switch (format) {
+    case GST_VIDEO_FORMAT_BGRx:
+      return DRM_FORMAT_XRGB8888;
+    case GST_VIDEO_FORMAT_RGBx:
+      return DRM_FORMAT_XBGR8888;
+    case GST_VIDEO_FORMAT_xRGB:
+      return DRM_FORMAT_BGRX8888;
+    case GST_VIDEO_FORMAT_xBGR:
+      return DRM_FORMAT_RGBX8888;
+    case GST_VIDEO_FORMAT_RGB:
+      return DRM_FORMAT_BGR888;
+    case GST_VIDEO_FORMAT_BGR:
+      return DRM_FORMAT_RGB888;
+    case GST_VIDEO_FORMAT_RGB16:
+      return DRM_FORMAT_RGB565;
+    default:
+      return 0;
+  }
+}
+
+#ifdef HAVE_DRM_MODIFIERS
+
+/* Check the modifiers listed for the screen format in an IN_FORMATS blob.
+   Dumb buffers are always linear, so explicit modifiers are only used when
+   the plane lists the linear modifier. */
+
+static void
+gst_drmsink_parse_in_formats (GstDrmsink *drmsink, uint32_t blob_id)
+{
+  drmModePropertyBlobRes *blob;
+  struct drm_format_modifier_blob *header;
+  struct drm_format_modifier *modifiers;
+  uint32_t *formats;
+  uint32_t fourcc;
+  int i, j;
+
+  blob = drmModeGetPropertyBlob (drmsink->fd, blob_id);
+  if (blob == NULL)
+    return;
+
+  fourcc = gst_drmsink_get_drm_format (GST_VIDEO_FORMAT_BGRx);
+  header = blob->data;
+  formats = (uint32_t *)((char *)header + header->formats_offset);
+  modifiers = (struct drm_format_modifier *)((char *)header +
+      header->modifiers_offset);
+  for (i = 0; i < header->count_formats; i++) {
+    if (formats[i] != fourcc)
+      continue;
+    for (j = 0; j < header->count_modifiers; j++) {
+      if (i < modifiers[j].offset || i >= modifiers[j].offset + 64 ||
+          !(modifiers[j].formats & (1ULL << (i - modifiers[j].offset))))
+        continue;
+      GST_INFO_OBJECT (drmsink, "Scanout modifier 0x%016" G_GINT64_MODIFIER
+          "x supported", (guint64) modifiers[j].modifier);
+      if (modifiers[j].modifier == DRM_FORMAT_MOD_LINEAR)
+        drmsink->use_modifiers = TRUE;
+    }
+  }
+
+  drmModeFreePropertyBlob (blob);
+}
+
+/* Find the primary plane of the crtc and read the formats and modifiers it
+   can scan out from its IN_FORMATS property. */
+
+static void
+gst_drmsink_query_scanout_modifiers (GstDrmsink *drmsink, int pipe)
+{
+  drmModePlaneRes *plane_resources;
+  drmModePlane *plane;
+  drmModeObjectProperties *props;
+  drmModePropertyRes *prop;
+  uint64_t cap, type, in_formats;
+  int i, j;
+
+  drmsink->use_modifiers = FALSE;
+  if (drmGetCap (drmsink->fd, DRM_CAP_ADDFB2_MODIFIERS, &cap) || !cap)
+    return;
+  /* The primary plane is only listed with universal planes enabled. */
+  if (drmSetClientCap (drmsink->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+    return;
+
+  plane_resources = drmModeGetPlaneResources (drmsink->fd);
+  for (i = 0; plane_resources != NULL &&
+      i < plane_resources->count_planes; i++) {
+    plane = drmModeGetPlane (drmsink->fd, plane_resources->planes[i]);
+    if (plane == NULL)
+      continue;
+    if (!(plane->possible_crtcs & (1 << pipe))) {
+      drmModeFreePlane (plane);
+      continue;
+    }
+    props = drmModeObjectGetProperties (drmsink->fd, plane->plane_id,
+        DRM_MODE_OBJECT_PLANE);
+    drmModeFreePlane (plane);
+    if (props == NULL)
+      continue;
+
+    type = DRM_PLANE_TYPE_OVERLAY;
+    in_formats = 0;
+    for (j = 0; j < props->count_props; j++) {
+      prop = drmModeGetProperty (drmsink->fd, props->props[j]);
+      if (prop == NULL)
+        continue;
+      if (strcmp (prop->name, "type") == 0)
+        type = props->prop_values[j];
+      else if (strcmp (prop->name, "IN_FORMATS") == 0)
+        in_formats = props->prop_values[j];
+      drmModeFreeProperty (prop);
+    }
+    drmModeFreeObjectProperties (props);
+
+    if (type == DRM_PLANE_TYPE_PRIMARY) {
+      if (in_formats != 0)
+        gst_drmsink_parse_in_formats (drmsink, in_formats);
+      break;
+    }
+  }
+  if (plane_resources != NULL)
+    drmModeFreePlaneResources (plane_resources);
+
+  drmSetClientCap (drmsink->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+}
+
+#endif
+
+/* Return the refresh rate of a mode in mHz, calculated from the pixel clock
+   so that rates like 23.976 and 59.94 Hz are told apart from 24 and 60 Hz. */
+
+static guint64
+gst_drmsink_get_mode_refresh (drmModeModeInfo *mode)
+{
+  guint64 refresh;
+
+  if (mode->htotal == 0 || mode->vtotal == 0)
+    return (guint64) mode->vrefresh * 1000;
+  refresh = (guint64) mode->clock * 1000000 /
+      ((guint64) mode->htotal * mode->vtotal);
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+    refresh *= 2;
+  if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+    refresh /= 2;
+  if (mode->vscan > 1)
+    refresh /= mode->vscan;
+  return refresh;
+}
+
+/* Whether the refresh rate of the mode is a whole multiple of the frame rate
+   (in mHz), within 0.05%. */
+
+static gboolean
+gst_drmsink_mode_matches_frame_rate (drmModeModeInfo *mode,
+    guint64 frame_rate)
+{
+  guint64 refresh = gst_drmsink_get_mode_refresh (mode);
+  guint64 multiple;
+
+  multiple = (refresh + frame_rate / 2) / frame_rate;
+  if (multiple == 0)
+    return FALSE;
+  return ABS ((gint64) refresh - (gint64) (multiple * frame_rate)) * 2000
+      <= (gint64) refresh;
+}
+
+/* Switch to the progressive mode of the current resolution with the highest
+   refresh rate that is a multiple of the frame rate, unless the current mode
+   already matches. The new mode is set when the next frame is shown; the
+   original mode is restored when the device is closed. */
+
+static void
+gst_drmsink_match_display_mode (GstFramebufferSink *framebuffersink,
+    GstVideoInfo *info)
+{
+  GstDrmsink *drmsink = GST_DRMSINK (framebuffersink);
+  drmModeConnector *connector;
+  drmModeModeInfo *mode, *best;
+  guint64 frame_rate;
+  int i;
+  gchar *s;
+
+  frame_rate = gst_util_uint64_scale_int (1000, GST_VIDEO_INFO_FPS_N (info),
+      GST_VIDEO_INFO_FPS_D (info));
+  if (frame_rate == 0 ||
+      gst_drmsink_mode_matches_frame_rate (&drmsink->mode, frame_rate))
+    return;
+
+  connector = drmModeGetConnector (drmsink->fd, drmsink->connector_id);
+  if (connector == NULL)
+    return;
+
+  best = NULL;
+  for (i = 0; i < connector->count_modes; i++) {
+    mode = &connector->modes[i];
+    if (mode->hdisplay != drmsink->mode.hdisplay ||
+        mode->vdisplay != drmsink->mode.vdisplay ||
+        (mode->flags & DRM_MODE_FLAG_INTERLACE) ||
+        !gst_drmsink_mode_matches_frame_rate (mode, frame_rate))
+      continue;
+    if (best == NULL || gst_drmsink_get_mode_refresh (mode) >
+        gst_drmsink_get_mode_refresh (best))
+      best = mode;
+  }
+
+  if (best != NULL) {
+    s = g_strdup_printf ("Switching to display mode %s at %.3f Hz for "
+        "%.3f fps", best->name,
+        (double) gst_drmsink_get_mode_refresh (best) / 1000,
+        (double) frame_rate / 1000);
+    drmsink->mode = *best;
+    drmsink->crtc_mode_initialized = FALSE;
+  }
+  else
+    s = g_strdup_printf ("No %dx%d display mode matches %.3f fps",
+        drmsink->mode.hdisplay, drmsink->mode.vdisplay,
+        (double) frame_rate / 1000);
+  GST_DRMSINK_MESSAGE_OBJECT (drmsink, s);
+  g_free (s);
+
+  drmModeFreeConnector (connector);
+}
+
 static gboolean
 gst_drmsink_find_mode_and_plane (GstDrmsink *drmsink, GstVideoRectangle *dim)
 {
@@ -363,6 +678,10 @@ gst_drmsink_find_mode_and_plane (GstDrmsink *drmsink, GstVideoRectangle *dim)
   if (pipe == -1)
     goto error_no_crtc;
 
+#ifdef HAVE_DRM_MODIFIERS
+  gst_drmsink_query_scanout_modifiers (drmsink, pipe);
+#endif
+
 #ifdef USE_DRM_PLANES
   for (i = 0; i < drmsink->plane_resources->count_planes; i++) {
     plane = drmModeGetPlane (drmsink->fd, drmsink->plane_resources->planes[i]);
@@ -412,6 +731,184 @@ error_no_plane:
   goto fail;
 }
 
+/* Extra outputs. Further connectors can be driven from the same screen
+   framebuffer, each by its own crtc, either mirroring the main connector or
+   extending the screen to the right of it. */
+
+static gboolean
+gst_drmsink_crtc_is_used (GstDrmsink *drmsink, uint32_t crtc_id)
+{
+  int i;
+
+  if (crtc_id == drmsink->crtc_id)
+    return TRUE;
+  for (i = 0; i < drmsink->nu_extra_outputs; i++)
+    if (drmsink->extra_outputs[i].crtc_id == crtc_id)
+      return TRUE;
+  return FALSE;
+}
+
+/* Find a crtc that can drive the connector and is not used by another
+   output, preferring the one it is currently connected to. */
+
+static uint32_t
+gst_drmsink_find_free_crtc (GstDrmsink *drmsink, drmModeConnector *connector)
+{
+  drmModeEncoder *encoder;
+  uint32_t crtc_id;
+  int i, j;
+
+  encoder = drmModeGetEncoder (drmsink->fd, connector->encoder_id);
+  if (encoder != NULL) {
+    crtc_id = encoder->crtc_id;
+    drmModeFreeEncoder (encoder);
+    if (crtc_id != 0 && !gst_drmsink_crtc_is_used (drmsink, crtc_id))
+      return crtc_id;
+  }
+
+  for (i = 0; i < connector->count_encoders; i++) {
+    encoder = drmModeGetEncoder (drmsink->fd, connector->encoders[i]);
+    if (encoder == NULL)
+      continue;
+    for (j = 0; j < drmsink->resources->count_crtcs; j++) {
+      crtc_id = drmsink->resources->crtcs[j];
+      if ((encoder->possible_crtcs & (1 << j)) &&
+          !gst_drmsink_crtc_is_used (drmsink, crtc_id)) {
+        drmModeFreeEncoder (encoder);
+        return crtc_id;
+      }
+    }
+    drmModeFreeEncoder (encoder);
+  }
+  return 0;
+}
+
+static gboolean
+gst_drmsink_connector_is_listed (gchar **ids, uint32_t connector_id)
+{
+  int i;
+
+  for (i = 0; ids[i] != NULL; i++)
+    if (*ids[i] != '\0' && strtoul (ids[i], NULL, 10) == connector_id)
+      return TRUE;
+  return FALSE;
+}
+
+/* Add the connectors selected by the outputs property as extra outputs and
+   enlarge the screen when spanning. When mirroring, each output uses the
+   largest mode that fits in the screen of the main connector. A crtc scans
+   out the framebuffer unscaled, so an output with a smaller mode shows the
+   top-left part of the screen. */
+
+static void
+gst_drmsink_add_extra_outputs (GstDrmsink *drmsink)
+{
+  drmModeConnector *connector;
+  drmModeModeInfo *mode;
+  GstDrmsinkOutput *output;
+  gchar **ids;
+  gboolean all;
+  int width, height;
+  int i, j;
+  gchar *s;
+
+  drmsink->nu_extra_outputs = 0;
+  if (drmsink->outputs_property == NULL ||
+      *drmsink->outputs_property == '\0')
+    return;
+
+  all = strcmp (drmsink->outputs_property, "all") == 0;
+  ids = g_strsplit (drmsink->outputs_property, ",", -1);
+  width = drmsink->screen_rect.w;
+  height = drmsink->screen_rect.h;
+
+  for (i = 0; i < drmsink->resources->count_connectors &&
+      drmsink->nu_extra_outputs < GST_DRMSINK_MAX_EXTRA_OUTPUTS; i++) {
+    if (drmsink->resources->connectors[i] == drmsink->connector_id)
+      continue;
+    if (!all && !gst_drmsink_connector_is_listed (ids,
+        drmsink->resources->connectors[i]))
+      continue;
+    connector = drmModeGetConnector (drmsink->fd,
+        drmsink->resources->connectors[i]);
+    if (connector == NULL)
+      continue;
+    if (connector->connection != DRM_MODE_CONNECTED ||
+        connector->count_modes == 0) {
+      drmModeFreeConnector (connector);
+      continue;
+    }
+
+    mode = NULL;
+    if (drmsink->span_outputs)
+      mode = &connector->modes[0];
+    else
+      for (j = 0; j < connector->count_modes; j++)
+        if (connector->modes[j].hdisplay <= drmsink->screen_rect.w &&
+            connector->modes[j].vdisplay <= drmsink->screen_rect.h) {
+          mode = &connector->modes[j];
+          break;
+        }
+
+    output = &drmsink->extra_outputs[drmsink->nu_extra_outputs];
+    output->crtc_id = gst_drmsink_find_free_crtc (drmsink, connector);
+    if (mode == NULL || output->crtc_id == 0) {
+      s = g_strdup_printf ("Cannot drive DRM connector %d as extra output "
+          "(no %s)", connector->connector_id,
+          mode == NULL ? "suitable mode" : "free crtc");
+      GST_DRMSINK_MESSAGE_OBJECT (drmsink, s);
+      g_free (s);
+      drmModeFreeConnector (connector);
+      continue;
+    }
+
+    output->connector_id = connector->connector_id;
+    output->mode = *mode;
+    output->x = 0;
+    if (drmsink->span_outputs) {
+      output->x = width;
+      width += mode->hdisplay;
+      height = MAX (height, mode->vdisplay);
+    }
+    output->saved_crtc = drmModeGetCrtc (drmsink->fd, output->crtc_id);
+    drmsink->nu_extra_outputs++;
+
+    s = g_strdup_printf ("Extra output: connector = %d, mode = %dx%d, "
+        "x = %d", output->connector_id, mode->hdisplay, mode->vdisplay,
+        output->x);
+    GST_DRMSINK_MESSAGE_OBJECT (drmsink, s);
+    g_free (s);
+    drmModeFreeConnector (connector);
+  }
+  g_strfreev (ids);
+
+  drmsink->screen_rect.w = width;
+  drmsink->screen_rect.h = height;
+}
+
+static void
+gst_drmsink_restore_extra_outputs (GstDrmsink *drmsink)
+{
+  GstDrmsinkOutput *output;
+  int i;
+
+  for (i = 0; i < drmsink->nu_extra_outputs; i++) {
+    output = &drmsink->extra_outputs[i];
+    if (output->saved_crtc == NULL)
+      continue;
+    if (output->saved_crtc->mode_valid)
+      drmModeSetCrtc (drmsink->fd, output->crtc_id,
+          output->saved_crtc->buffer_id, output->saved_crtc->x,
+          output->saved_crtc->y, &output->connector_id, 1,
+          &output->saved_crtc->mode);
+    else
+      drmModeSetCrtc (drmsink->fd, output->crtc_id, 0, 0, 0, NULL, 0, NULL);
+    drmModeFreeCrtc (output->saved_crtc);
+    output->saved_crtc = NULL;
+  }
+  drmsink->nu_extra_outputs = 0;
+}
+
 static void
 gst_drmsink_reset (GstDrmsink *drmsink)
 {
@@ -434,6 +931,13 @@ gst_drmsink_reset (GstDrmsink *drmsink)
   }
 
 
+  gst_drmsink_stop_event_thread (drmsink);
+  gst_drmsink_flush_dumb_buffer_cache (drmsink);
+  if (drmsink->event_context) {
+    g_slice_free (drmEventContext, drmsink->event_context);
+    drmsink->event_context = NULL;
+  }
+
   if (drmsink->fd != -1) {
     close (drmsink->fd);
     drmsink->fd = -1;
@@ -566,12 +1070,19 @@ gst_drmsink_open_hardware (GstFramebufferSink *framebuffersink,
   drmsink->crtc_mode_initialized = FALSE;
   drmsink->saved_crtc = drmModeGetCrtc (drmsink->fd, drmsink->crtc_id);
 
+  gst_drmsink_add_extra_outputs (drmsink);
+
   drmsink->event_context = g_slice_new (drmEventContext);
   drmsink->event_context->version = DRM_EVENT_CONTEXT_VERSION;
   drmsink->event_context->vblank_handler = gst_drmsink_vblank_handler;
   drmsink->event_context->page_flip_handler = gst_drmsink_page_flip_handler;
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+  drmsink->event_context->page_flip_handler2 = gst_drmsink_page_flip_handler2;
+#endif
   drmsink->page_flip_occurred = FALSE;
   drmsink->page_flip_pending = FALSE;
+  if (!gst_drmsink_start_event_thread (drmsink))
+    goto fail;
 
 #if 0
   drmModeFreeResources(resources);
@@ -608,6 +1119,12 @@ gst_drmsink_open_hardware (GstFramebufferSink *framebuffersink,
   return TRUE;
 
 fail:
+  /* Put the crtcs of the extra outputs back and free what was saved. */
+  gst_drmsink_restore_extra_outputs (drmsink);
+  if (drmsink->saved_crtc != NULL) {
+    drmModeFreeCrtc (drmsink->saved_crtc);
+    drmsink->saved_crtc = NULL;
+  }
   gst_drmsink_reset (drmsink);
   return FALSE;
 
@@ -626,15 +1143,23 @@ plane_resources_failed:
 static void
 gst_drmsink_close_hardware (GstFramebufferSink *framebuffersink) {
   GstDrmsink *drmsink = GST_DRMSINK (framebuffersink);
+  gchar *s;
 
-  gst_drmsink_flush_drm_events (drmsink);
-  gst_drmsink_wait_pending_drm_events (drmsink);
+  gst_drmsink_wait_page_flip (drmsink, 5 * G_TIME_SPAN_SECOND);
 
   drmModeSetCrtc (drmsink->fd, drmsink->saved_crtc->crtc_id,
       drmsink->saved_crtc->buffer_id, drmsink->saved_crtc->x,
       drmsink->saved_crtc->y, &drmsink->connector_id, 1,
       &drmsink->saved_crtc->mode);
   drmModeFreeCrtc (drmsink->saved_crtc);
+  drmsink->saved_crtc = NULL;
+  gst_drmsink_restore_extra_outputs (drmsink);
+
+  s = g_strdup_printf ("Dumb buffers reused from cache: %d",
+      drmsink->stats_dumb_buffers_reused);
+  GST_DRMSINK_MESSAGE_OBJECT (drmsink, s);
+  g_free (s);
+  drmsink->stats_dumb_buffers_reused = 0;
 
   gst_drmsink_reset (drmsink);
 
@@ -646,6 +1171,8 @@ gst_drmsink_close_hardware (GstFramebufferSink *framebuffersink) {
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  gst_framebuffersink_kernels_init ();
+
   /* Remember to set the rank if it's an element that is meant
      to be autoplugged by decodebin. */
   return gst_element_register (plugin, "drmsink", GST_RANK_NONE,
@@ -698,16 +1225,156 @@ GType gst_drmsink_video_memory_allocator_get_type (void);
 G_DEFINE_TYPE (GstDrmSinkVideoMemoryAllocator,
     gst_drmsink_video_memory_allocator, GST_TYPE_ALLOCATOR);
 
+/* A dumb buffer registered as framebuffer and mapped into memory. */
+
 typedef struct
 {
-  GstMemory mem;
   struct drm_mode_create_dumb creq;
   struct drm_mode_map_dumb mreq;
   uint32_t fb;
+  uint32_t fourcc;
+  uint32_t depth;
   gpointer map_address;
+  /* Value of page_flips_completed when the buffer was freed. */
+  guint freed_at_flip;
+} GstDrmSinkDumbBuffer;
+
+typedef struct
+{
+  GstMemory mem;
+  GstDrmSinkDumbBuffer dumb;
   gboolean allocated;
 } GstDrmSinkVideoMemory;
 
+/* Dumb buffer cache. Creating a dumb buffer takes several ioctls and an mmap,
+   so dumb buffers that are freed are kept mapped and registered as
+   framebuffers, most recently used first, up to the configured cache size,
+   and are reused for the next allocation with the same dimensions and
+   format. A freed buffer may still be scanned out, so it only enters the
+   cache once a page flip has completed after it was freed. */
+
+static void
+gst_drmsink_destroy_dumb_buffer (GstDrmsink *drmsink,
+    GstDrmSinkDumbBuffer *dumb)
+{
+  struct drm_mode_destroy_dumb dreq;
+
+  munmap (dumb->map_address, dumb->creq.size);
+  if (drmsink->fd == -1)
+    return;
+  drmModeRmFB (drmsink->fd, dumb->fb);
+  dreq.handle = dumb->creq.handle;
+  drmIoctl (drmsink->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+}
+
+/* Move the freed buffers that are off screen into the cache, evicting the
+   least recently used buffers. Called with dumb_buffer_lock held. */
+
+static void
+gst_drmsink_cache_flipped_dumb_buffers (GstDrmsink *drmsink)
+{
+  GstDrmSinkDumbBuffer *cached;
+  gsize max_size = (gsize) drmsink->max_dumb_buffer_cache_property
+      * 1024 * 1024;
+  guint flips = g_atomic_int_get (&drmsink->page_flips_completed);
+  GList *l, *next;
+
+  for (l = drmsink->dumb_buffers_pending_flip; l != NULL; l = next) {
+    cached = l->data;
+    next = l->next;
+    if (cached->freed_at_flip == flips)
+      continue;
+    drmsink->dumb_buffers_pending_flip = g_list_delete_link (
+        drmsink->dumb_buffers_pending_flip, l);
+    drmsink->dumb_buffer_cache = g_list_prepend (drmsink->dumb_buffer_cache,
+        cached);
+    drmsink->dumb_buffer_cache_size += cached->creq.size;
+  }
+
+  while (drmsink->dumb_buffer_cache_size > max_size) {
+    l = g_list_last (drmsink->dumb_buffer_cache);
+    cached = l->data;
+    drmsink->dumb_buffer_cache = g_list_delete_link (
+        drmsink->dumb_buffer_cache, l);
+    drmsink->dumb_buffer_cache_size -= cached->creq.size;
+    gst_drmsink_destroy_dumb_buffer (drmsink, cached);
+    g_slice_free (GstDrmSinkDumbBuffer, cached);
+  }
+}
+
+static gboolean
+gst_drmsink_take_cached_dumb_buffer (GstDrmsink *drmsink, uint32_t width,
+    uint32_t height, uint32_t bpp, uint32_t depth, uint32_t fourcc,
+    GstDrmSinkDumbBuffer *dumb)
+{
+  GList *l;
+
+  g_mutex_lock (&drmsink->dumb_buffer_lock);
+  gst_drmsink_cache_flipped_dumb_buffers (drmsink);
+  for (l = drmsink->dumb_buffer_cache; l != NULL; l = l->next) {
+    GstDrmSinkDumbBuffer *cached = l->data;
+    if (cached->creq.width == width && cached->creq.height == height &&
+        cached->creq.bpp == bpp && cached->depth == depth &&
+        cached->fourcc == fourcc) {
+      *dumb = *cached;
+      drmsink->dumb_buffer_cache = g_list_delete_link (
+          drmsink->dumb_buffer_cache, l);
+      drmsink->dumb_buffer_cache_size -= cached->creq.size;
+      drmsink->stats_dumb_buffers_reused++;
+      g_slice_free (GstDrmSinkDumbBuffer, cached);
+      g_mutex_unlock (&drmsink->dumb_buffer_lock);
+      return TRUE;
+    }
+  }
+  g_mutex_unlock (&drmsink->dumb_buffer_lock);
+  return FALSE;
+}
+
+static void
+gst_drmsink_cache_dumb_buffer (GstDrmsink *drmsink, GstDrmSinkDumbBuffer *dumb)
+{
+  GstDrmSinkDumbBuffer *cached;
+  gsize max_size = (gsize) drmsink->max_dumb_buffer_cache_property
+      * 1024 * 1024;
+
+  g_mutex_lock (&drmsink->dumb_buffer_lock);
+  if (drmsink->fd == -1 || dumb->creq.size > max_size) {
+    g_mutex_unlock (&drmsink->dumb_buffer_lock);
+    gst_drmsink_destroy_dumb_buffer (drmsink, dumb);
+    return;
+  }
+
+  cached = g_slice_new (GstDrmSinkDumbBuffer);
+  *cached = *dumb;
+  cached->freed_at_flip = g_atomic_int_get (&drmsink->page_flips_completed);
+  drmsink->dumb_buffers_pending_flip = g_list_prepend (
+      drmsink->dumb_buffers_pending_flip, cached);
+  gst_drmsink_cache_flipped_dumb_buffers (drmsink);
+  g_mutex_unlock (&drmsink->dumb_buffer_lock);
+}
+
+static void
+gst_drmsink_flush_dumb_buffer_cache (GstDrmsink *drmsink)
+{
+  GList *l;
+
+  g_mutex_lock (&drmsink->dumb_buffer_lock);
+  for (l = drmsink->dumb_buffer_cache; l != NULL; l = l->next) {
+    gst_drmsink_destroy_dumb_buffer (drmsink, l->data);
+    g_slice_free (GstDrmSinkDumbBuffer, l->data);
+  }
+  g_list_free (drmsink->dumb_buffer_cache);
+  drmsink->dumb_buffer_cache = NULL;
+  drmsink->dumb_buffer_cache_size = 0;
+  for (l = drmsink->dumb_buffers_pending_flip; l != NULL; l = l->next) {
+    gst_drmsink_destroy_dumb_buffer (drmsink, l->data);
+    g_slice_free (GstDrmSinkDumbBuffer, l->data);
+  }
+  g_list_free (drmsink->dumb_buffers_pending_flip);
+  drmsink->dumb_buffers_pending_flip = NULL;
+  g_mutex_unlock (&drmsink->dumb_buffer_lock);
+}
+
 #ifdef LAZY_ALLOCATION
 /* With lazy allocation, don't allocate video memory immediately, but wait
    until the first memory_map call. */
@@ -722,7 +1389,7 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
   gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_NO_SHARE |
       GST_MEMORY_FLAG_VIDEO_MEMORY, allocator, NULL, size, align, 0, size);
   mem->allocated = FALSE;
-  mem->map_address = NULL;
+  mem->dumb.map_address = NULL;
   return GST_MEMORY_CAST (mem);
 }
 #endif
@@ -741,12 +1408,19 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
 #endif
   GstDrmSinkVideoMemoryAllocator *drmsink_video_memory_allocator =
       (GstDrmSinkVideoMemoryAllocator *)allocator;
+  GstDrmsink *drmsink = drmsink_video_memory_allocator->drmsink;
   struct drm_mode_destroy_dumb dreq;
   int ret;
   /* Ignore params (which should be NULL) and use word alignment. */
   int align = 3;
   int i;
-  int depth;
+  uint32_t bpp;
+  uint32_t depth;
+  uint32_t fourcc;
+  uint32_t handles[4], pitches[4], offsets[4];
+#ifdef HAVE_DRM_MODIFIERS
+  uint64_t modifiers[4];
+#endif
 
   GST_OBJECT_LOCK (allocator);
 
@@ -754,18 +1428,36 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
   mem = g_slice_new (GstDrmSinkVideoMemory);
 #endif
 
-  mem->creq.height = drmsink_video_memory_allocator->h;
-  mem->creq.width = drmsink_video_memory_allocator->w;
-  mem->creq.bpp = GST_VIDEO_FORMAT_INFO_PSTRIDE (
+  bpp = GST_VIDEO_FORMAT_INFO_PSTRIDE (
       &drmsink_video_memory_allocator->format_info, 0) * 8;
-  mem->creq.flags = 0;
+  depth = 0;
+  for (i = 0; i < GST_VIDEO_FORMAT_INFO_N_COMPONENTS (
+      &drmsink_video_memory_allocator->format_info); i++)
+    depth += GST_VIDEO_FORMAT_INFO_DEPTH (
+        &drmsink_video_memory_allocator->format_info, i);
+
+  fourcc = gst_drmsink_get_drm_format (GST_VIDEO_FORMAT_INFO_FORMAT (
+      &drmsink_video_memory_allocator->format_info));
+
+  if (gst_drmsink_take_cached_dumb_buffer (drmsink,
+      drmsink_video_memory_allocator->w, drmsink_video_memory_allocator->h,
+      bpp, depth, fourcc, &mem->dumb)) {
+    GST_LOG_OBJECT (drmsink, "Reusing cached dumb buffer at %p",
+        mem->dumb.map_address);
+    goto done;
+  }
+
+  mem->dumb.creq.height = drmsink_video_memory_allocator->h;
+  mem->dumb.creq.width = drmsink_video_memory_allocator->w;
+  mem->dumb.creq.bpp = bpp;
+  mem->dumb.creq.flags = 0;
+  mem->dumb.depth = depth;
+  mem->dumb.fourcc = fourcc;
 
   /* handle, pitch and size will be returned in the creq struct. */
-  ret = drmIoctl (drmsink_video_memory_allocator->drmsink->fd,
-      DRM_IOCTL_MODE_CREATE_DUMB, &mem->creq);
+  ret = drmIoctl (drmsink->fd, DRM_IOCTL_MODE_CREATE_DUMB, &mem->dumb.creq);
   if (ret < 0) {
-    GST_DRMSINK_MESSAGE_OBJECT (drmsink_video_memory_allocator->drmsink,
-        "Creating dumb drm buffer failed");
+    GST_DRMSINK_MESSAGE_OBJECT (drmsink, "Creating dumb drm buffer failed");
 #ifndef LAZY_ALLOCATION
     g_slice_free (GstDrmSinkVideoMemory, mem);
 #endif
@@ -773,21 +1465,36 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
     return NULL;
   }
 
-  depth = 0;
-  for (i = 0; i < GST_VIDEO_FORMAT_INFO_N_COMPONENTS (
-      &drmsink_video_memory_allocator->format_info); i++)
-    depth += GST_VIDEO_FORMAT_INFO_DEPTH (
-        &drmsink_video_memory_allocator->format_info, i);
-
-  /* create framebuffer object for the dumb-buffer */
-  ret = drmModeAddFB (drmsink_video_memory_allocator->drmsink->fd,
-      drmsink_video_memory_allocator->w, drmsink_video_memory_allocator->h,
-      depth, GST_VIDEO_FORMAT_INFO_PSTRIDE (
-      &drmsink_video_memory_allocator->format_info, 0) * 8,
-      mem->creq.pitch, mem->creq.handle, &mem->fb);
+  /* create framebuffer object for the dumb-buffer, with an explicit
+     format and modifier when the driver supports it */
+  memset (handles, 0, sizeof (handles));
+  memset (pitches, 0, sizeof (pitches));
+  memset (offsets, 0, sizeof (offsets));
+  handles[0] = mem->dumb.creq.handle;
+  pitches[0] = mem->dumb.creq.pitch;
+  ret = -1;
+#ifdef HAVE_DRM_MODIFIERS
+  if (fourcc != 0 && drmsink->use_modifiers) {
+    memset (modifiers, 0, sizeof (modifiers));
+    modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+    ret = drmModeAddFB2WithModifiers (drmsink->fd,
+        drmsink_video_memory_allocator->w, drmsink_video_memory_allocator->h,
+        fourcc, handles, pitches, offsets, modifiers, &mem->dumb.fb,
+        DRM_MODE_FB_MODIFIERS);
+  }
+#endif
+  if (ret && fourcc != 0)
+    ret = drmModeAddFB2 (drmsink->fd,
+        drmsink_video_memory_allocator->w, drmsink_video_memory_allocator->h,
+        fourcc, handles, pitches, offsets, &mem->dumb.fb, 0);
+  if (ret)
+    ret = drmModeAddFB (drmsink->fd,
+        drmsink_video_memory_allocator->w, drmsink_video_memory_allocator->h,
+        depth, bpp, mem->dumb.creq.pitch, mem->dumb.creq.handle,
+        &mem->dumb.fb);
   if (ret) {
     /* frame buffer creation failed; see "errno" */
-    GST_DRMSINK_MESSAGE_OBJECT (drmsink_video_memory_allocator->drmsink,
+    GST_DRMSINK_MESSAGE_OBJECT (drmsink,
         "DRM framebuffer creation failed.\n");
     goto fail_destroy;
   }
@@ -795,31 +1502,31 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
   /* the framebuffer "fb" can now used for scanout with KMS */
 
   /* prepare buffer for memory mapping */
-  memset (&mem->mreq, 0, sizeof(mem->mreq));
-  mem->mreq.handle = mem->creq.handle;
-  ret = drmIoctl (drmsink_video_memory_allocator->drmsink->fd,
-      DRM_IOCTL_MODE_MAP_DUMB, &mem->mreq);
+  memset (&mem->dumb.mreq, 0, sizeof(mem->dumb.mreq));
+  mem->dumb.mreq.handle = mem->dumb.creq.handle;
+  ret = drmIoctl (drmsink->fd, DRM_IOCTL_MODE_MAP_DUMB, &mem->dumb.mreq);
   if (ret) {
-    GST_DRMSINK_MESSAGE_OBJECT (drmsink_video_memory_allocator->drmsink,
+    GST_DRMSINK_MESSAGE_OBJECT (drmsink,
         "DRM buffer preparation failed.\n");
-    drmModeRmFB (drmsink_video_memory_allocator->drmsink->fd, mem->creq.handle);
+    drmModeRmFB (drmsink->fd, mem->dumb.fb);
     goto fail_destroy;
   }
 
-  /* mem->mreq.offset now contains the new offset that can be used with mmap */
+  /* mem->dumb.mreq.offset now contains the new offset that can be used with
+     mmap */
 
   /* perform actual memory mapping */
-  mem->map_address = mmap (0, mem->creq.size, PROT_READ | PROT_WRITE,
-      MAP_SHARED,
-      drmsink_video_memory_allocator->drmsink->fd, mem->mreq.offset);
-  if (mem->map_address == MAP_FAILED) {
+  mem->dumb.map_address = mmap (0, mem->dumb.creq.size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, drmsink->fd, mem->dumb.mreq.offset);
+  if (mem->dumb.map_address == MAP_FAILED) {
     /* memory-mapping failed; see "errno" */
-    GST_DRMSINK_MESSAGE_OBJECT (drmsink_video_memory_allocator->drmsink,
+    GST_DRMSINK_MESSAGE_OBJECT (drmsink,
         "Memory mapping of DRM buffer failed.\n");
-    drmModeRmFB (drmsink_video_memory_allocator->drmsink->fd, mem->creq.handle);
+    drmModeRmFB (drmsink->fd, mem->dumb.fb);
     goto fail_destroy;
   }
 
+done:
 #ifndef LAZY_ALLOCATION
   gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_NO_SHARE |
       GST_MEMORY_FLAG_VIDEO_MEMORY,
@@ -829,18 +1536,17 @@ gst_drmsink_video_memory_allocator_alloc (GstAllocator *allocator, gsize size,
 
   drmsink_video_memory_allocator->total_allocated += size;
 
-  GST_INFO_OBJECT (drmsink_video_memory_allocator->drmsink,
+  GST_INFO_OBJECT (drmsink,
       "Allocated video memory buffer of size %zd at %p, align %d, mem = %p\n",
-      size, mem->map_address, align, mem);
+      size, mem->dumb.map_address, align, mem);
 
   GST_OBJECT_UNLOCK (allocator);
   return (GstMemory *) mem;
 
 fail_destroy :
 
-    dreq.handle = mem->creq.handle;
-    drmIoctl (drmsink_video_memory_allocator->drmsink->fd,
-        DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    dreq.handle = mem->dumb.creq.handle;
+    drmIoctl (drmsink->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 #ifndef LAZY_ALLOCATION
     g_slice_free (GstDrmSinkVideoMemory, mem);
 #endif
@@ -855,10 +1561,10 @@ gst_drmsink_video_memory_allocator_free (GstAllocator * allocator,
   GstDrmSinkVideoMemoryAllocator *drmsink_video_memory_allocator =
       (GstDrmSinkVideoMemoryAllocator *)allocator;
   GstDrmSinkVideoMemory *vmem = (GstDrmSinkVideoMemory *) mem;
-  struct drm_mode_destroy_dumb dreq;
 
   GST_INFO_OBJECT (drmsink_video_memory_allocator->drmsink,
-      "video_memory_allocator_free called, address = %p\n", vmem->map_address);
+      "video_memory_allocator_free called, address = %p\n",
+      vmem->dumb.map_address);
 
 #ifdef LAZY_ALLOCATION
   if (!vmem->allocated) {
@@ -869,10 +1575,8 @@ gst_drmsink_video_memory_allocator_free (GstAllocator * allocator,
 
   drmsink_video_memory_allocator->total_allocated -= mem->size;
 
-  munmap (vmem->map_address, vmem->creq.size);
-  dreq.handle = vmem->creq.handle;
-  drmIoctl (drmsink_video_memory_allocator->drmsink->fd,
-      DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+  gst_drmsink_cache_dumb_buffer (drmsink_video_memory_allocator->drmsink,
+      &vmem->dumb);
 
   g_slice_free (GstDrmSinkVideoMemory, vmem);
 
@@ -884,10 +1588,13 @@ gst_drmsink_video_memory_map (GstMemory * mem, gsize maxsize, GstMapFlags flags)
 {
   GstDrmSinkVideoMemory *vmem = (GstDrmSinkVideoMemory *)mem;
   GST_DEBUG ("video_memory_map called, mem = %p, maxsize = %d, flags = %d, "
-      "data = %p\n", mem, maxsize, flags, vmem->map_address);
+      "data = %p\n", mem, maxsize, flags, vmem->dumb.map_address);
 
   if (flags & GST_MAP_READ)
     GST_DEBUG ("Mapping video memory for reading is slow.\n");
+  if ((flags & GST_MAP_READWRITE) == GST_MAP_READ)
+    gst_framebuffersink_video_memory_read (GST_FRAMEBUFFERSINK (
+        ((GstDrmSinkVideoMemoryAllocator *)mem->allocator)->drmsink));
 
 #ifdef LAZY_ALLOCATION
   if (!vmem->allocated) {
@@ -898,7 +1605,7 @@ gst_drmsink_video_memory_map (GstMemory * mem, gsize maxsize, GstMapFlags flags)
   }
 #endif
 
-  return vmem->map_address;
+  return vmem->dumb.map_address;
 }
 
 static gboolean
@@ -955,12 +1662,50 @@ gst_drmsink_video_memory_allocator_new (GstFramebufferSink *framebuffersink,
   return GST_ALLOCATOR_CAST (drmsink_video_memory_allocator);
 }
 
-/* DRM event related functions. */
+/* DRM event related functions. Page flip and vblank events are read from
+   the DRM device by a dedicated thread, which records the vblank sequence
+   number and time of each event and wakes up the streaming thread when it is
+   waiting for one. */
+
+/* Maximum time to wait for a single page flip or vblank event. */
+#define DRM_EVENT_TIMEOUT (100 * G_TIME_SPAN_MILLISECOND)
 
 static void
 gst_drmsink_vblank_handler (int fd, unsigned int sequence, unsigned int tv_sec,
     unsigned int tv_usec, void *user_data)
 {
+    GstDrmsink *drmsink = (GstDrmsink *)user_data;
+    drmsink->vblank_sequence = sequence;
+    drmsink->vblank_time = tv_sec * GST_SECOND + tv_usec * GST_USECOND;
+    drmsink->vblank_occurred = TRUE;
+    g_cond_broadcast (&drmsink->event_cond);
+}
+
+/* The sequence number and time of a frame are those of the flip of the
+   main crtc; the crtcs of extra outputs run off their own vblanks. Without
+   the crtc id in page flip events (libdrm before event context version 3),
+   the last flip of a frame is taken instead. */
+
+static void
+gst_drmsink_page_flip_completed (GstDrmsink *drmsink, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, gboolean main_crtc)
+{
+    if (main_crtc) {
+      drmsink->page_flip_sequence = sequence;
+      drmsink->page_flip_time = tv_sec * GST_SECOND + tv_usec * GST_USECOND;
+      GST_LOG_OBJECT (drmsink, "Page flip completed at vblank %u, time %"
+          GST_TIME_FORMAT, sequence, GST_TIME_ARGS (drmsink->page_flip_time));
+    }
+    /* With extra outputs, the frame has been flipped once every crtc has
+       flipped. */
+    if (drmsink->page_flips_queued > 0)
+      drmsink->page_flips_queued--;
+    if (drmsink->page_flips_queued > 0)
+      return;
+    drmsink->page_flip_occurred = TRUE;
+    drmsink->page_flip_pending = FALSE;
+    g_atomic_int_inc (&drmsink->page_flips_completed);
+    g_cond_broadcast (&drmsink->event_cond);
 }
 
 static void
@@ -968,86 +1713,212 @@ gst_drmsink_page_flip_handler (int fd,  unsigned int sequence,
     unsigned int tv_sec, unsigned int tv_usec, void *user_data)
 {
     GstDrmsink *drmsink = (GstDrmsink *)user_data;
-    drmsink->page_flip_occurred = TRUE;
-    if (drmsink->page_flip_pending)
-     drmsink->page_flip_pending = FALSE;
+    gst_drmsink_page_flip_completed (drmsink, sequence, tv_sec, tv_usec,
+        TRUE);
 }
 
-/* Flush queued drm events. */
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+static void
+gst_drmsink_page_flip_handler2 (int fd,  unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+    void *user_data)
+{
+    GstDrmsink *drmsink = (GstDrmsink *)user_data;
+    gst_drmsink_page_flip_completed (drmsink, sequence, tv_sec, tv_usec,
+        crtc_id == (unsigned int) drmsink->crtc_id);
+}
+#endif
+
+static gpointer
+gst_drmsink_event_thread (gpointer data)
+{
+  GstDrmsink *drmsink = (GstDrmsink *)data;
+  struct epoll_event events[2];
+  int i, n;
 
-static void gst_drmsink_flush_drm_events (GstDrmsink *drmsink) {
-  fd_set fds;
-  struct timeval tv;
-  /* Set the timeout to zero. */
-  memset (&tv, 0, sizeof (tv));
-  FD_ZERO (&fds);
   while (TRUE) {
-    FD_SET (drmsink->fd, &fds);
-    select (drmsink->fd + 1, &fds, NULL, NULL, &tv);
-    if (FD_ISSET (drmsink->fd, &fds))
-      drmHandleEvent(drmsink->fd, drmsink->event_context);
-    else
-      break;
+    n = epoll_wait (drmsink->event_epoll_fd, events, 2, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      GST_ERROR_OBJECT (drmsink, "epoll_wait failed: %s", strerror (errno));
+      return NULL;
+    }
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == drmsink->event_wakeup_fd)
+        return NULL;
+      g_mutex_lock (&drmsink->event_lock);
+      drmHandleEvent (drmsink->fd, drmsink->event_context);
+      g_mutex_unlock (&drmsink->event_lock);
+    }
   }
 }
 
-/* Wait until all pending page flips have finished. */
-
-static void gst_drmsink_wait_pending_drm_events (GstDrmsink *drmsink) {
-  fd_set fds;
-  struct timeval tv;
-  /* Set the timeout to zero. */
-  memset (&tv, 0, sizeof (tv));
-  FD_ZERO (&fds);
-  while (drmsink->page_flip_pending) {
-    FD_SET (drmsink->fd, &fds);
-    tv.tv_sec = 5;
-    select (drmsink->fd + 1, &fds, NULL, NULL, &tv);
-    if (FD_ISSET (drmsink->fd, &fds))
-      drmHandleEvent(drmsink->fd, drmsink->event_context);
-    else
-      break;
+static gboolean
+gst_drmsink_start_event_thread (GstDrmsink *drmsink)
+{
+  struct epoll_event event;
+
+  drmsink->event_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  drmsink->event_wakeup_fd = eventfd (0, EFD_CLOEXEC);
+  if (drmsink->event_epoll_fd < 0 || drmsink->event_wakeup_fd < 0)
+    goto fail;
+
+  memset (&event, 0, sizeof (event));
+  event.events = EPOLLIN;
+  event.data.fd = drmsink->fd;
+  if (epoll_ctl (drmsink->event_epoll_fd, EPOLL_CTL_ADD, drmsink->fd,
+      &event) < 0)
+    goto fail;
+  event.data.fd = drmsink->event_wakeup_fd;
+  if (epoll_ctl (drmsink->event_epoll_fd, EPOLL_CTL_ADD,
+      drmsink->event_wakeup_fd, &event) < 0)
+    goto fail;
+
+  drmsink->event_thread = g_thread_try_new ("drmsink-events",
+      gst_drmsink_event_thread, drmsink, NULL);
+  if (drmsink->event_thread == NULL)
+    goto fail;
+  return TRUE;
+
+fail:
+  GST_ERROR_OBJECT (drmsink, "Could not start DRM event thread: %s",
+      strerror (errno));
+  gst_drmsink_stop_event_thread (drmsink);
+  return FALSE;
+}
+
+static void
+gst_drmsink_stop_event_thread (GstDrmsink *drmsink)
+{
+  guint64 value = 1;
+
+  if (drmsink->event_thread != NULL) {
+    if (write (drmsink->event_wakeup_fd, &value, sizeof (value)) !=
+        sizeof (value))
+      GST_ERROR_OBJECT (drmsink, "Could not wake up DRM event thread");
+    g_thread_join (drmsink->event_thread);
+    drmsink->event_thread = NULL;
+  }
+  if (drmsink->event_wakeup_fd >= 0) {
+    close (drmsink->event_wakeup_fd);
+    drmsink->event_wakeup_fd = -1;
+  }
+  if (drmsink->event_epoll_fd >= 0) {
+    close (drmsink->event_epoll_fd);
+    drmsink->event_epoll_fd = -1;
   }
 }
 
+/* Wait until the pending page flip, if any, has completed. Returns FALSE if
+   it did not complete within the timeout. */
+
+static gboolean
+gst_drmsink_wait_page_flip (GstDrmsink *drmsink, gint64 timeout)
+{
+  gint64 end_time = g_get_monotonic_time () + timeout;
+  gboolean res = TRUE;
+
+  g_mutex_lock (&drmsink->event_lock);
+  while (drmsink->page_flip_pending)
+    if (!g_cond_wait_until (&drmsink->event_cond, &drmsink->event_lock,
+        end_time)) {
+      res = !drmsink->page_flip_pending;
+      break;
+    }
+  g_mutex_unlock (&drmsink->event_lock);
+  return res;
+}
+
 static void
 gst_drmsink_pan_display (GstFramebufferSink *framebuffersink,
     GstMemory *memory)
 {
   GstDrmsink *drmsink = GST_DRMSINK (framebuffersink);
   GstDrmSinkVideoMemory *vmem = (GstDrmSinkVideoMemory *)memory;
+  GstDrmsinkOutput *output;
   uint32_t connectors[1];
-  gchar *s;
+  GstClockTime begin;
+  gboolean flipped;
+  int i;
 
   GST_LOG_OBJECT (framebuffersink,
       "pan_display called, mem = %p, map_address = %p",
-      vmem, vmem->map_address);
+      vmem, vmem->dumb.map_address);
+
+  /* Wait for the previous page flip rather than dropping the frame. A flip
+     whose event never arrives is given up on, so that it cannot block all
+     further flips. */
+  begin = gst_framebuffersink_trace_begin (framebuffersink, "wait_page_flip");
+  flipped = gst_drmsink_wait_page_flip (drmsink, DRM_EVENT_TIMEOUT);
+  gst_framebuffersink_trace_end (framebuffersink, "wait_page_flip", begin);
+  if (!flipped) {
+    GST_WARNING_OBJECT (drmsink,
+        "pan_display: no event for previous page flip, assuming completed");
+    g_mutex_lock (&drmsink->event_lock);
+    drmsink->page_flips_queued = 0;
+    drmsink->page_flip_pending = FALSE;
+    g_mutex_unlock (&drmsink->event_lock);
+  }
 
+  /* Set the mode when showing the first frame, or after the mode was
+     changed to match the frame rate. */
   if (!drmsink->crtc_mode_initialized) {
     connectors[0] = drmsink->connector_id;
-    if (drmModeSetCrtc (drmsink->fd, drmsink->crtc_id, vmem->fb,
+    if (drmModeSetCrtc (drmsink->fd, drmsink->crtc_id, vmem->dumb.fb,
         0, 0, connectors, 1, &drmsink->mode)) {
       GST_ERROR_OBJECT (drmsink, "drmModeSetCrtc failed");
+      drmsink->page_flip_skipped = TRUE;
       return;
     }
+    for (i = 0; i < drmsink->nu_extra_outputs; i++) {
+      output = &drmsink->extra_outputs[i];
+      if (drmModeSetCrtc (drmsink->fd, output->crtc_id, vmem->dumb.fb,
+          output->x, 0, &output->connector_id, 1, &output->mode))
+        GST_ERROR_OBJECT (drmsink, "drmModeSetCrtc failed for connector %d",
+            output->connector_id);
+    }
     drmsink->crtc_mode_initialized = TRUE;
   }
 
-  gst_drmsink_flush_drm_events (drmsink);
-
-  if (drmsink->page_flip_pending) {
-    GST_INFO_OBJECT (drmsink,
-        "pan_display: previous page flip still pending, skipping");
-    return;
-  }
-
+  /* Flip all crtcs to the new frame. Since the next frame waits for all of
+     these flips, the outputs never drift apart by more than one frame. Each
+     output keeps the position in the framebuffer it was set up with. */
+  begin = gst_framebuffersink_trace_begin (framebuffersink, "drmModePageFlip");
+  g_mutex_lock (&drmsink->event_lock);
   drmsink->page_flip_occurred = FALSE;
-  drmsink->page_flip_pending = TRUE;
-  if (drmModePageFlip (drmsink->fd, drmsink->crtc_id, vmem->fb,
-      DRM_MODE_PAGE_FLIP_EVENT, drmsink)) {
-    GST_ERROR_OBJECT (drmsink, "drmModePageFlip failed");
-    return;
+  drmsink->page_flips_queued = 0;
+  if (drmModePageFlip (drmsink->fd, drmsink->crtc_id, vmem->dumb.fb,
+      DRM_MODE_PAGE_FLIP_EVENT, drmsink))
+    GST_ERROR_OBJECT (drmsink, "drmModePageFlip failed: %s",
+        strerror (errno));
+  else
+    drmsink->page_flips_queued++;
+  for (i = 0; i < drmsink->nu_extra_outputs; i++) {
+    output = &drmsink->extra_outputs[i];
+    if (drmModePageFlip (drmsink->fd, output->crtc_id, vmem->dumb.fb,
+        DRM_MODE_PAGE_FLIP_EVENT, drmsink))
+      GST_WARNING_OBJECT (drmsink, "drmModePageFlip failed for connector "
+          "%d: %s", output->connector_id, strerror (errno));
+    else
+      drmsink->page_flips_queued++;
   }
+  drmsink->page_flip_pending = drmsink->page_flips_queued > 0;
+  drmsink->page_flip_skipped = !drmsink->page_flip_pending;
+  g_mutex_unlock (&drmsink->event_lock);
+  gst_framebuffersink_trace_end (framebuffersink, "drmModePageFlip", begin);
+}
+
+/* A page flip is only queued once the previous one has completed, so the
+   buffer shown before the previous one is no longer scanned out. When the
+   flip was skipped, the frame never reaches the screen. */
+
+static gboolean
+gst_drmsink_frame_queued_for_scanout (GstFramebufferSink *framebuffersink)
+{
+  GstDrmsink *drmsink = GST_DRMSINK (framebuffersink);
+
+  return !drmsink->page_flip_skipped;
 }
 
 static void
@@ -1055,13 +1926,24 @@ gst_drmsink_wait_for_vsync (GstFramebufferSink *framebuffersink)
 {
   GstDrmsink *drmsink = GST_DRMSINK (framebuffersink);
   drmVBlank vbl;
-  fd_set fds;
-  struct timeval tv;
+  gint64 end_time;
 
   GST_INFO_OBJECT (drmsink, "wait_for_vsync called");
 
+  g_mutex_lock (&drmsink->event_lock);
   drmsink->vblank_occurred = FALSE;
   vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
   vbl.request.sequence = 1;
-  drmWaitVBlank(drmsink->fd, &vbl);
+  vbl.request.signal = (unsigned long) drmsink;
+  if (drmWaitVBlank(drmsink->fd, &vbl)) {
+    g_mutex_unlock (&drmsink->event_lock);
+    GST_ERROR_OBJECT (drmsink, "drmWaitVBlank failed: %s", strerror (errno));
+    return;
+  }
+  end_time = g_get_monotonic_time () + DRM_EVENT_TIMEOUT;
+  while (!drmsink->vblank_occurred)
+    if (!g_cond_wait_until (&drmsink->event_cond, &drmsink->event_lock,
+        end_time))
+      break;
+  g_mutex_unlock (&drmsink->event_lock);
 }
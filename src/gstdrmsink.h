@@ -41,6 +41,20 @@ G_BEGIN_DECLS
 typedef struct _GstDrmsink GstDrmsink;
 typedef struct _GstDrmsinkClass GstDrmsinkClass;
 
+#define GST_DRMSINK_MAX_EXTRA_OUTPUTS 4
+
+/* An output driven in addition to the main connector. It scans out the same
+   screen framebuffer as the main connector, starting at column x. */
+
+typedef struct
+{
+  uint32_t connector_id;
+  uint32_t crtc_id;
+  drmModeModeInfo mode;
+  drmModeCrtc *saved_crtc;
+  int x;
+} GstDrmsinkOutput;
+
 struct _GstDrmsink
 {
   GstFramebufferSink framebuffersink;
@@ -56,15 +70,55 @@ struct _GstDrmsink
   drmEventContext *event_context;
   drmModeCrtc *saved_crtc;
   gboolean crtc_mode_initialized;
+  /* Whether framebuffers are registered with an explicit (linear) modifier,
+     as listed in the IN_FORMATS property of the primary plane. */
+  gboolean use_modifiers;
   gboolean vblank_occurred;
   gboolean page_flip_pending;
   gboolean page_flip_occurred;
+  /* Number of page flips of the current frame (one per crtc) that have not
+     completed yet. */
+  int page_flips_queued;
+  /* Number of frames whose page flips have all completed. */
+  volatile guint page_flips_completed;
+  /* Set when the last pan_display did not queue a page flip. */
+  gboolean page_flip_skipped;
+  /* Vblank sequence number and time of the last page flip and vblank
+     events. */
+  unsigned int page_flip_sequence;
+  GstClockTime page_flip_time;
+  unsigned int vblank_sequence;
+  GstClockTime vblank_time;
+
+  /* Thread that handles DRM events. The event fields above are protected by
+     event_lock, and event_cond is signalled for every event. */
+  GThread *event_thread;
+  GMutex event_lock;
+  GCond event_cond;
+  int event_epoll_fd;
+  int event_wakeup_fd;
+
+  /* Dumb buffers that were freed, kept for reuse (most recently used
+     first), and their total size. */
+  GList *dumb_buffer_cache;
+  gsize dumb_buffer_cache_size;
+  /* Dumb buffers that were freed but may still be scanned out, until the
+     next page flip has completed. */
+  GList *dumb_buffers_pending_flip;
+  GMutex dumb_buffer_lock;
+  int stats_dumb_buffers_reused;
+
+  GstDrmsinkOutput extra_outputs[GST_DRMSINK_MAX_EXTRA_OUTPUTS];
+  int nu_extra_outputs;
 
   /* GST */
   GstVideoRectangle screen_rect;
 
   /* Properties */
   gint preferred_connector_id;
+  gint max_dumb_buffer_cache_property;
+  gchar *outputs_property;
+  gboolean span_outputs;
 };
 
 struct _GstDrmsinkClass
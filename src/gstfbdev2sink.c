@@ -95,6 +95,7 @@
 #include <gst/video/video.h>
 #include <gst/video/video-info.h>
 #include "gstfbdev2sink.h"
+#include "gstframebuffersinkkernels.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_fbdev2sink_debug_category);
 #define GST_CAT_DEFAULT gst_fbdev2sink_debug_category
@@ -161,6 +162,8 @@ gst_fbdev2sink_init (GstFbdev2sink *fbdev2sink) {
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  gst_framebuffersink_kernels_init ();
+
   /* Remember to set the rank if it's an element that is meant
      to be autoplugged by decodebin. */
   return gst_element_register (plugin, "fbdev2sink", GST_RANK_NONE,
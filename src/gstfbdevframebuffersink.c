@@ -102,6 +102,9 @@ static void gst_fbdevframebuffersink_get_property (GObject * object,
 static GstAllocator *gst_fbdevframebuffersink_video_memory_allocator_new (
     GstFramebufferSink *framebuffersink, GstVideoInfo *info, gboolean pannable,
     gboolean is_overlay);
+static gboolean gst_fbdevframebuffersink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info);
 static void gst_fbdevframebuffersink_pan_display (
     GstFramebufferSink *framebuffersink, GstMemory *memory);
 static void gst_fbdevframebuffersink_wait_for_vsync (
@@ -112,9 +115,12 @@ static void gst_fbdevframebuffersink_pan_display_fbdev (
     GstFbdevFramebufferSink *fbdevframebuffersink, int x, int y);
 
 /* Standard video memory implementation. */
-static void gst_fbdevframebuffersink_video_memory_init (gpointer framebuffer,
-    gsize map_size);
-static void gst_fbdevframebuffersink_video_memory_finalize ();
+static gboolean gst_fbdevframebuffersink_video_memory_share (
+    GstFbdevFramebufferSink *fbdevframebuffersink);
+static void gst_fbdevframebuffersink_video_memory_init (
+    GstFbdevFramebufferSink *fbdevframebuffersink, gboolean shared);
+static gboolean gst_fbdevframebuffersink_video_memory_finalize (
+    GstFbdevFramebufferSink *fbdevframebuffersink);
 
 enum
 {
@@ -147,6 +153,9 @@ gst_fbdevframebuffersink_class_init (GstFbdevFramebufferSinkClass* klass)
       GST_DEBUG_FUNCPTR (gst_fbdevframebuffersink_close_hardware);
   framebuffer_sink_class->video_memory_allocator_new =
       GST_DEBUG_FUNCPTR (gst_fbdevframebuffersink_video_memory_allocator_new);
+  framebuffer_sink_class->video_memory_allocator_is_reusable =
+      GST_DEBUG_FUNCPTR (
+      gst_fbdevframebuffersink_video_memory_allocator_is_reusable);
   framebuffer_sink_class->pan_display =
       GST_DEBUG_FUNCPTR (gst_fbdevframebuffersink_pan_display);
   framebuffer_sink_class->wait_for_vsync =
@@ -195,6 +204,11 @@ gst_fbdevframebuffersink_set_property (GObject * object, guint property_id,
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
   }
+
+  GST_OBJECT_LOCK (fbdevframebuffersink);
+  gst_framebuffersink_clear_caps_cache (
+      GST_FRAMEBUFFERSINK (fbdevframebuffersink));
+  GST_OBJECT_UNLOCK (fbdevframebuffersink);
 }
 
 static void
@@ -262,6 +276,7 @@ gst_fbdevframebuffersink_open_hardware (GstFramebufferSink *framebuffersink,
   GstVideoFormat framebuffer_format;
   GstVideoAlignment align;
   int max_framebuffers;
+  gboolean shared_mapping = FALSE;
   struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
   SunxiMemOpen(ops);
   fbdevframebuffersink->fd = open (framebuffersink->device, O_RDWR);
@@ -312,7 +327,14 @@ gst_fbdevframebuffersink_open_hardware (GstFramebufferSink *framebuffersink,
       fbdevframebuffersink->framebuffer_map_size = fixinfo.line_length
           * varinfo.yres;
   }
-  if (framebuffersink->max_video_memory_property <= 0) {
+  /* When another instance has already mapped this device, adopt its mapping
+     so that the buffers of both instances are allocated from the same
+     storage. */
+  fbdevframebuffersink->video_memory_storage = NULL;
+  if (framebuffersink->max_video_memory_property <= 0)
+    shared_mapping =
+        gst_fbdevframebuffersink_video_memory_share (fbdevframebuffersink);
+  if (framebuffersink->max_video_memory_property <= 0 && !shared_mapping) {
 	fbdevframebuffersink->framebuffer = mmap (0,
 	  fbdevframebuffersink->framebuffer_map_size,
 	  PROT_WRITE, MAP_SHARED, fbdevframebuffersink->fd, 0);
@@ -320,7 +342,7 @@ gst_fbdevframebuffersink_open_hardware (GstFramebufferSink *framebuffersink,
 	close (fbdevframebuffersink->fd);
 	goto err;
 	}
-  } else {
+  } else if (framebuffersink->max_video_memory_property > 0) {
 	fbdevframebuffersink->framebuffer = SunxiMemPalloc(ops,fbdevframebuffersink->framebuffer_map_size);
   }
 
@@ -382,10 +404,17 @@ gst_fbdevframebuffersink_open_hardware (GstFramebufferSink *framebuffersink,
   fbdevframebuffersink->fixinfo = fixinfo;
   fbdevframebuffersink->varinfo = varinfo;
 
-  /* Make sure all framebuffers can be panned to. */
+  /* Make sure all framebuffers can be panned to. The display start belongs
+     to the instance that mapped the device first; an instance sharing its
+     mapping uses a single screen buffer and never pans, and leaves the
+     virtual size alone. */
   max_framebuffers = fbdevframebuffersink->framebuffer_map_size /
       GST_VIDEO_INFO_SIZE (info);
-  if (fbdevframebuffersink->varinfo.yres_virtual < max_framebuffers *
+  if (shared_mapping) {
+    max_framebuffers = 1;
+    *pannable_video_memory_size = GST_VIDEO_INFO_SIZE (info);
+  }
+  else if (fbdevframebuffersink->varinfo.yres_virtual < max_framebuffers *
       GST_VIDEO_INFO_HEIGHT (info)
       && !gst_fbdevframebuffersink_set_device_virtual_size(fbdevframebuffersink,
       fbdevframebuffersink->varinfo.xres_virtual,
@@ -400,8 +429,9 @@ gst_fbdevframebuffersink_open_hardware (GstFramebufferSink *framebuffersink,
     *pannable_video_memory_size = max_framebuffers * GST_VIDEO_INFO_SIZE (info);
 
   /* Initialize video memory. */
-  gst_fbdevframebuffersink_video_memory_init(fbdevframebuffersink->framebuffer,
-      fbdevframebuffersink->framebuffer_map_size);
+  if (fbdevframebuffersink->video_memory_storage == NULL)
+    gst_fbdevframebuffersink_video_memory_init(fbdevframebuffersink,
+        framebuffersink->max_video_memory_property <= 0);
 
   {
     gchar *s = g_strdup_printf("Succesfully opened fbdev framebuffer device %s, "
@@ -460,18 +490,17 @@ gst_fbdevframebuffersink_close_hardware (GstFramebufferSink *framebuffersink)
   GST_OBJECT_LOCK (fbdevframebuffersink);
   if(framebuffersink->max_video_memory_property <= 0)
   {
-	  /* Video memory buffers should already be freed. */
-	  gst_fbdevframebuffersink_video_memory_finalize ();
-
-	  gst_fbdevframebuffersink_pan_display_fbdev(fbdevframebuffersink, 0, 0);
-
-	  if (munmap (fbdevframebuffersink->framebuffer,
-	      fbdevframebuffersink->framebuffer_map_size))
-	    GST_ERROR_OBJECT (fbdevframebuffersink, "Could not unmap video memory");
+	  /* The mapping is released together with the storage once the last
+	     instance and the last video memory using it are gone. Only the last
+	     instance using the device resets the display start, so that the
+	     others keep showing their screens. */
+	  if (gst_fbdevframebuffersink_video_memory_finalize (fbdevframebuffersink))
+	    gst_fbdevframebuffersink_pan_display_fbdev(fbdevframebuffersink, 0, 0);
 	  close (fbdevframebuffersink->fd);
   }
   else
   {
+      gst_fbdevframebuffersink_video_memory_finalize (fbdevframebuffersink);
       SunxiMemPfree(ops,fbdevframebuffersink->framebuffer);
       SunxiMemClose(ops);
   }
@@ -601,6 +630,9 @@ typedef struct
 #ifdef LAZY_ALLOCATION
   gboolean allocated;
 #endif
+  /* Set when the memory has been mapped for writing since the last call to
+     gst_fbdevframebuffersink_video_memory_take_dirty. */
+  gboolean dirty;
 } GstFbdevFramebufferSinkVideoMemory;
 
 #ifdef LAZY_ALLOCATION
@@ -608,6 +640,8 @@ static GstMemory *gst_fbdevframebuffersink_video_memory_allocator_alloc_actual (
     GstAllocator *allocator, gsize size, GstAllocationParams *allocation_params,
     GstFbdevFramebufferSinkVideoMemory *mem);
 #endif
+static void gst_fbdevframebuffersink_video_memory_allocator_read (
+    GstAllocator *allocator);
 
 static gpointer
 gst_fbdevframebuffersink_video_memory_map (GstMemory *mem, gsize maxsize,
@@ -623,6 +657,11 @@ gst_fbdevframebuffersink_video_memory_map (GstMemory *mem, gsize maxsize,
     GST_DEBUG ("Mapping video memory for reading is slow.\n");
 #endif
 
+  if ((flags & GST_MAP_READWRITE) == GST_MAP_READ)
+    gst_fbdevframebuffersink_video_memory_allocator_read (mem->allocator);
+  if (flags & GST_MAP_WRITE)
+    vmem->dirty = TRUE;
+
 #ifdef LAZY_ALLOCATION
   if (!vmem->allocated) {
     if (!gst_fbdevframebuffersink_video_memory_allocator_alloc_actual (
@@ -641,6 +680,18 @@ gst_fbdevframebuffersink_video_memory_unmap (GstMemory * mem)
   return;
 }
 
+/* The following member function is exported for use by derived subclasses. */
+gboolean
+gst_fbdevframebuffersink_video_memory_take_dirty (GstMemory *memory)
+{
+  GstFbdevFramebufferSinkVideoMemory *vmem =
+      (GstFbdevFramebufferSinkVideoMemory *) memory;
+  gboolean dirty = vmem->dirty;
+
+  vmem->dirty = FALSE;
+  return dirty;
+}
+
 /* Video memory storage. */
 
 typedef struct {
@@ -658,37 +709,130 @@ typedef struct {
   gsize total_allocated;
   /* Maintain a sorted linked list of allocated memory regions. */
   GList *chain;
+  /* The device for storages of a mapped framebuffer that can be shared
+     between instances, NULL otherwise. */
+  gchar *device;
+  /* Sink instances using the storage. Allocators hold references as well,
+     so this is counted separately. Protected by the
+     shared_video_memory_storages lock. */
+  guint users;
 } GstFbdevFramebufferSinkVideoMemoryStorage;
 
 GType gst_fbdev_framebuffer_sink_video_memory_storage_get_type (void);
 GST_DEFINE_MINI_OBJECT_TYPE (GstFbdevFramebufferSinkVideoMemoryStorage,
     gst_fbdev_framebuffer_sink_video_memory_storage);
 
-static GstFbdevFramebufferSinkVideoMemoryStorage *video_memory_storage;
+/* Storages of mapped framebuffer devices. Several sink instances (for example
+   one per stream, each shown in its own hardware overlay) may drive the same
+   device; they share a single mapping and allocate from the same storage so
+   that their buffers never overlap. */
+G_LOCK_DEFINE_STATIC (shared_video_memory_storages);
+static GList *shared_video_memory_storages = NULL;
 
 static void
-gst_fbdevframebuffersink_video_memory_init (gpointer framebuffer,
-gsize framebuffer_size)
+gst_fbdevframebuffersink_video_memory_storage_free (GstMiniObject *obj)
 {
-  video_memory_storage = g_slice_new (
-      GstFbdevFramebufferSinkVideoMemoryStorage);
-  gst_mini_object_init (GST_MINI_OBJECT_CAST (video_memory_storage),
+  GstFbdevFramebufferSinkVideoMemoryStorage *storage =
+      (GstFbdevFramebufferSinkVideoMemoryStorage *) obj;
+
+  /* Called with the shared_video_memory_storages lock held. */
+  if (storage->device != NULL) {
+    shared_video_memory_storages = g_list_remove (
+        shared_video_memory_storages, storage);
+    if (munmap (storage->framebuffer, storage->framebuffer_size))
+      GST_ERROR ("Could not unmap video memory");
+    g_free (storage->device);
+  }
+  if (storage->chain != NULL)
+    GST_ERROR ("%zd bytes of video memory still allocated",
+        storage->total_allocated);
+  while (storage->chain != NULL) {
+    g_slice_free (ChainEntry, storage->chain->data);
+    storage->chain = g_list_delete_link (storage->chain, storage->chain);
+  }
+  g_slice_free (GstFbdevFramebufferSinkVideoMemoryStorage, storage);
+}
+
+/* Look for the storage of an instance that has already mapped the same
+   device. If found, adopt its mapping. */
+
+static gboolean
+gst_fbdevframebuffersink_video_memory_share (
+    GstFbdevFramebufferSink *fbdevframebuffersink)
+{
+  GstFramebufferSink *framebuffersink =
+      GST_FRAMEBUFFERSINK (fbdevframebuffersink);
+  GList *list;
+
+  G_LOCK (shared_video_memory_storages);
+  for (list = shared_video_memory_storages; list != NULL;
+      list = g_list_next (list)) {
+    GstFbdevFramebufferSinkVideoMemoryStorage *storage = list->data;
+    if (strcmp (storage->device, framebuffersink->device) == 0) {
+      fbdevframebuffersink->video_memory_storage =
+          gst_mini_object_ref (GST_MINI_OBJECT_CAST (storage));
+      storage->users++;
+      fbdevframebuffersink->framebuffer = storage->framebuffer;
+      fbdevframebuffersink->framebuffer_map_size = storage->framebuffer_size;
+      break;
+    }
+  }
+  G_UNLOCK (shared_video_memory_storages);
+
+  return fbdevframebuffersink->video_memory_storage != NULL;
+}
+
+static void
+gst_fbdevframebuffersink_video_memory_init (
+    GstFbdevFramebufferSink *fbdevframebuffersink, gboolean shared)
+{
+  GstFbdevFramebufferSinkVideoMemoryStorage *storage;
+
+  storage = g_slice_new (GstFbdevFramebufferSinkVideoMemoryStorage);
+  gst_mini_object_init (GST_MINI_OBJECT_CAST (storage),
       GST_MINI_OBJECT_FLAG_LOCKABLE,
       gst_fbdev_framebuffer_sink_video_memory_storage_get_type (),
-      NULL, NULL, NULL);
-  video_memory_storage->framebuffer = framebuffer;
-  video_memory_storage->framebuffer_size = framebuffer_size;
-  video_memory_storage->total_allocated = 0;
-  video_memory_storage->end_marker = 0;
-  video_memory_storage->chain = NULL;
+      NULL, NULL, gst_fbdevframebuffersink_video_memory_storage_free);
+  storage->framebuffer = fbdevframebuffersink->framebuffer;
+  storage->framebuffer_size = fbdevframebuffersink->framebuffer_map_size;
+  storage->total_allocated = 0;
+  storage->end_marker = 0;
+  storage->chain = NULL;
+  storage->device = NULL;
+  storage->users = 1;
+  if (shared) {
+    storage->device = g_strdup (
+        GST_FRAMEBUFFERSINK (fbdevframebuffersink)->device);
+    G_LOCK (shared_video_memory_storages);
+    shared_video_memory_storages = g_list_prepend (
+        shared_video_memory_storages, storage);
+    G_UNLOCK (shared_video_memory_storages);
+  }
+  fbdevframebuffersink->video_memory_storage = GST_MINI_OBJECT_CAST (storage);
 }
 
-static void
-gst_fbdevframebuffersink_video_memory_finalize ()
+/* Drop the instance's reference to the storage. Returns TRUE when it was
+   the last instance using it. */
+
+static gboolean
+gst_fbdevframebuffersink_video_memory_finalize (
+    GstFbdevFramebufferSink *fbdevframebuffersink)
 {
-  gst_mini_object_unref (GST_MINI_OBJECT_CAST (video_memory_storage));
-  g_slice_free (GstFbdevFramebufferSinkVideoMemoryStorage,
-     video_memory_storage);
+  GstFbdevFramebufferSinkVideoMemoryStorage *storage =
+      (GstFbdevFramebufferSinkVideoMemoryStorage *)
+      fbdevframebuffersink->video_memory_storage;
+  gboolean last;
+
+  if (storage == NULL)
+    return TRUE;
+  /* Hold the lock so that a concurrent lookup can't pick up a storage that
+     is being freed. */
+  G_LOCK (shared_video_memory_storages);
+  last = --storage->users == 0;
+  gst_mini_object_unref (GST_MINI_OBJECT_CAST (storage));
+  G_UNLOCK (shared_video_memory_storages);
+  fbdevframebuffersink->video_memory_storage = NULL;
+  return last;
 }
 
 /* Video memory allocator implementation that uses fbdev video memory. */
@@ -697,6 +841,11 @@ typedef struct
 {
   GstAllocator parent;
   GstAllocationParams params;
+  GstFbdevFramebufferSinkVideoMemoryStorage *storage;
+  /* The allocator is registered globally and can outlive the sink, so it
+     only holds a weak reference to it, and its own reference to the
+     storage. */
+  GWeakRef framebuffersink;
 } GstFbdevFramebufferSinkVideoMemoryAllocator;
 
 typedef struct
@@ -708,6 +857,24 @@ GType gst_fbdevframebuffersink_video_memory_allocator_get_type (void);
 G_DEFINE_TYPE (GstFbdevFramebufferSinkVideoMemoryAllocator,
     gst_fbdevframebuffersink_video_memory_allocator, GST_TYPE_ALLOCATOR);
 
+/* Report a read mapping to the sink for readback detection. */
+
+static void
+gst_fbdevframebuffersink_video_memory_allocator_read (GstAllocator *allocator)
+{
+  GstFbdevFramebufferSinkVideoMemoryAllocator *
+      fbdevframebuffersink_video_memory_allocator =
+      (GstFbdevFramebufferSinkVideoMemoryAllocator *)allocator;
+  GstFramebufferSink *framebuffersink;
+
+  framebuffersink = g_weak_ref_get (
+      &fbdevframebuffersink_video_memory_allocator->framebuffersink);
+  if (framebuffersink == NULL)
+    return;
+  gst_framebuffersink_video_memory_read (framebuffersink);
+  gst_object_unref (framebuffersink);
+}
+
 #ifdef LAZY_ALLOCATION
 static GstMemory *
 gst_fbdevframebuffersink_video_memory_allocator_alloc (GstAllocator *allocator,
@@ -725,6 +892,7 @@ gst_fbdevframebuffersink_video_memory_allocator_alloc (GstAllocator *allocator,
       size);
   mem->allocated = FALSE;
   mem->data = NULL;
+  mem->dirty = FALSE;
   return GST_MEMORY_CAST (mem);
 }
 #endif
@@ -747,11 +915,13 @@ gst_fbdevframebuffersink_video_memory_allocator_alloc (GstAllocator *allocator,
   GstAllocationParams *params;
   int align_bytes;
   guintptr framebuffer_offset;
+  GstFbdevFramebufferSinkVideoMemoryStorage *video_memory_storage;
   GList *chain;
   ChainEntry *chain_entry;
 
   GST_DEBUG ("alloc frame %lu", size);
 
+  video_memory_storage = fbdevframebuffersink_allocator->storage;
   gst_mini_object_lock (GST_MINI_OBJECT_CAST (video_memory_storage),
       GST_LOCK_FLAG_EXCLUSIVE);
 
@@ -803,6 +973,7 @@ gst_fbdevframebuffersink_video_memory_allocator_alloc (GstAllocator *allocator,
   gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_NO_SHARE |
       GST_MEMORY_FLAG_VIDEO_MEMORY, allocator, NULL, size, params->align, 0,
       size);
+  mem->dirty = FALSE;
 #endif
 
   mem->data = video_memory_storage->framebuffer + framebuffer_offset;
@@ -843,6 +1014,8 @@ gst_fbdevframebuffersink_video_memory_allocator_free (GstAllocator * allocator,
 {
   GstFbdevFramebufferSinkVideoMemory *vmem =
       (GstFbdevFramebufferSinkVideoMemory *) mem;
+  GstFbdevFramebufferSinkVideoMemoryStorage *video_memory_storage =
+      ((GstFbdevFramebufferSinkVideoMemoryAllocator *) allocator)->storage;
   GList *chain;
 
 #ifdef LAZY_ALLOCATION
@@ -891,11 +1064,32 @@ gst_fbdevframebuffersink_video_memory_allocator_free (GstAllocator * allocator,
   GST_ERROR ("video_memory_free failed");
 }
 
+static void
+gst_fbdevframebuffersink_video_memory_allocator_finalize (GObject *object)
+{
+  GstFbdevFramebufferSinkVideoMemoryAllocator *
+      fbdevframebuffersink_video_memory_allocator =
+      (GstFbdevFramebufferSinkVideoMemoryAllocator *) object;
+
+  g_weak_ref_clear (
+      &fbdevframebuffersink_video_memory_allocator->framebuffersink);
+  G_LOCK (shared_video_memory_storages);
+  gst_mini_object_unref (GST_MINI_OBJECT_CAST (
+      fbdevframebuffersink_video_memory_allocator->storage));
+  G_UNLOCK (shared_video_memory_storages);
+
+  G_OBJECT_CLASS (gst_fbdevframebuffersink_video_memory_allocator_parent_class)
+      ->finalize (object);
+}
+
 static void
 gst_fbdevframebuffersink_video_memory_allocator_class_init (
      GstFbdevFramebufferSinkVideoMemoryAllocatorClass * klass) {
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GstAllocatorClass * allocator_class = GST_ALLOCATOR_CLASS (klass);
 
+  gobject_class->finalize =
+      gst_fbdevframebuffersink_video_memory_allocator_finalize;
   allocator_class->alloc =
       gst_fbdevframebuffersink_video_memory_allocator_alloc;
   allocator_class->free = gst_fbdevframebuffersink_video_memory_allocator_free;
@@ -926,6 +1120,11 @@ gst_fbdevframebuffersink_video_memory_allocator_new (GstFramebufferSink *
   gst_fbdevframebuffersink_allocation_params_init (fbdevframebuffersink,
       &fbdevframebuffersink_video_memory_allocator->params, pannable,
       is_overlay);
+  fbdevframebuffersink_video_memory_allocator->storage =
+      (GstFbdevFramebufferSinkVideoMemoryStorage *) gst_mini_object_ref (
+      fbdevframebuffersink->video_memory_storage);
+  g_weak_ref_init (&fbdevframebuffersink_video_memory_allocator->framebuffersink,
+      framebuffersink);
 
   g_sprintf (s, "fbdevframebuffersink_video_memory_%p",
       fbdevframebuffersink_video_memory_allocator);
@@ -934,3 +1133,28 @@ gst_fbdevframebuffersink_video_memory_allocator_new (GstFramebufferSink *
 
   return GST_ALLOCATOR_CAST (fbdevframebuffersink_video_memory_allocator);
 }
+
+/* An overlay allocator only depends on the overlay alignment, so it can be
+   reused when its alignment is at least as strict as the one required now. */
+
+static gboolean
+gst_fbdevframebuffersink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info)
+{
+  GstFbdevFramebufferSink *fbdevframebuffersink =
+      GST_FBDEVFRAMEBUFFERSINK (framebuffersink);
+  GstFbdevFramebufferSinkVideoMemoryAllocator *
+      fbdevframebuffersink_video_memory_allocator;
+
+  if (!G_TYPE_CHECK_INSTANCE_TYPE (allocator,
+      gst_fbdevframebuffersink_video_memory_allocator_get_type ()))
+    return FALSE;
+  fbdevframebuffersink_video_memory_allocator =
+      (GstFbdevFramebufferSinkVideoMemoryAllocator *) allocator;
+  return fbdevframebuffersink_video_memory_allocator->storage ==
+      (GstFbdevFramebufferSinkVideoMemoryStorage *)
+      fbdevframebuffersink->video_memory_storage &&
+      (framebuffersink->overlay_align &
+      ~fbdevframebuffersink_video_memory_allocator->params.align) == 0;
+}
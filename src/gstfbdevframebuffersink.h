@@ -61,6 +61,9 @@ struct _GstFbdevFramebufferSink
   struct fb_fix_screeninfo fixinfo;
   struct fb_var_screeninfo varinfo;
   int saved_kd_mode;
+  /* Video memory storage the allocators carve buffers out of; shared by all
+     instances that map the same device. */
+  GstMiniObject *video_memory_storage;
 };
 
 struct _GstFbdevFramebufferSinkClass
@@ -76,6 +79,11 @@ gboolean gst_fbdevframebuffersink_open_hardware (
 void gst_fbdevframebuffersink_close_hardware (
     GstFramebufferSink *framebuffersink);
 
+/* Returns whether a video memory object allocated by the fbdev allocator has
+   been mapped for writing since the last call, and clears the flag. Used by
+   subclasses to skip cache maintenance for memory the CPU didn't write. */
+gboolean gst_fbdevframebuffersink_video_memory_take_dirty (GstMemory *memory);
+
 G_END_DECLS
 
 #endif
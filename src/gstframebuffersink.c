@@ -67,6 +67,9 @@
 #include <stdint.h>
 #include <math.h>
 #include <glib/gprintf.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 #include <gst/gst.h>
 #include <gst/video/gstvideosink.h>
@@ -74,7 +77,9 @@
 #include <gst/video/video.h>
 #include <gst/video/video-info.h>
 #include <gst/video/gstvideometa.h>
+#include <gst/video/videooverlay.h>
 #include "gstframebuffersink.h"
+#include "gstframebuffersinkkernels.h"
 #include <ion_mem_alloc.h>
 
 GST_DEBUG_CATEGORY_STATIC (gst_framebuffersink_debug_category);
@@ -83,13 +88,21 @@ GST_DEBUG_CATEGORY_STATIC (gst_framebuffersink_debug_category);
 static GstVideoSinkClass *parent_class = NULL;
 
 /* Definitions to influence buffer pool allocation.
-  Provide another video memory pool for repeated requests. */
-#define MULTIPLE_VIDEO_MEMORY_POOLS
+  Whether another video memory pool is provided for repeated requests is
+  controlled by the multiple-pools property. */
 /* Provide half of the available video memory pool buffers per request. */
 /* #define HALF_POOLS */
 
 //#define INCLUDE_PRESERVE_PAR_PROPERTY
 
+/* Maximum number of threads copying overlay frames into video memory. */
+#define MAX_UPLOAD_THREADS 8
+
+/* Number of shown video memory buffers the sink keeps a reference to (the
+   size of scanout_buffers). A pool needs at least one buffer more for
+   upstream to render into, or acquiring a buffer blocks forever. */
+#define SCANOUT_HELD_BUFFERS 2
+
 /* Function to produce informational output if silent property is not set;
    if the silent property is set only debugging info is produced. */
 static void
@@ -137,14 +150,35 @@ static void gst_framebuffersink_close_hardware (GstFramebufferSink
 static GstAllocator *gst_framebuffersink_video_memory_allocator_new (
     GstFramebufferSink *framebuffersink, GstVideoInfo *info, gboolean pannable,
     gboolean is_overlay);
+static gboolean gst_framebuffersink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info);
 static void gst_framebuffersink_pan_display (GstFramebufferSink *
     framebuffersink, GstMemory *memory);
+static gboolean gst_framebuffersink_frame_queued_for_scanout (
+    GstFramebufferSink *framebuffersink);
+static void gst_framebuffersink_match_display_mode (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info);
 static void gst_framebuffersink_wait_for_vsync (GstFramebufferSink *
     framebuffersink);
+static GstFlowReturn gst_framebuffersink_show_overlay_physical (
+    GstFramebufferSink *framebuffersink,
+    GstFramebufferSinkPhysicalAddressMeta *meta);
+
+/* Trace points. */
+static void gst_framebuffersink_trace_init (void);
 
 /* Video memory. */
 static gboolean gst_framebuffersink_is_video_memory (GstFramebufferSink *
     framebuffersink, GstMemory *mem);
+static GstMemory *gst_framebuffersink_alloc_video_memory (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator, gsize size);
+static GstAllocator *gst_framebuffersink_get_overlay_allocator (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info);
+
+/* GstVideoOverlay interface. */
+static void gst_framebuffersink_video_overlay_init (
+    GstVideoOverlayInterface *iface);
 
 enum
 {
@@ -176,6 +210,14 @@ enum
   PROP_OVERLAY_FORMAT,
   PROP_BENCHMARK,
   PROP_ROTATE_ANGLE,
+  PROP_ADAPTIVE_POOL,
+  PROP_MIN_POOL_BUFFERS,
+  PROP_MULTIPLE_POOLS,
+  PROP_MATCH_REFRESH_RATE,
+  PROP_STAGING_HUGEPAGES,
+  PROP_UPLOAD_THREADS,
+  PROP_BOB,
+  PROP_FRAME_CHECKSUM,
 };
 
 /* pad templates */
@@ -202,6 +244,20 @@ static GstVideoFormat overlay_formats_supported_table_empty[] = {
   GST_VIDEO_FORMAT_UNKNOWN
 };
 
+/* Formats that are converted while uploading into an overlay format with the
+   same planes when the overlay doesn't support them: the chroma planes of
+   I420 are interleaved, 10-bit samples are narrowed to 8 bits by the given
+   right shift. */
+static const struct {
+  GstVideoFormat format;
+  GstVideoFormat overlay_format;
+  int narrow_shift;
+} overlay_upload_conversions[] = {
+  { GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_NV12, 0 },
+  { GST_VIDEO_FORMAT_P010_10LE, GST_VIDEO_FORMAT_NV12, 8 },
+  { GST_VIDEO_FORMAT_Y444_10LE, GST_VIDEO_FORMAT_Y444, 2 }
+};
+
 /* Class initialization. */
 
 static void
@@ -344,6 +400,44 @@ gst_framebuffersink_class_init (GstFramebufferSinkClass* klass)
       "4:horizontal flip 6:vertical flip"
       ,
       0, 6, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ADAPTIVE_POOL,
+      g_param_spec_boolean ("adaptive-pool", "Adaptive buffer pool",
+      "Size the video memory buffer pool to the measured pipeline depth and "
+      "free unused buffers, instead of using all buffers that fit in video "
+      "memory", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MIN_POOL_BUFFERS,
+      g_param_spec_int ("min-pool-buffers", "Minimum pool buffers",
+      "Minimum number of buffers kept in an adaptive buffer pool",
+      1, G_MAXINT, 3, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MULTIPLE_POOLS,
+      g_param_spec_boolean ("multiple-pools", "Multiple buffer pools",
+      "Provide another video memory buffer pool when upstream asks again, "
+      "as long as video memory is available, instead of falling back to "
+      "system memory", TRUE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MATCH_REFRESH_RATE,
+      g_param_spec_boolean ("match-refresh-rate", "Match refresh rate",
+      "Switch to the display mode whose refresh rate best matches the frame "
+      "rate of the stream (if supported)", FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STAGING_HUGEPAGES,
+      g_param_spec_boolean ("staging-hugepages", "Staging hugepages",
+      "Back system memory pool buffers with transparent huge pages when they "
+      "are large enough", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_UPLOAD_THREADS,
+      g_param_spec_int ("upload-threads", "Upload threads",
+      "Number of threads copying overlay frames into video memory "
+      "(0 = one per CPU core, up to 4)", 0, MAX_UPLOAD_THREADS, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_BOB,
+      g_param_spec_boolean ("bob", "Bob",
+      "Show interlaced video one field at a time at the field rate, even "
+      "when the display engine can deinterlace", FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FRAME_CHECKSUM,
+      g_param_spec_boolean ("frame-checksum", "Frame checksum",
+      "Post an element message with the CRC-32C of each frame as handed to "
+      "the display (for automated testing)", FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   element_class->change_state = GST_DEBUG_FUNCPTR (
       gst_framebuffersink_change_state);
@@ -361,11 +455,21 @@ gst_framebuffersink_class_init (GstFramebufferSinkClass* klass)
       gst_framebuffersink_close_hardware);
   klass->video_memory_allocator_new = GST_DEBUG_FUNCPTR (
       gst_framebuffersink_video_memory_allocator_new);
+  klass->video_memory_allocator_is_reusable = GST_DEBUG_FUNCPTR (
+      gst_framebuffersink_video_memory_allocator_is_reusable);
   klass->pan_display = GST_DEBUG_FUNCPTR (gst_framebuffersink_pan_display);
   klass->wait_for_vsync = GST_DEBUG_FUNCPTR (
       gst_framebuffersink_wait_for_vsync);
+  klass->frame_queued_for_scanout = GST_DEBUG_FUNCPTR (
+      gst_framebuffersink_frame_queued_for_scanout);
+  klass->match_display_mode = GST_DEBUG_FUNCPTR (
+      gst_framebuffersink_match_display_mode);
+  klass->show_overlay_physical = GST_DEBUG_FUNCPTR (
+      gst_framebuffersink_show_overlay_physical);
   klass->get_supported_overlay_formats = GST_DEBUG_FUNCPTR (
       gst_framebuffersink_get_supported_overlay_formats);
+
+  gst_framebuffersink_trace_init ();
 }
 
 static void
@@ -381,6 +485,8 @@ static void
 gst_framebuffersink_init (GstFramebufferSink *framebuffersink) {
   framebuffersink->pool = NULL;
   framebuffersink->caps = NULL;
+  framebuffersink->default_caps_cache = NULL;
+  framebuffersink->caps_cache = NULL;
   /* This will set the format to GST_VIDEO_FORMAT_UNKNOWN. */
   gst_video_info_init (&framebuffersink->screen_info);
   gst_video_info_init (&framebuffersink->video_info);
@@ -418,6 +524,14 @@ gst_framebuffersink_init (GstFramebufferSink *framebuffersink) {
   framebuffersink->max_video_memory_property = 12;
   framebuffersink->preferred_overlay_format_str = NULL;
   framebuffersink->benchmark = FALSE;
+  framebuffersink->adaptive_pool = FALSE;
+  framebuffersink->min_pool_buffers = 3;
+  framebuffersink->multiple_pools = TRUE;
+  framebuffersink->match_refresh_rate = FALSE;
+  framebuffersink->staging_hugepages = FALSE;
+  framebuffersink->upload_threads_property = 0;
+  framebuffersink->bob = FALSE;
+  framebuffersink->frame_checksum = FALSE;
 }
 
 /* Default implementation of hardware open/close functions. */
@@ -452,6 +566,33 @@ gst_framebuffersink_wait_for_vsync (GstFramebufferSink *framebuffersink)
 {
 }
 
+/* Default implementation of frame_queued_for_scanout: the display latches
+   every new address at the next vertical blank. */
+
+static gboolean
+gst_framebuffersink_frame_queued_for_scanout (GstFramebufferSink *
+    framebuffersink)
+{
+  return TRUE;
+}
+
+/* Default implementation of match_display_mode: keep the current mode. */
+
+static void
+gst_framebuffersink_match_display_mode (GstFramebufferSink *framebuffersink,
+    GstVideoInfo *info)
+{
+}
+
+/* Default implementation of show_overlay_physical: always copy. */
+
+static GstFlowReturn
+gst_framebuffersink_show_overlay_physical (GstFramebufferSink *
+    framebuffersink, GstFramebufferSinkPhysicalAddressMeta *meta)
+{
+  return GST_FLOW_NOT_SUPPORTED;
+}
+
 /* Default implementation of get_supported_overlay_formats: none supported. */
 
 static GstVideoFormat *
@@ -470,6 +611,16 @@ static GstAllocator *gst_framebuffersink_video_memory_allocator_new (
   return NULL;
 }
 
+/* Default implementation of video_memory_allocator_is_reusable: overlay
+   allocators are never reused across renegotiation. */
+
+static gboolean gst_framebuffersink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info)
+{
+  return FALSE;
+}
+
 static gboolean
 gst_framebuffersink_video_format_supported_by_overlay (GstFramebufferSink *
     framebuffersink, GstVideoFormat format)
@@ -515,17 +666,31 @@ gst_framebuffersink_set_property (GObject * object, guint property_id,
       g_free (framebuffersink->device);
       framebuffersink->device = g_value_dup_string (value);
       break;
+    /* The output window can be changed while playing; the new window is
+       applied with the next frame. */
     case PROP_REQUESTED_X:
+      GST_OBJECT_LOCK (framebuffersink);
       framebuffersink->requested_video_x = g_value_get_int (value);
+      framebuffersink->video_rectangle_changed = TRUE;
+      GST_OBJECT_UNLOCK (framebuffersink);
       break;
     case PROP_REQUESTED_Y:
+      GST_OBJECT_LOCK (framebuffersink);
       framebuffersink->requested_video_y = g_value_get_int (value);
+      framebuffersink->video_rectangle_changed = TRUE;
+      GST_OBJECT_UNLOCK (framebuffersink);
       break;
     case PROP_REQUESTED_WIDTH:
+      GST_OBJECT_LOCK (framebuffersink);
       framebuffersink->requested_video_width = g_value_get_int (value);
+      framebuffersink->video_rectangle_changed = TRUE;
+      GST_OBJECT_UNLOCK (framebuffersink);
       break;
     case PROP_REQUESTED_HEIGHT:
+      GST_OBJECT_LOCK (framebuffersink);
       framebuffersink->requested_video_height = g_value_get_int (value);
+      framebuffersink->video_rectangle_changed = TRUE;
+      GST_OBJECT_UNLOCK (framebuffersink);
       break;
     case PROP_WIDTH_BEFORE_SCALING:
       framebuffersink->width_before_scaling = g_value_get_int (value);
@@ -576,10 +741,38 @@ gst_framebuffersink_set_property (GObject * object, guint property_id,
 	case PROP_ROTATE_ANGLE:
 	  framebuffersink->rotate_angle_property = g_value_get_int(value);
       break;
+    case PROP_ADAPTIVE_POOL:
+      framebuffersink->adaptive_pool = g_value_get_boolean (value);
+      break;
+    case PROP_MIN_POOL_BUFFERS:
+      framebuffersink->min_pool_buffers = g_value_get_int (value);
+      break;
+    case PROP_MULTIPLE_POOLS:
+      framebuffersink->multiple_pools = g_value_get_boolean (value);
+      break;
+    case PROP_MATCH_REFRESH_RATE:
+      framebuffersink->match_refresh_rate = g_value_get_boolean (value);
+      break;
+    case PROP_STAGING_HUGEPAGES:
+      framebuffersink->staging_hugepages = g_value_get_boolean (value);
+      break;
+    case PROP_UPLOAD_THREADS:
+      framebuffersink->upload_threads_property = g_value_get_int (value);
+      break;
+    case PROP_BOB:
+      framebuffersink->bob = g_value_get_boolean (value);
+      break;
+    case PROP_FRAME_CHECKSUM:
+      framebuffersink->frame_checksum = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
   }
+
+  GST_OBJECT_LOCK (framebuffersink);
+  gst_framebuffersink_clear_caps_cache (framebuffersink);
+  GST_OBJECT_UNLOCK (framebuffersink);
 }
 
 static void
@@ -672,6 +865,30 @@ gst_framebuffersink_get_property (GObject * object, guint property_id,
 	case PROP_ROTATE_ANGLE:
 	  g_value_set_int(value, framebuffersink->rotate_angle_property);
 	  break;
+    case PROP_ADAPTIVE_POOL:
+      g_value_set_boolean (value, framebuffersink->adaptive_pool);
+      break;
+    case PROP_MIN_POOL_BUFFERS:
+      g_value_set_int (value, framebuffersink->min_pool_buffers);
+      break;
+    case PROP_MULTIPLE_POOLS:
+      g_value_set_boolean (value, framebuffersink->multiple_pools);
+      break;
+    case PROP_MATCH_REFRESH_RATE:
+      g_value_set_boolean (value, framebuffersink->match_refresh_rate);
+      break;
+    case PROP_STAGING_HUGEPAGES:
+      g_value_set_boolean (value, framebuffersink->staging_hugepages);
+      break;
+    case PROP_UPLOAD_THREADS:
+      g_value_set_int (value, framebuffersink->upload_threads_property);
+      break;
+    case PROP_BOB:
+      g_value_set_boolean (value, framebuffersink->bob);
+      break;
+    case PROP_FRAME_CHECKSUM:
+      g_value_set_boolean (value, framebuffersink->frame_checksum);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -693,10 +910,46 @@ gst_framebuffersink_clear_screen (GstFramebufferSink *framebuffersink,
       gst_memory_unmap (framebuffersink->screens[index], &mapinfo);
     return;
   }
-  memset (mapinfo.data, 0, mapinfo.size);
+  gst_framebuffersink_kernels->clear (mapinfo.data, mapinfo.size);
   gst_memory_unmap (framebuffersink->screens[index], &mapinfo);
 }
 
+/* Clear the part of the old video rectangle in a screen buffer that is not
+   covered by the current video rectangle, after the window has moved. */
+
+static void
+gst_framebuffersink_clear_exposed_area (GstFramebufferSink *framebuffersink,
+    guint8 *screen, GstVideoRectangle *old_rectangle)
+{
+  GstVideoRectangle *new_rectangle = &framebuffersink->video_rectangle;
+  guintptr stride = GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info,
+      0);
+  gint pixel_stride = GST_VIDEO_INFO_COMP_PSTRIDE (
+      &framebuffersink->screen_info, 0);
+  gint old_right = old_rectangle->x + old_rectangle->w;
+  gint new_right = new_rectangle->x + new_rectangle->w;
+  gint y;
+
+  for (y = old_rectangle->y; y < old_rectangle->y + old_rectangle->h; y++) {
+    guint8 *line = screen + y * stride;
+    if (y < new_rectangle->y || y >= new_rectangle->y + new_rectangle->h) {
+      gst_framebuffersink_kernels->clear (line + old_rectangle->x *
+          pixel_stride, old_rectangle->w * pixel_stride);
+      continue;
+    }
+    /* Left and right of the new rectangle. */
+    if (new_rectangle->x > old_rectangle->x)
+      gst_framebuffersink_kernels->clear (line + old_rectangle->x *
+          pixel_stride, (MIN (new_rectangle->x, old_right) -
+          old_rectangle->x) * pixel_stride);
+    if (new_right < old_right) {
+      gint x = MAX (new_right, old_rectangle->x);
+      gst_framebuffersink_kernels->clear (line + x * pixel_stride,
+          (old_right - x) * pixel_stride);
+    }
+  }
+}
+
 static void
 gst_framebuffersink_put_image_memcpy (GstFramebufferSink *framebuffersink,
     uint8_t *src)
@@ -721,6 +974,19 @@ gst_framebuffersink_put_image_memcpy (GstFramebufferSink *framebuffersink,
     return;
   }
   dest = mapinfo.data;
+  /* Each screen buffer still holds the frame at the window position it was
+     last drawn at. */
+  if (framebuffersink->screen_video_rectangles != NULL) {
+    GstVideoRectangle *screen_rectangle =
+        &framebuffersink->screen_video_rectangles[
+        framebuffersink->current_framebuffer_index];
+    if (memcmp (screen_rectangle, &framebuffersink->video_rectangle,
+        sizeof (GstVideoRectangle)) != 0) {
+      gst_framebuffersink_clear_exposed_area (framebuffersink, dest,
+          screen_rectangle);
+      *screen_rectangle = framebuffersink->video_rectangle;
+    }
+  }
   dest += framebuffersink->video_rectangle.y * GST_VIDEO_INFO_COMP_STRIDE (
       &framebuffersink->screen_info, 0)
       + framebuffersink->video_rectangle.x * GST_VIDEO_INFO_COMP_PSTRIDE (
@@ -737,7 +1003,8 @@ gst_framebuffersink_put_image_memcpy (GstFramebufferSink *framebuffersink,
 		/*g_sprintf(s, "FB_put_imag_cp dst=0x%x,src=0x%x,size=%d",
 		(unsigned int)dest, (unsigned int)src, framebuffersink->video_rectangle_width_in_bytes);
 		GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);*/
-      memcpy (dest, src, framebuffersink->video_rectangle_width_in_bytes);
+      gst_framebuffersink_kernels->copy (dest, src,
+          framebuffersink->video_rectangle_width_in_bytes);
       src += framebuffersink->source_video_width_in_bytes[0];
       dest += dest_stride;
     }
@@ -747,16 +1014,329 @@ gst_framebuffersink_put_image_memcpy (GstFramebufferSink *framebuffersink,
   return;
 }
 
+/* Overlay upload. Each plane is split into horizontal stripes that are
+   copied by the upload thread pool (upload-threads property), with the
+   streaming thread copying the last stripe itself, so that the planes are
+   written in parallel instead of one after another; several writers fill
+   write-combined video memory faster than one on most devices. Rows are
+   copied with the copy kernel, and a stripe is a single copy when the
+   strides match. When I420 video is shown on an NV12 overlay, the U and V
+   planes are interleaved into the UV plane by the interleave kernel in the
+   same pass, and 10-bit video shown on an 8-bit overlay is narrowed by the
+   narrow kernel. */
+
+typedef struct
+{
+  guint8 *dest;
+  const guint8 *src;
+  /* V plane of an interleave job, NULL for copies. */
+  const guint8 *src_v;
+  /* Right shift narrowing 16-bit source samples to 8 bits, 0 for copies. */
+  int narrow_shift;
+  int dest_stride;
+  int src_stride;
+  int width_in_bytes;
+  int rows;
+} GstFramebufferSinkUploadJob;
+
+static void
+gst_framebuffersink_run_upload_job (GstFramebufferSinkUploadJob *job)
+{
+  int y;
+
+  if (job->src_v != NULL) {
+    for (y = 0; y < job->rows; y++)
+      gst_framebuffersink_kernels->interleave_row (
+          job->dest + y * job->dest_stride,
+          job->src + y * job->src_stride, job->src_v + y * job->src_stride,
+          job->width_in_bytes);
+  }
+  else if (job->narrow_shift > 0) {
+    for (y = 0; y < job->rows; y++)
+      gst_framebuffersink_kernels->narrow_row (
+          job->dest + y * job->dest_stride,
+          job->src + y * job->src_stride, job->width_in_bytes,
+          job->narrow_shift);
+  }
+  else if (job->dest_stride == job->src_stride)
+    gst_framebuffersink_kernels->copy (job->dest, job->src,
+        (gsize) job->src_stride * (job->rows - 1) + job->width_in_bytes);
+  else
+    for (y = 0; y < job->rows; y++)
+      gst_framebuffersink_kernels->copy (job->dest + y * job->dest_stride,
+          job->src + y * job->src_stride, job->width_in_bytes);
+}
+
+static void
+gst_framebuffersink_upload_thread (gpointer data, gpointer user_data)
+{
+  GstFramebufferSink *framebuffersink = user_data;
+
+  gst_framebuffersink_run_upload_job (data);
+
+  g_mutex_lock (&framebuffersink->upload_lock);
+  if (--framebuffersink->uploads_pending == 0)
+    g_cond_signal (&framebuffersink->upload_cond);
+  g_mutex_unlock (&framebuffersink->upload_lock);
+}
+
+/* Split rows into upload_stripes jobs. */
+
+static void
+gst_framebuffersink_add_upload_jobs (GstFramebufferSink *framebuffersink,
+    GstFramebufferSinkUploadJob *jobs, int *n,
+    GstFramebufferSinkUploadJob *plane)
+{
+  int stripes = MIN (framebuffersink->upload_stripes, plane->rows);
+  int i, y = 0;
+
+  for (i = 0; i < stripes; i++) {
+    GstFramebufferSinkUploadJob *job = &jobs[(*n)++];
+    int rows = (plane->rows - y) / (stripes - i);
+    *job = *plane;
+    job->dest += y * plane->dest_stride;
+    job->src += y * plane->src_stride;
+    if (job->src_v != NULL)
+      job->src_v += y * plane->src_stride;
+    job->rows = rows;
+    y += rows;
+  }
+}
+
+static void
+gst_framebuffersink_run_upload_jobs (GstFramebufferSink *framebuffersink,
+    GstFramebufferSinkUploadJob *jobs, int n)
+{
+  int i;
+
+  if (framebuffersink->upload_pool == NULL || n <= 1) {
+    for (i = 0; i < n; i++)
+      gst_framebuffersink_run_upload_job (&jobs[i]);
+    return;
+  }
+
+  framebuffersink->uploads_pending = n - 1;
+  for (i = 0; i < n - 1; i++)
+    g_thread_pool_push (framebuffersink->upload_pool, &jobs[i], NULL);
+  gst_framebuffersink_run_upload_job (&jobs[n - 1]);
+
+  g_mutex_lock (&framebuffersink->upload_lock);
+  while (framebuffersink->uploads_pending > 0)
+    g_cond_wait (&framebuffersink->upload_cond,
+        &framebuffersink->upload_lock);
+  g_mutex_unlock (&framebuffersink->upload_lock);
+}
+
+static void
+gst_framebuffersink_start_upload_threads (GstFramebufferSink *
+    framebuffersink)
+{
+  int threads = framebuffersink->upload_threads_property;
+
+  if (threads == 0)
+    threads = MIN (g_get_num_processors (), 4);
+  framebuffersink->upload_stripes = threads;
+  framebuffersink->upload_pool = NULL;
+  g_mutex_init (&framebuffersink->upload_lock);
+  g_cond_init (&framebuffersink->upload_cond);
+  if (threads > 1)
+    framebuffersink->upload_pool = g_thread_pool_new (
+        gst_framebuffersink_upload_thread, framebuffersink, threads - 1,
+        FALSE, NULL);
+  if (framebuffersink->upload_pool == NULL)
+    framebuffersink->upload_stripes = 1;
+}
+
+static void
+gst_framebuffersink_stop_upload_threads (GstFramebufferSink *
+    framebuffersink)
+{
+  if (framebuffersink->upload_pool != NULL) {
+    g_thread_pool_free (framebuffersink->upload_pool, FALSE, TRUE);
+    framebuffersink->upload_pool = NULL;
+  }
+  g_mutex_clear (&framebuffersink->upload_lock);
+  g_cond_clear (&framebuffersink->upload_cond);
+}
+
+/* Trace points. Every hardware interaction is bracketed by a USDT probe pair
+   (sdt_framebuffersink:hw__begin and hw__end, when built with sys/sdt.h),
+   which costs a nop until perf or bpftrace attaches to it. When GST_TRACERS
+   is set, the time spent in each call is also logged as a
+   framebuffersink-hw tracer record, and when GST_FRAMEBUFFERSINK_FTRACE is
+   set, begin and end are written to the ftrace marker file so they line up
+   with kernel events in the same timeline. */
+
+#if GST_CHECK_VERSION(1, 8, 0)
+static GstTracerRecord *trace_record = NULL;
+#endif
+static int trace_marker_fd = -1;
+
+static void
+gst_framebuffersink_trace_init (void)
+{
+  static const char *marker_paths[] = {
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker"
+  };
+  int i;
+
+#if GST_CHECK_VERSION(1, 8, 0)
+  if (g_getenv ("GST_TRACERS") != NULL) {
+    trace_record = gst_tracer_record_new ("framebuffersink-hw.class",
+        "element", GST_TYPE_STRUCTURE, gst_structure_new ("scope",
+            "type", G_TYPE_GTYPE, G_TYPE_STRING,
+            "related-to", GST_TYPE_TRACER_VALUE_SCOPE,
+            GST_TRACER_VALUE_SCOPE_ELEMENT, NULL),
+        "call", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+            "type", G_TYPE_GTYPE, G_TYPE_STRING,
+            "description", G_TYPE_STRING, "hardware interaction", NULL),
+        "time", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+            "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+            "description", G_TYPE_STRING, "time spent in the call in ns",
+            "min", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+            "max", G_TYPE_UINT64, G_MAXUINT64, NULL),
+        "ts", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+            "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+            "description", G_TYPE_STRING, "time the call returned in ns",
+            "min", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+            "max", G_TYPE_UINT64, G_MAXUINT64, NULL),
+        NULL);
+    GST_OBJECT_FLAG_SET (trace_record, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+  }
+#endif
+
+  if (g_getenv ("GST_FRAMEBUFFERSINK_FTRACE") != NULL) {
+    for (i = 0; i < G_N_ELEMENTS (marker_paths) && trace_marker_fd < 0; i++)
+      trace_marker_fd = open (marker_paths[i], O_WRONLY | O_CLOEXEC);
+    if (trace_marker_fd < 0)
+      GST_WARNING ("Could not open the ftrace marker file");
+  }
+}
+
+static void
+gst_framebuffersink_trace_marker (GstFramebufferSink *framebuffersink,
+    const char *name, const char *event)
+{
+  char line[128];
+  int length;
+
+  length = g_snprintf (line, sizeof (line), "framebuffersink: %s %s %s\n",
+      GST_OBJECT_NAME (framebuffersink), name, event);
+  length = MIN (length, (int) sizeof (line) - 1);
+  /* A lost marker only leaves a gap in the trace. */
+  if (write (trace_marker_fd, line, length) < 0)
+    return;
+}
+
+GstClockTime
+gst_framebuffersink_trace_begin (GstFramebufferSink *framebuffersink,
+    const char *name)
+{
+#ifdef HAVE_SYS_SDT_H
+  DTRACE_PROBE2 (framebuffersink, hw__begin,
+      GST_OBJECT_NAME (framebuffersink), name);
+#endif
+  if (trace_marker_fd >= 0)
+    gst_framebuffersink_trace_marker (framebuffersink, name, "begin");
+#if GST_CHECK_VERSION(1, 8, 0)
+  if (trace_record != NULL)
+    return gst_util_get_timestamp ();
+#endif
+  return GST_CLOCK_TIME_NONE;
+}
+
+void
+gst_framebuffersink_trace_end (GstFramebufferSink *framebuffersink,
+    const char *name, GstClockTime begin)
+{
+#if GST_CHECK_VERSION(1, 8, 0)
+  if (trace_record != NULL && GST_CLOCK_TIME_IS_VALID (begin)) {
+    GstClockTime end = gst_util_get_timestamp ();
+
+    gst_tracer_record_log (trace_record, GST_OBJECT_NAME (framebuffersink),
+        name, (guint64) (end - begin), (guint64) end);
+  }
+#endif
+  if (trace_marker_fd >= 0)
+    gst_framebuffersink_trace_marker (framebuffersink, name, "end");
+#ifdef HAVE_SYS_SDT_H
+  DTRACE_PROBE2 (framebuffersink, hw__end,
+      GST_OBJECT_NAME (framebuffersink), name);
+#endif
+}
+
+/* Calls of the subclass' hardware functions, with trace points. */
+
+static void
+gst_framebuffersink_hw_wait_for_vsync (GstFramebufferSink *framebuffersink)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstClockTime begin;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink, "wait_for_vsync");
+  klass->wait_for_vsync (framebuffersink);
+  gst_framebuffersink_trace_end (framebuffersink, "wait_for_vsync", begin);
+}
+
+static void
+gst_framebuffersink_hw_pan_display (GstFramebufferSink *framebuffersink,
+    GstMemory *memory)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstClockTime begin;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink, "pan_display");
+  klass->pan_display (framebuffersink, memory);
+  framebuffersink->presented_memory = memory;
+  gst_framebuffersink_trace_end (framebuffersink, "pan_display", begin);
+}
+
+static GstFlowReturn
+gst_framebuffersink_hw_show_overlay (GstFramebufferSink *framebuffersink,
+    GstMemory *memory)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstClockTime begin;
+  GstFlowReturn res;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink, "show_overlay");
+  res = klass->show_overlay (framebuffersink, memory);
+  gst_framebuffersink_trace_end (framebuffersink, "show_overlay", begin);
+  return res;
+}
+
+static GstFlowReturn
+gst_framebuffersink_hw_show_overlay_physical (GstFramebufferSink *
+    framebuffersink, GstFramebufferSinkPhysicalAddressMeta *meta)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstClockTime begin;
+  GstFlowReturn res;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink,
+      "show_overlay_physical");
+  res = klass->show_overlay_physical (framebuffersink, meta);
+  gst_framebuffersink_trace_end (framebuffersink, "show_overlay_physical",
+      begin);
+  return res;
+}
+
 static void
 gst_framebuffersink_put_overlay_image_memcpy(GstFramebufferSink *
     framebuffersink, GstMemory *vmem, uint8_t *src)
 {
-  GstFramebufferSinkClass *klass = GST_FRAMEBUFFERSINK_GET_CLASS (
-      framebuffersink);
+  GstVideoInfo *info = &framebuffersink->video_info;
+  GstFramebufferSinkUploadJob jobs[GST_VIDEO_MAX_PLANES * MAX_UPLOAD_THREADS];
+  GstFramebufferSinkUploadJob plane;
   uint8_t *framebuffer_address;
   GstMapInfo mapinfo;
   gboolean res;
-  /*gchar s[256];*/
+  int i, n, nu_jobs = 0;
 
   mapinfo.data = NULL;
   res = gst_memory_map (vmem, &mapinfo, GST_MAP_WRITE);
@@ -769,55 +1349,102 @@ gst_framebuffersink_put_overlay_image_memcpy(GstFramebufferSink *
 
   framebuffer_address = mapinfo.data;
   if (framebuffersink->overlay_alignment_is_native) {
-	/*g_sprintf(s, "FB_put_overlay_cp dst=0x%x,src=0x%x,size=%d",
-	(unsigned int)framebuffer_address, (unsigned int)src,
-	framebuffersink->video_info.size);
-	GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);*/
-    memcpy(framebuffer_address, src, framebuffersink->video_info.size);
+    /* The layouts are identical, copy in one piece per stripe. */
+    plane.dest = framebuffer_address;
+    plane.src = src;
+    plane.src_v = NULL;
+    plane.narrow_shift = 0;
+    plane.rows = framebuffersink->upload_stripes;
+    plane.src_stride = plane.dest_stride = plane.width_in_bytes =
+        GST_VIDEO_INFO_SIZE (info) / plane.rows;
+    gst_framebuffersink_add_upload_jobs (framebuffersink, jobs, &nu_jobs,
+        &plane);
+    /* Remainder. */
+    plane.dest += plane.rows * plane.src_stride;
+    plane.src += plane.rows * plane.src_stride;
+    plane.src_stride = plane.dest_stride = plane.width_in_bytes =
+        GST_VIDEO_INFO_SIZE (info) % plane.rows;
+    plane.rows = 1;
+    if (plane.src_stride > 0)
+      jobs[nu_jobs++] = plane;
   } else {
-    int i;
-    int n = GST_VIDEO_INFO_N_PLANES (&framebuffersink->video_info);
-    guintptr offset;
+    n = GST_VIDEO_INFO_N_PLANES (info);
+    if (framebuffersink->overlay_convert_to_nv12)
+      n = 2;
     for (i = 0; i < n; i++) {
-      offset = framebuffersink->overlay_plane_offset[i];
-      if (GST_VIDEO_INFO_PLANE_STRIDE (&framebuffersink->video_info, i) ==
-          framebuffersink->overlay_scanline_stride[i]){
-         /* g_sprintf(s, "offset=0x%x,dst[%d]=0x%x,src=0x%x,size=%d",
-		(unsigned int)offset, i, (unsigned int)framebuffer_address + offset, (unsigned int)src, framebuffersink->overlay_scanline_stride[i]
-            * framebuffersink->videosink.height);
-		GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);*/
-        memcpy(framebuffer_address + offset, src,
-            framebuffersink->overlay_scanline_stride[i]
-            * framebuffersink->videosink.height);
-	}
-      else {
-        int y;
-        for (y = 0; y < framebuffersink->videosink.height; y++) {
-		/*g_sprintf(s, "-offset=0x%x,dst[%d]=0x%x,src=0x%x,size=%d",
-		(unsigned int)offset, i, (unsigned int)framebuffer_address + offset +
-        framebuffersink->overlay_scanline_offset[i], (unsigned int)src,
-        framebuffersink->source_video_width_in_bytes[i]);
-		GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);*/
-          memcpy(framebuffer_address + offset +
-              framebuffersink->overlay_scanline_offset[i],
-              src, framebuffersink->source_video_width_in_bytes[i]);
-          offset += framebuffersink->overlay_scanline_stride[i];
-        }
-      }
+      int comp = 0;
+      while (GST_VIDEO_INFO_COMP_PLANE (info, comp) != i)
+        comp++;
+      plane.dest = framebuffer_address +
+          framebuffersink->overlay_plane_offset[i] +
+          framebuffersink->overlay_scanline_offset[i];
+      plane.src = src + GST_VIDEO_INFO_PLANE_OFFSET (info, i);
+      plane.src_v = NULL;
+      plane.narrow_shift = framebuffersink->overlay_narrow_shift;
+      plane.dest_stride = framebuffersink->overlay_scanline_stride[i];
+      plane.src_stride = GST_VIDEO_INFO_PLANE_STRIDE (info, i);
+      plane.width_in_bytes = framebuffersink->source_video_width_in_bytes[i];
+      if (plane.narrow_shift > 0)
+        plane.width_in_bytes /= 2;
+      plane.rows = GST_VIDEO_INFO_COMP_HEIGHT (info, comp);
+      if (framebuffersink->overlay_convert_to_nv12 && i == 1)
+        plane.src_v = src + GST_VIDEO_INFO_PLANE_OFFSET (info, 2);
+      gst_framebuffersink_add_upload_jobs (framebuffersink, jobs, &nu_jobs,
+          &plane);
     }
   }
+  gst_framebuffersink_run_upload_jobs (framebuffersink, jobs, nu_jobs);
+
   gst_memory_unmap (vmem, &mapinfo);
-  klass->show_overlay (framebuffersink, vmem);
+  if (gst_framebuffersink_hw_show_overlay (framebuffersink, vmem) ==
+      GST_FLOW_OK)
+    framebuffersink->shown_overlay_memory = vmem;
 }
 
 static void
 gst_framebuffersink_put_image_pan(GstFramebufferSink * framebuffersink,
     GstMemory *memory)
 {
-  GstFramebufferSinkClass *klass = GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
   if (framebuffersink->vsync && !framebuffersink->pan_does_vsync)
-    klass->wait_for_vsync (framebuffersink);
-  klass->pan_display(framebuffersink, memory);
+    gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
+  gst_framebuffersink_hw_pan_display (framebuffersink, memory);
+}
+
+/* Keep a reference to a video memory buffer that was just shown so that it
+   does not return to its pool, and get overwritten upstream, while the
+   display is still reading from it. The buffer that was on screen before
+   can only be released once the flip away from it has completed; since a
+   new frame is only shown after waiting for vsync or after the previous flip
+   has completed, that is the case for the buffer shown two frames ago.
+   Pools are sized so that upstream still has a buffer to render into while
+   SCANOUT_HELD_BUFFERS are held. */
+
+static void
+gst_framebuffersink_hold_scanout_buffer (GstFramebufferSink *framebuffersink,
+    GstBuffer *buf)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+
+  if (!klass->frame_queued_for_scanout (framebuffersink))
+    return;
+  if (framebuffersink->scanout_buffers[1] != NULL)
+    gst_buffer_unref (framebuffersink->scanout_buffers[1]);
+  framebuffersink->scanout_buffers[1] = framebuffersink->scanout_buffers[0];
+  framebuffersink->scanout_buffers[0] = gst_buffer_ref (buf);
+}
+
+static void
+gst_framebuffersink_release_scanout_buffers (GstFramebufferSink *
+    framebuffersink)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (framebuffersink->scanout_buffers[i] != NULL) {
+      gst_buffer_unref (framebuffersink->scanout_buffers[i]);
+      framebuffersink->scanout_buffers[i] = NULL;
+    }
 }
 
 /* Benchmark functionality. */
@@ -914,7 +1541,8 @@ static void gst_framebuffersink_benchmark_read_first_words (
   uint32_t *src;
   uint32_t sum = 0;
   int size  = GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info);
-  gst_memory_map (buffers[0], &mapinfo, GST_MAP_READ);
+  /* No map flags, so that readback detection doesn't count this. */
+  gst_memory_map (buffers[0], &mapinfo, 0);
   src = (uint32_t *)mapinfo.data;
   while (size >= 32) {
     sum += *src;
@@ -979,7 +1607,7 @@ static void gst_framebuffersink_benchmark_copy_n_to_source_memcpy (
   int i;
   int size  = GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info);
   for (i = 0; i < nu_buffers; i++) {
-    gst_memory_map (buffers[0], &mapinfo, GST_MAP_READ);
+    gst_memory_map (buffers[0], &mapinfo, 0);
     gst_memory_map (source_buffer, &mapinfo_src, GST_MAP_WRITE);
     memcpy (mapinfo_src.data, mapinfo.data, size);
     gst_memory_unmap (source_buffer, &mapinfo_src);
@@ -1136,6 +1764,12 @@ gst_framebuffersink_start (GstBaseSink *sink)
       framebuffersink->use_buffer_pool_property;
   framebuffersink->vsync =
       framebuffersink->vsync_property;
+  framebuffersink->use_overlay_composition = FALSE;
+  framebuffersink->use_physical_address_meta = FALSE;
+  framebuffersink->use_interlaced_scan = FALSE;
+  framebuffersink->overlay_first_field = GST_FRAMEBUFFERSINK_FIELD_NONE;
+  framebuffersink->overlay_field = GST_FRAMEBUFFERSINK_FIELD_NONE;
+  framebuffersink->overlay_composition_seqnum = 0;
 
   if (!klass->open_hardware (framebuffersink, &framebuffersink->screen_info,
       &framebuffersink->video_memory_size,
@@ -1159,6 +1793,8 @@ gst_framebuffersink_start (GstBaseSink *sink)
       framebuffersink->max_framebuffers);
   if (framebuffersink->vsync)
     g_sprintf(s + strlen(s), ", vsync enabled");
+  g_sprintf(s + strlen(s), ", %s pixel kernels",
+      gst_framebuffersink_kernels->name);
   GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);
 
   if (framebuffersink->full_screen) {
@@ -1188,16 +1824,38 @@ gst_framebuffersink_start (GstBaseSink *sink)
         klass->get_supported_overlay_formats (framebuffersink);
   }
 
+  /* Caps generated for a previous screen configuration are stale. This has
+     to come after the full-screen size and the overlay formats are set, as
+     get_caps depends on both. */
+  GST_OBJECT_LOCK (framebuffersink);
+  gst_framebuffersink_clear_caps_cache (framebuffersink);
+  GST_OBJECT_UNLOCK (framebuffersink);
+
   framebuffersink->current_framebuffer_index = 0;
   framebuffersink->nu_screens_used = 0;
   framebuffersink->screens = NULL;
   framebuffersink->nu_overlays_used = 0;
   framebuffersink->overlays = NULL;
 
+  framebuffersink->video_memory_reads = 0;
+  framebuffersink->readback_interval_start = 0;
+  framebuffersink->readback_mode = FALSE;
+  framebuffersink->readback_probe_interval = 0;
+  framebuffersink->staging_index = 0;
+
+  gst_framebuffersink_start_upload_threads (framebuffersink);
+
   framebuffersink->stats_video_frames_video_memory = 0;
   framebuffersink->stats_video_frames_system_memory = 0;
   framebuffersink->stats_overlay_frames_video_memory = 0;
   framebuffersink->stats_overlay_frames_system_memory = 0;
+  framebuffersink->stats_video_memory_reused = 0;
+  g_atomic_int_set (&framebuffersink->stats_pool_buffers_released, 0);
+  framebuffersink->stats_video_memory_pools = 0;
+  framebuffersink->stats_system_memory_pools = 0;
+  framebuffersink->stats_readback_switches = 0;
+  framebuffersink->stats_second_fields = 0;
+  framebuffersink->stats_caps_cache_hits = 0;
 
   return TRUE;
 }
@@ -1285,6 +1943,28 @@ skip_video_size_request:
   }
 }
 
+/* Interlaced video can only be shown by the overlay, which either has the
+   display engine deinterlace it or shows one field at a time. */
+
+static void
+gst_framebuffersink_caps_set_overlay_interlace_modes (GstCaps *caps)
+{
+  static const char *modes[] = { "progressive", "interleaved", "mixed" };
+  GValue list = G_VALUE_INIT;
+  GValue mode = G_VALUE_INIT;
+  int i;
+
+  g_value_init (&list, GST_TYPE_LIST);
+  g_value_init (&mode, G_TYPE_STRING);
+  for (i = 0; i < G_N_ELEMENTS (modes); i++) {
+    g_value_set_static_string (&mode, modes[i]);
+    gst_value_list_append_value (&list, &mode);
+  }
+  gst_caps_set_value (caps, "interlace-mode", &list);
+  g_value_unset (&mode);
+  g_value_unset (&list);
+}
+
 /* Return default caps, or NULL if no default caps could be not generated. */
 
 static GstCaps *gst_framebuffersink_get_default_caps (
@@ -1293,6 +1973,7 @@ static GstCaps *gst_framebuffersink_get_default_caps (
   GstCaps *caps;
   GstCaps *framebuffer_caps;
   GstVideoFormat *f;
+  int i;
 
   if (GST_VIDEO_INFO_FORMAT (&framebuffersink->screen_info) ==
       GST_VIDEO_FORMAT_UNKNOWN)
@@ -1308,11 +1989,25 @@ static GstCaps *gst_framebuffersink_get_default_caps (
     if (*f != GST_VIDEO_INFO_FORMAT (&framebuffersink->screen_info)) {
       GstCaps *overlay_caps = gst_caps_new_simple("video/x-raw", "format",
           G_TYPE_STRING, gst_video_format_to_string(*f), NULL);
+      gst_framebuffersink_caps_set_overlay_interlace_modes (overlay_caps);
       gst_caps_append(caps, overlay_caps);
     }
     f++;
   }
 
+  /* Add the formats that are converted while uploading. */
+  for (i = 0; i < G_N_ELEMENTS (overlay_upload_conversions); i++)
+    if (gst_framebuffersink_video_format_supported_by_overlay (framebuffersink,
+        overlay_upload_conversions[i].overlay_format) &&
+        !gst_framebuffersink_video_format_supported_by_overlay (framebuffersink,
+        overlay_upload_conversions[i].format)) {
+      GstCaps *converted_caps = gst_caps_new_simple ("video/x-raw", "format",
+          G_TYPE_STRING, gst_video_format_to_string (
+          overlay_upload_conversions[i].format), NULL);
+      gst_framebuffersink_caps_set_overlay_interlace_modes (converted_caps);
+      gst_caps_append (caps, converted_caps);
+    }
+
   /* Add the standard framebuffer format. */
   framebuffer_caps = gst_caps_new_simple ("video/x-raw", "format",
       G_TYPE_STRING, gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (
@@ -1322,6 +2017,17 @@ static GstCaps *gst_framebuffersink_get_default_caps (
       NULL);
   gst_caps_append(caps, framebuffer_caps);
 
+  /* When overlay compositions are shown by the subclass, also accept them as
+     meta so that upstream doesn't blend them into the video frames. */
+  if (framebuffersink->use_overlay_composition) {
+    GstCaps *composition_caps = gst_caps_copy (caps);
+    for (i = 0; i < gst_caps_get_size (composition_caps); i++)
+      gst_caps_set_features (composition_caps, i, gst_caps_features_new (
+          GST_CAPS_FEATURE_MEMORY_SYSTEM_MEMORY,
+          GST_CAPS_FEATURE_META_GST_VIDEO_OVERLAY_COMPOSITION, NULL));
+    gst_caps_append (caps, composition_caps);
+  }
+
   return caps;
 
 unknown_format:
@@ -1386,6 +2092,93 @@ static GstVideoFormat gst_framebuffersink_get_preferred_video_format_from_caps (
   return best_format;
 }
 
+/* Results of get_caps. The default caps for the screen with the property
+   preferences applied are generated once, and the result for each of the
+   most recently seen filters is kept, since decodebin and playbin send the
+   same CAPS and ACCEPT_CAPS queries many times while a pipeline starts and
+   on every reconfigure. The cache is cleared, with the object lock held,
+   when a property changes, when caps are set and when the element starts
+   or stops. */
+
+#define CAPS_CACHE_SIZE 8
+
+typedef struct {
+  /* NULL for ACCEPT_CAPS queries. */
+  GstCaps *filter;
+  GstCaps *caps;
+  /* Whether get_caps stored the caps in framebuffersink->caps. */
+  gboolean store;
+} GstFramebufferSinkCapsCacheEntry;
+
+static void
+gst_framebuffersink_free_caps_cache_entry (gpointer data)
+{
+  GstFramebufferSinkCapsCacheEntry *entry = data;
+
+  if (entry->filter != NULL)
+    gst_caps_unref (entry->filter);
+  gst_caps_unref (entry->caps);
+  g_slice_free (GstFramebufferSinkCapsCacheEntry, entry);
+}
+
+void
+gst_framebuffersink_clear_caps_cache (GstFramebufferSink *framebuffersink)
+{
+  if (framebuffersink->default_caps_cache != NULL) {
+    gst_caps_unref (framebuffersink->default_caps_cache);
+    framebuffersink->default_caps_cache = NULL;
+  }
+  g_list_free_full (framebuffersink->caps_cache,
+      gst_framebuffersink_free_caps_cache_entry);
+  framebuffersink->caps_cache = NULL;
+}
+
+/* Return a reference to the cached result for filter, or NULL. */
+
+static GstCaps *
+gst_framebuffersink_lookup_caps_cache (GstFramebufferSink *framebuffersink,
+    GstCaps *filter, gboolean *store)
+{
+  GList *l;
+
+  for (l = framebuffersink->caps_cache; l != NULL; l = l->next) {
+    GstFramebufferSinkCapsCacheEntry *entry = l->data;
+    if (filter == NULL ? entry->filter == NULL : entry->filter != NULL &&
+        gst_caps_is_strictly_equal (filter, entry->filter)) {
+      /* Move it to the front. */
+      framebuffersink->caps_cache = g_list_remove_link (
+          framebuffersink->caps_cache, l);
+      framebuffersink->caps_cache = g_list_concat (l,
+          framebuffersink->caps_cache);
+      *store = entry->store;
+      return gst_caps_ref (entry->caps);
+    }
+  }
+  return NULL;
+}
+
+static void
+gst_framebuffersink_add_caps_cache (GstFramebufferSink *framebuffersink,
+    GstCaps *filter, GstCaps *caps, gboolean store)
+{
+  GstFramebufferSinkCapsCacheEntry *entry;
+  GList *last;
+
+  entry = g_slice_new (GstFramebufferSinkCapsCacheEntry);
+  entry->filter = filter != NULL ? gst_caps_ref (filter) : NULL;
+  entry->caps = gst_caps_ref (caps);
+  entry->store = store;
+  framebuffersink->caps_cache = g_list_prepend (framebuffersink->caps_cache,
+      entry);
+
+  if (g_list_length (framebuffersink->caps_cache) > CAPS_CACHE_SIZE) {
+    last = g_list_last (framebuffersink->caps_cache);
+    gst_framebuffersink_free_caps_cache_entry (last->data);
+    framebuffersink->caps_cache = g_list_delete_link (
+        framebuffersink->caps_cache, last);
+  }
+}
+
 /* get_caps is called by GstBaseSink for two purposes:
    1. When filter is not NULL, it is a GST_QUERY_CAPS query.
       The function should suggest caps based on filter.
@@ -1406,6 +2199,7 @@ gst_framebuffersink_get_caps (GstBaseSink * sink, GstCaps * filter)
   int n;
   const char *format_str = NULL;
   GstVideoFormat format;
+  gboolean store = FALSE;
 
   GST_OBJECT_LOCK (framebuffersink);
 
@@ -1435,15 +2229,37 @@ gst_framebuffersink_get_caps (GstBaseSink * sink, GstCaps * filter)
     framebuffersink->caps = NULL;
   }
 
-  /* Generate default caps for the screen. */
-  caps = gst_framebuffersink_get_default_caps(framebuffersink);
-  if (caps == NULL)
+  caps = gst_framebuffersink_lookup_caps_cache (framebuffersink, filter,
+      &store);
+  if (caps != NULL) {
+    framebuffersink->stats_caps_cache_hits++;
+    if (store) {
+      if (framebuffersink->caps)
+        gst_caps_unref (framebuffersink->caps);
+      framebuffersink->caps = gst_caps_ref (caps);
+    }
     goto done_no_store;
-  gst_framebuffersink_caps_set_preferences(framebuffersink, caps, TRUE);
+  }
+
+  /* Generate default caps for the screen. */
+  if (framebuffersink->default_caps_cache == NULL) {
+    framebuffersink->default_caps_cache =
+        gst_framebuffersink_get_default_caps(framebuffersink);
+    if (framebuffersink->default_caps_cache == NULL) {
+      caps = NULL;
+      goto done_no_store;
+    }
+    gst_framebuffersink_caps_set_preferences(framebuffersink,
+        framebuffersink->default_caps_cache, TRUE);
+  }
 
   /* For an ACCEPT_CAPS query, return the default caps for the screen. */
-  if (filter == NULL)
-    goto done_no_store;
+  if (filter == NULL) {
+    caps = gst_caps_ref (framebuffersink->default_caps_cache);
+    goto done_cache;
+  }
+
+  caps = gst_caps_copy (framebuffersink->default_caps_cache);
 
   /* Check whether upstream is reporting video dimensions and par. */
   n = gst_caps_get_size (filter);
@@ -1472,7 +2288,7 @@ gst_framebuffersink_get_caps (GstBaseSink * sink, GstCaps * filter)
     icaps = gst_caps_intersect_full (filter, caps, GST_CAPS_INTERSECT_FIRST);
     gst_caps_unref (caps);
     caps = icaps;
-    goto done_no_store;
+    goto done_cache;
   }
 
   /* Upstream has confirmed a video size */
@@ -1508,6 +2324,10 @@ gst_framebuffersink_get_caps (GstBaseSink * sink, GstCaps * filter)
   if (framebuffersink->caps)
     gst_caps_unref (framebuffersink->caps);
   framebuffersink->caps = gst_caps_ref (caps);
+  store = TRUE;
+
+done_cache:
+  gst_framebuffersink_add_caps_cache (framebuffersink, filter, caps, store);
 
 done_no_store:
 
@@ -1519,6 +2339,537 @@ done_no_store:
   return caps;
 }
 
+/* Allocator for the system memory buffer pools. Blocks are anonymous
+   mappings, which are page aligned (more than the cache line and SIMD
+   alignment the copy into video memory wants), and are prefaulted when
+   allocated so that upstream does not fault in every page of the first
+   frames on the streaming thread. With the staging-hugepages property,
+   blocks of at least the huge page size are aligned to it and backed by
+   transparent huge pages, which saves TLB misses when copying large
+   frames. */
+
+#define STAGING_ALIGN 63
+#define STAGING_HUGEPAGE_SIZE (2 * 1024 * 1024)
+/* One buffer being written upstream, one being copied into video memory and
+   one kept as the last sample by the base sink. */
+#define SYSTEM_MEMORY_POOL_MIN_BUFFERS 3
+
+typedef struct
+{
+  GstMemory mem;
+  guint8 *data;
+  /* Size of the mapping, 0 for shared sub-memory. */
+  gsize mapped_size;
+} GstFramebufferSinkStagingMemory;
+
+typedef struct
+{
+  GstAllocator parent;
+  gboolean hugepages;
+} GstFramebufferSinkStagingAllocator;
+
+typedef struct
+{
+  GstAllocatorClass parent_class;
+} GstFramebufferSinkStagingAllocatorClass;
+
+GType gst_framebuffersink_staging_allocator_get_type (void);
+G_DEFINE_TYPE (GstFramebufferSinkStagingAllocator,
+    gst_framebuffersink_staging_allocator, GST_TYPE_ALLOCATOR);
+
+/* Map size bytes of anonymous memory starting at a multiple of align (a
+   power of two). mmap only guarantees page alignment, so for larger
+   alignments the mapping is made larger by the difference and the slack
+   around the aligned block is unmapped again. */
+
+static guint8 *
+gst_framebuffersink_staging_map (gsize size, gsize align, gsize page_size,
+    gboolean populate)
+{
+  guint8 *data, *start;
+  gsize slack, head;
+
+  slack = align > page_size ? align - page_size : 0;
+  data = mmap (NULL, size + slack, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0), -1, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  head = ALIGNMENT_GET_ALIGN_BYTES ((guintptr) data, align - 1);
+  start = data + head;
+  if (head > 0)
+    munmap (data, head);
+  if (slack > head)
+    munmap (start + size, slack - head);
+  return start;
+}
+
+static GstMemory *
+gst_framebuffersink_staging_allocator_alloc (GstAllocator *allocator,
+    gsize size, GstAllocationParams *params)
+{
+  GstFramebufferSinkStagingAllocator *staging_allocator =
+      (GstFramebufferSinkStagingAllocator *) allocator;
+  GstFramebufferSinkStagingMemory *smem;
+  gsize maxsize, mapped_size, page_size, align, i;
+  gboolean hugepages;
+  guint8 *data;
+
+  maxsize = size + params->prefix + params->padding;
+  page_size = sysconf (_SC_PAGESIZE);
+  hugepages = staging_allocator->hugepages &&
+      maxsize >= STAGING_HUGEPAGE_SIZE;
+  /* Huge pages are only used for blocks aligned to the huge page size. An
+     alignment requested by upstream beyond the page size is honoured too. */
+  align = hugepages ? STAGING_HUGEPAGE_SIZE : page_size;
+  if (params->align + 1 > align)
+    align = params->align + 1;
+  mapped_size = ALIGNMENT_GET_ALIGNED (maxsize,
+      (hugepages ? STAGING_HUGEPAGE_SIZE : page_size) - 1);
+
+  if (!hugepages) {
+    data = gst_framebuffersink_staging_map (mapped_size, align, page_size,
+        TRUE);
+    if (data == NULL)
+      return NULL;
+  }
+  else {
+    /* The pages have to be faulted in after madvise for huge pages to be
+       used. */
+    data = gst_framebuffersink_staging_map (mapped_size, align, page_size,
+        FALSE);
+    if (data == NULL)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise (data, mapped_size, MADV_HUGEPAGE);
+#endif
+    for (i = 0; i < mapped_size; i += page_size)
+      data[i] = 0;
+  }
+
+  smem = g_slice_new (GstFramebufferSinkStagingMemory);
+  gst_memory_init (GST_MEMORY_CAST (smem), params->flags, allocator, NULL,
+      maxsize, params->align | STAGING_ALIGN, params->prefix, size);
+  smem->data = data;
+  smem->mapped_size = mapped_size;
+
+  GST_DEBUG ("%p: allocated %" G_GSIZE_FORMAT " bytes of staging memory%s",
+      smem, mapped_size, hugepages ? " (huge pages)" : "");
+  return GST_MEMORY_CAST (smem);
+}
+
+static void
+gst_framebuffersink_staging_allocator_free (GstAllocator *allocator,
+    GstMemory *mem)
+{
+  GstFramebufferSinkStagingMemory *smem =
+      (GstFramebufferSinkStagingMemory *) mem;
+
+  if (smem->mapped_size > 0)
+    munmap (smem->data, smem->mapped_size);
+  g_slice_free (GstFramebufferSinkStagingMemory, smem);
+}
+
+static gpointer
+gst_framebuffersink_staging_memory_map (GstMemory *mem, gsize maxsize,
+    GstMapFlags flags)
+{
+  return ((GstFramebufferSinkStagingMemory *) mem)->data;
+}
+
+static gboolean
+gst_framebuffersink_staging_memory_unmap (GstMemory *mem)
+{
+  return TRUE;
+}
+
+static GstMemory *
+gst_framebuffersink_staging_memory_share (GstMemory *mem, gssize offset,
+    gssize size)
+{
+  GstFramebufferSinkStagingMemory *smem =
+      (GstFramebufferSinkStagingMemory *) mem;
+  GstFramebufferSinkStagingMemory *sub;
+  GstMemory *parent;
+
+  parent = mem->parent != NULL ? mem->parent : mem;
+  if (size == -1)
+    size = mem->size - offset;
+
+  sub = g_slice_new (GstFramebufferSinkStagingMemory);
+  gst_memory_init (GST_MEMORY_CAST (sub), GST_MINI_OBJECT_FLAGS (parent) |
+      GST_MINI_OBJECT_FLAG_LOCK_READONLY, mem->allocator, parent,
+      mem->maxsize, mem->align, mem->offset + offset, size);
+  sub->data = smem->data;
+  sub->mapped_size = 0;
+  return GST_MEMORY_CAST (sub);
+}
+
+static void
+gst_framebuffersink_staging_allocator_class_init (
+    GstFramebufferSinkStagingAllocatorClass *klass)
+{
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  allocator_class->alloc = gst_framebuffersink_staging_allocator_alloc;
+  allocator_class->free = gst_framebuffersink_staging_allocator_free;
+}
+
+static void
+gst_framebuffersink_staging_allocator_init (
+    GstFramebufferSinkStagingAllocator *staging_allocator)
+{
+  GstAllocator *alloc = GST_ALLOCATOR_CAST (staging_allocator);
+
+  alloc->mem_type = "framebuffersink_staging_memory";
+  alloc->mem_map = gst_framebuffersink_staging_memory_map;
+  alloc->mem_unmap = gst_framebuffersink_staging_memory_unmap;
+  alloc->mem_share = gst_framebuffersink_staging_memory_share;
+}
+
+static GstAllocator *
+gst_framebuffersink_staging_allocator_new (GstFramebufferSink *
+    framebuffersink)
+{
+  GstFramebufferSinkStagingAllocator *staging_allocator =
+      g_object_new (gst_framebuffersink_staging_allocator_get_type (), NULL);
+
+  gst_object_ref_sink (staging_allocator);
+  staging_allocator->hugepages = framebuffersink->staging_hugepages;
+  return GST_ALLOCATOR_CAST (staging_allocator);
+}
+
+/* Buffer pool used for video memory buffer pools. In adaptive mode
+   (adaptive-pool property) it starts with min-pool-buffers buffers and
+   grows on demand up to the number of buffers that fit in video memory. Once
+   per measurement interval the number of buffers that is actually needed is
+   derived from the peak number of buffers outstanding (acquired but not yet
+   released), plus a headroom that grows when acquiring a buffer had to wait
+   for a free one and shrinks again when it didn't. Buffers beyond that are
+   freed when they are released, which returns their video memory to the
+   allocator. */
+
+#define ADAPTIVE_POOL_INTERVAL (G_USEC_PER_SEC)
+#define ADAPTIVE_POOL_WAIT_THRESHOLD (2 * 1000)
+
+typedef struct
+{
+  GstBufferPool parent;
+  /* The pool is used from upstream threads and can outlive the sink, so it
+     only holds a weak reference to it. */
+  GWeakRef framebuffersink;
+  gboolean adaptive;
+  /* Buffer size and bounds from the pool configuration. */
+  guint size;
+  guint min_buffers;
+  guint max_buffers;
+  /* Buffers currently allocated by the pool. */
+  guint allocated;
+  /* Buffers acquired and not yet released (counted for every pool, under
+     the object lock), and the peak in the current measurement interval. */
+  guint outstanding;
+  guint peak_outstanding;
+  guint headroom;
+  /* Number of acquires in the current interval that had to wait. */
+  guint waits;
+  guint target;
+  gint64 interval_start;
+  /* Set once upstream has activated the pool. */
+  gboolean started;
+} GstFramebufferSinkBufferPool;
+
+typedef struct
+{
+  GstBufferPoolClass parent_class;
+} GstFramebufferSinkBufferPoolClass;
+
+GType gst_framebuffersink_buffer_pool_get_type (void);
+G_DEFINE_TYPE (GstFramebufferSinkBufferPool, gst_framebuffersink_buffer_pool,
+    GST_TYPE_BUFFER_POOL);
+
+static gboolean
+gst_framebuffersink_buffer_pool_set_config (GstBufferPool *pool,
+    GstStructure *config)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+  GstCaps *caps;
+
+  if (!GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      set_config (pool, config))
+    return FALSE;
+
+  /* Upstream may have changed the bounds. */
+  gst_buffer_pool_config_get_params (config, &caps, &fbpool->size,
+      &fbpool->min_buffers, &fbpool->max_buffers);
+  fbpool->target = fbpool->max_buffers;
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_framebuffersink_buffer_pool_alloc_buffer (GstBufferPool *pool,
+    GstBuffer **buffer, GstBufferPoolAcquireParams *params)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+  GstFlowReturn res;
+
+  res = GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      alloc_buffer (pool, buffer, params);
+  if (res == GST_FLOW_OK)
+    g_atomic_int_inc (&fbpool->allocated);
+  return res;
+}
+
+static void
+gst_framebuffersink_buffer_pool_free_buffer (GstBufferPool *pool,
+    GstBuffer *buffer)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+
+  g_atomic_int_add (&fbpool->allocated, -1);
+  GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      free_buffer (pool, buffer);
+}
+
+static GstFlowReturn
+gst_framebuffersink_buffer_pool_acquire_buffer (GstBufferPool *pool,
+    GstBuffer **buffer, GstBufferPoolAcquireParams *params)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+  GstFlowReturn res;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  res = GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      acquire_buffer (pool, buffer, params);
+  if (res != GST_FLOW_OK)
+    return res;
+
+  GST_OBJECT_LOCK (pool);
+  fbpool->outstanding++;
+  if (!fbpool->adaptive) {
+    GST_OBJECT_UNLOCK (pool);
+    return res;
+  }
+  if (fbpool->outstanding > fbpool->peak_outstanding)
+    fbpool->peak_outstanding = fbpool->outstanding;
+  if (g_get_monotonic_time () - start > ADAPTIVE_POOL_WAIT_THRESHOLD)
+    fbpool->waits++;
+  GST_OBJECT_UNLOCK (pool);
+  return res;
+}
+
+static void
+gst_framebuffersink_buffer_pool_release_buffer (GstBufferPool *pool,
+    GstBuffer *buffer)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+  gboolean released = FALSE;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  GST_OBJECT_LOCK (pool);
+  /* Every released buffer was acquired from this pool. */
+  g_warn_if_fail (fbpool->outstanding > 0);
+  if (fbpool->outstanding > 0)
+    fbpool->outstanding--;
+  if (!fbpool->adaptive) {
+    GST_OBJECT_UNLOCK (pool);
+    goto release;
+  }
+  if (now - fbpool->interval_start >= ADAPTIVE_POOL_INTERVAL) {
+    /* Adjust the headroom and the target pool size. */
+    if (fbpool->waits > 0)
+      fbpool->headroom++;
+    else if (fbpool->headroom > 1)
+      fbpool->headroom--;
+    fbpool->target = CLAMP (fbpool->peak_outstanding + fbpool->headroom,
+        MAX (fbpool->min_buffers, 1), fbpool->max_buffers > 0 ?
+        fbpool->max_buffers : G_MAXUINT);
+    GST_DEBUG_OBJECT (fbpool,
+        "Adaptive pool: %u allocated, peak %u outstanding, %u waits, "
+        "target %u", (guint) g_atomic_int_get (&fbpool->allocated),
+        fbpool->peak_outstanding, fbpool->waits, fbpool->target);
+    fbpool->peak_outstanding = fbpool->outstanding;
+    fbpool->waits = 0;
+    fbpool->interval_start = now;
+  }
+  /* Let the pool free the buffer instead of keeping it when there are more
+     buffers than needed. */
+  if ((guint) g_atomic_int_get (&fbpool->allocated) > fbpool->target) {
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_TAG_MEMORY);
+    released = TRUE;
+  }
+  GST_OBJECT_UNLOCK (pool);
+
+  if (released) {
+    GstFramebufferSink *framebuffersink =
+        g_weak_ref_get (&fbpool->framebuffersink);
+    if (framebuffersink != NULL) {
+      g_atomic_int_inc (&framebuffersink->stats_pool_buffers_released);
+      gst_object_unref (framebuffersink);
+    }
+  }
+
+release:
+  GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      release_buffer (pool, buffer);
+}
+
+static gboolean
+gst_framebuffersink_buffer_pool_start (GstBufferPool *pool)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+
+  if (!GST_BUFFER_POOL_CLASS (gst_framebuffersink_buffer_pool_parent_class)->
+      start (pool))
+    return FALSE;
+  GST_OBJECT_LOCK (pool);
+  fbpool->started = TRUE;
+  GST_OBJECT_UNLOCK (pool);
+  return TRUE;
+}
+
+/* Whether upstream may still use the pool: it has buffers out, is active,
+   or was handed out and not activated yet. */
+
+static gboolean
+gst_framebuffersink_buffer_pool_in_use (GstBufferPool *pool)
+{
+  GstFramebufferSinkBufferPool *fbpool = (GstFramebufferSinkBufferPool *) pool;
+  gboolean in_use;
+
+  GST_OBJECT_LOCK (pool);
+  in_use = fbpool->outstanding > 0 || !fbpool->started;
+  GST_OBJECT_UNLOCK (pool);
+  return in_use || gst_buffer_pool_is_active (pool);
+}
+
+static void
+gst_framebuffersink_buffer_pool_finalize (GObject *object)
+{
+  GstFramebufferSinkBufferPool *fbpool =
+      (GstFramebufferSinkBufferPool *) object;
+
+  /* The buffers hold a reference to the pool, so none can be out now. A
+     failure here means the accounting that decides when a pool is retired
+     is wrong. */
+  g_warn_if_fail (fbpool->outstanding == 0);
+  g_weak_ref_clear (&fbpool->framebuffersink);
+
+  G_OBJECT_CLASS (gst_framebuffersink_buffer_pool_parent_class)->finalize (
+      object);
+}
+
+static void
+gst_framebuffersink_buffer_pool_class_init (
+    GstFramebufferSinkBufferPoolClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+  gobject_class->finalize = gst_framebuffersink_buffer_pool_finalize;
+
+  pool_class->start = gst_framebuffersink_buffer_pool_start;
+  pool_class->set_config = gst_framebuffersink_buffer_pool_set_config;
+  pool_class->alloc_buffer = gst_framebuffersink_buffer_pool_alloc_buffer;
+  pool_class->free_buffer = gst_framebuffersink_buffer_pool_free_buffer;
+  pool_class->acquire_buffer = gst_framebuffersink_buffer_pool_acquire_buffer;
+  pool_class->release_buffer = gst_framebuffersink_buffer_pool_release_buffer;
+}
+
+static void
+gst_framebuffersink_buffer_pool_init (GstFramebufferSinkBufferPool *fbpool)
+{
+  fbpool->headroom = 1;
+  fbpool->interval_start = g_get_monotonic_time ();
+}
+
+static GstBufferPool *
+gst_framebuffersink_buffer_pool_new (GstFramebufferSink *framebuffersink)
+{
+  GstFramebufferSinkBufferPool *fbpool =
+      g_object_new (gst_framebuffersink_buffer_pool_get_type (), NULL);
+
+  g_weak_ref_init (&fbpool->framebuffersink, framebuffersink);
+  fbpool->adaptive = framebuffersink->adaptive_pool;
+  return GST_BUFFER_POOL_CAST (fbpool);
+}
+
+/* Video memory pools handed out are tracked so that they can be retired
+   when the caps change, and so that the video memory they use is known when
+   another pool is requested. A pool that upstream has activated, then
+   deactivated, and of which no buffers are out (including those the sink
+   holds for scanout) has been dropped by upstream. Retired pools are
+   deactivated, which frees their buffers once the last one has been
+   returned. */
+
+static void
+gst_framebuffersink_track_pool (GstFramebufferSink *framebuffersink,
+    GstBufferPool *pool)
+{
+  framebuffersink->video_memory_pools = g_list_prepend (
+      framebuffersink->video_memory_pools, gst_object_ref (pool));
+}
+
+static void
+gst_framebuffersink_retire_pools (GstFramebufferSink *framebuffersink,
+    gboolean all)
+{
+  GList *l, *next;
+
+  for (l = framebuffersink->video_memory_pools; l != NULL; l = next) {
+    GstBufferPool *pool = l->data;
+    next = l->next;
+    if (!all && gst_framebuffersink_buffer_pool_in_use (pool))
+      continue;
+    framebuffersink->video_memory_pools = g_list_delete_link (
+        framebuffersink->video_memory_pools, l);
+    gst_buffer_pool_set_active (pool, FALSE);
+    gst_object_unref (pool);
+  }
+}
+
+/* Video memory held by the tracked pools. */
+
+static gsize
+gst_framebuffersink_pools_video_memory_used (GstFramebufferSink *
+    framebuffersink)
+{
+  GList *l;
+  gsize used = 0;
+
+  for (l = framebuffersink->video_memory_pools; l != NULL; l = l->next) {
+    GstFramebufferSinkBufferPool *fbpool = l->data;
+    used += (gsize) fbpool->size * (guint) g_atomic_int_get (
+        &fbpool->allocated);
+  }
+  return used;
+}
+
+/* Number of buffers in a video memory buffer pool. In adaptive mode the pool
+   starts small and grows up to max_buffers. */
+
+static void
+gst_framebuffersink_get_pool_buffer_range (GstFramebufferSink *framebuffersink,
+    guint *min_buffers, guint *max_buffers)
+{
+  int n;
+
+  n = framebuffersink->nu_screens_used;
+  if (framebuffersink->use_hardware_overlay)
+    n = framebuffersink->nu_overlays_used;
+
+#ifdef HALF_POOLS
+  n /= 2;
+#endif
+  *max_buffers = n;
+  *min_buffers = n;
+  if (framebuffersink->adaptive_pool &&
+      framebuffersink->min_pool_buffers < n)
+    *min_buffers = MAX (framebuffersink->min_pool_buffers,
+        MIN (SCANOUT_HELD_BUFFERS + 1, n));
+}
+
 /* This function is called from set_caps when we are configured with */
 /* use_buffer_pool=true, and from propose_allocation */
 
@@ -1526,45 +2877,36 @@ static GstBufferPool *
 gst_framebuffersink_allocate_buffer_pool (GstFramebufferSink *framebuffersink,
     GstCaps *caps, GstVideoInfo *info)
 {
-  GstFramebufferSinkClass *klass = GST_FRAMEBUFFERSINK_GET_CLASS (
-      framebuffersink);
   GstStructure *config;
   GstBufferPool *newpool;
   GstAllocator *allocator;
-  int n;
+  guint min_buffers, max_buffers;
   char s[256];
 
   GST_DEBUG("allocate_buffer_pool, caps: %" GST_PTR_FORMAT, caps);
 
   /* Create a new pool for the new configuration. */
-  newpool = gst_buffer_pool_new ();
+  newpool = gst_framebuffersink_buffer_pool_new (framebuffersink);
 
   config = gst_buffer_pool_get_config (newpool);
 
-  n = framebuffersink->nu_screens_used;
-  if (framebuffersink->use_hardware_overlay)
-    n = framebuffersink->nu_overlays_used;
-
-#ifdef HALF_POOLS
-  n /= 2;
-#endif
-  gst_buffer_pool_config_set_params (config, caps, info->size, n, n);
+  gst_framebuffersink_get_pool_buffer_range (framebuffersink, &min_buffers,
+      &max_buffers);
+  gst_buffer_pool_config_set_params (config, caps, info->size, min_buffers,
+      max_buffers);
 
   if (framebuffersink->use_hardware_overlay) {
     /* Make sure one screen is allocated when using the hardware overlay. */
     if (framebuffersink->screens == NULL) {
       framebuffersink->screens = g_slice_alloc (sizeof (GstMemory *) * 1);
       /* Use the default alignment for the screen video memory allocator. */
-      framebuffersink->screens[0] = gst_allocator_alloc(
-          framebuffersink->screen_video_memory_allocator, GST_VIDEO_INFO_SIZE (
-          &framebuffersink->screen_info), NULL);
+      framebuffersink->screens[0] = gst_framebuffersink_alloc_video_memory (
+          framebuffersink, framebuffersink->screen_video_memory_allocator,
+          GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info));
     }
     /* Create the overlay allocator. */
-    if (!framebuffersink->overlay_video_memory_allocator)
-      framebuffersink->overlay_video_memory_allocator =
-          klass->video_memory_allocator_new (
-          framebuffersink, info, FALSE, TRUE);
-    allocator = framebuffersink->overlay_video_memory_allocator;
+    allocator = gst_framebuffersink_get_overlay_allocator (framebuffersink,
+        info);
   }
   else {
     allocator = framebuffersink->screen_video_memory_allocator;
@@ -1575,8 +2917,15 @@ gst_framebuffersink_allocate_buffer_pool (GstFramebufferSink *framebuffersink,
   if (!gst_buffer_pool_set_config (newpool, config))
     goto config_failed;
 
-  g_sprintf(s, "Succesfully allocated buffer pool (frame size %zd, %d buffers)",
-      info->size, n);
+  gst_framebuffersink_track_pool (framebuffersink, newpool);
+  framebuffersink->stats_video_memory_pools++;
+
+  if (min_buffers < max_buffers)
+    g_sprintf(s, "Succesfully allocated adaptive buffer pool (frame size %zd, "
+        "%d to %d buffers)", info->size, min_buffers, max_buffers);
+  else
+    g_sprintf(s, "Succesfully allocated buffer pool (frame size %zd, "
+        "%d buffers)", info->size, max_buffers);
   GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
 
 #if 0
@@ -1772,57 +3121,234 @@ static void gst_framebuffersink_calculate_overlay_size (GstFramebufferSink *
     framebuffersink->overlay_alignment_is_native = FALSE;
 }
 
-/* This function is called when the GstBaseSink should prepare itself */
-/* for a given media format. It practice it may be called twice with the */
-/* same caps, so we have to detect that. */
+/* Video memory is kept across renegotiation (resolution changes with adaptive
+   streaming, channel changes) in a cache of blocks, so that a new
+   configuration that fits reuses them instead of freeing and reallocating
+   everything. Blocks that are on screen when the caps change are only reused
+   as the last buffer in flip order, or freed after the first frame of the new
+   configuration has been shown. */
 
-static gboolean
-gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
+static void
+gst_framebuffersink_cache_video_memory (GstFramebufferSink *framebuffersink,
+    GstMemory *mem, gboolean displayed)
 {
-  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (sink);
-  GstFramebufferSinkClass *klass =
-      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
-  GstVideoInfo info;
-  GstVideoFormat matched_overlay_format;
-  GstVideoRectangle src_video_rectangle;
-  GstVideoRectangle screen_video_rectangle;
-  int i;
+  if (mem == NULL)
+    return;
+  if (displayed) {
+    framebuffersink->cached_video_memory = g_list_append (
+        framebuffersink->cached_video_memory, mem);
+    framebuffersink->retiring_video_memory = g_list_prepend (
+        framebuffersink->retiring_video_memory, mem);
+  }
+  else
+    framebuffersink->cached_video_memory = g_list_prepend (
+        framebuffersink->cached_video_memory, mem);
+}
 
-  if (!gst_video_info_from_caps (&info, caps))
-    goto invalid_format;
+static void
+gst_framebuffersink_retire_video_memory (GstFramebufferSink *framebuffersink)
+{
+  int i, n;
 
-  GST_OBJECT_LOCK (framebuffersink);
+  /* Screens. In overlay mode the single screen is always shown, otherwise
+     the screen before the current flip index is. */
+  n = framebuffersink->nu_screens_used;
+  if (framebuffersink->screens != NULL) {
+    for (i = 0; i < n; i++)
+      gst_framebuffersink_cache_video_memory (framebuffersink,
+          framebuffersink->screens[i], framebuffersink->use_hardware_overlay ||
+          i == (framebuffersink->current_framebuffer_index + n - 1) % n);
+    if (n > 0)
+      g_slice_free1 (sizeof (GstMemory *) * n, framebuffersink->screens);
+  }
+  if (framebuffersink->screen_video_rectangles != NULL) {
+    if (n > 0)
+      g_slice_free1 (sizeof (GstVideoRectangle) * n,
+          framebuffersink->screen_video_rectangles);
+    framebuffersink->screen_video_rectangles = NULL;
+  }
 
-  if (gst_video_info_is_equal(&info, &framebuffersink->video_info)) {
-    GST_OBJECT_UNLOCK (framebuffersink);
-    GST_WARNING_OBJECT (framebuffersink, "set_caps called with same caps");
-    return TRUE;
+  /* Overlays. */
+  n = framebuffersink->nu_overlays_used;
+  if (framebuffersink->overlays != NULL) {
+    for (i = 0; i < n; i++)
+      gst_framebuffersink_cache_video_memory (framebuffersink,
+          framebuffersink->overlays[i],
+          i == (framebuffersink->current_overlay_index + n - 1) % n);
+    if (n > 0)
+      g_slice_free1 (sizeof (GstMemory *) * n, framebuffersink->overlays);
   }
 
-  GST_INFO_OBJECT (framebuffersink, "Negotiated caps: %" GST_PTR_FORMAT "\n",
-      caps);
+  /* Staging blocks; one of them may be on screen. */
+  for (i = 0; i < 3; i++) {
+    gst_framebuffersink_cache_video_memory (framebuffersink,
+        framebuffersink->staging_memory[i], TRUE);
+    framebuffersink->staging_memory[i] = NULL;
+  }
 
-  /* Set the video parameters for GstVideoSink. */
-  framebuffersink->videosink.width = info.width;
-  framebuffersink->videosink.height = info.height;
+  framebuffersink->current_framebuffer_index = 0;
+  framebuffersink->current_overlay_index = 0;
+  framebuffersink->nu_screens_used = 0;
+  framebuffersink->screens = NULL;
+  framebuffersink->nu_overlays_used = 0;
+  framebuffersink->overlays = NULL;
+  framebuffersink->retiring_video_memory_presented = 0;
 
-  if (framebuffersink->videosink.width <= 0 ||
-      framebuffersink->videosink.height <= 0)
-    goto no_display_size;
+  /* Pools that were already handed out upstream are owned by upstream;
+     deactivating frees their buffers once upstream has returned them. */
+  if (framebuffersink->pool) {
+    gst_buffer_pool_set_active (framebuffersink->pool, FALSE);
+    gst_object_unref (framebuffersink->pool);
+    framebuffersink->pool = NULL;
+  }
 
-  gst_framebuffersink_calculate_plane_widths(framebuffersink, &info);
+  /* The overlay allocator may be reused if the new configuration is
+     compatible; see gst_framebuffersink_get_overlay_allocator. */
+  if (framebuffersink->overlay_video_memory_allocator) {
+    if (framebuffersink->previous_overlay_video_memory_allocator)
+      g_object_unref (framebuffersink->previous_overlay_video_memory_allocator);
+    framebuffersink->previous_overlay_video_memory_allocator =
+        framebuffersink->overlay_video_memory_allocator;
+    framebuffersink->overlay_video_memory_allocator = NULL;
+  }
+}
 
-  matched_overlay_format = GST_VIDEO_INFO_FORMAT (&info);
-  if (!gst_framebuffersink_video_format_supported_by_overlay (framebuffersink,
-      matched_overlay_format))
-    matched_overlay_format = GST_VIDEO_FORMAT_UNKNOWN;
+/* On renegotiation, once the new caps have been validated, keep the video
+   memory of the previous configuration for reuse, and retire the pools
+   provided for the previous caps. */
+
+static void
+gst_framebuffersink_retire_configuration (GstFramebufferSink *framebuffersink)
+{
+  gst_framebuffersink_retire_pools (framebuffersink, TRUE);
+  gst_framebuffersink_retire_video_memory (framebuffersink);
+}
+
+/* Free cached blocks. When all is FALSE, blocks of the current screen and
+   overlay allocators are kept for a later renegotiation. Blocks that are
+   still on screen are left to gst_framebuffersink_free_retiring_video_memory.
+   */
+
+static void
+gst_framebuffersink_flush_video_memory_cache (
+    GstFramebufferSink *framebuffersink, gboolean all)
+{
+  GList *l, *next;
+
+  for (l = framebuffersink->cached_video_memory; l != NULL; l = next) {
+    GstMemory *mem = l->data;
+    next = l->next;
+    if (!all && (mem->allocator ==
+        framebuffersink->screen_video_memory_allocator ||
+        mem->allocator == framebuffersink->overlay_video_memory_allocator))
+      continue;
+    framebuffersink->cached_video_memory = g_list_delete_link (
+        framebuffersink->cached_video_memory, l);
+    if (g_list_find (framebuffersink->retiring_video_memory, mem) == NULL)
+      gst_allocator_free (mem->allocator, mem);
+  }
+}
+
+/* Called once the display has moved off the blocks that were on screen at
+   renegotiation, i.e. once a presented frame of the new configuration has
+   been replaced by the next one. Blocks that are still cached stay in the
+   cache. */
+
+static void
+gst_framebuffersink_free_retiring_video_memory (
+    GstFramebufferSink *framebuffersink)
+{
+  GList *l;
+
+  for (l = framebuffersink->retiring_video_memory; l != NULL; l = l->next) {
+    GstMemory *mem = l->data;
+    if (g_list_find (framebuffersink->cached_video_memory, mem) == NULL)
+      gst_allocator_free (mem->allocator, mem);
+  }
+  g_list_free (framebuffersink->retiring_video_memory);
+  framebuffersink->retiring_video_memory = NULL;
+  framebuffersink->retiring_video_memory_presented = 0;
+}
+
+/* Allocate a block of video memory, preferably a cached one of at least the
+   requested size. */
+
+static GstMemory *
+gst_framebuffersink_alloc_video_memory (GstFramebufferSink *framebuffersink,
+    GstAllocator *allocator, gsize size)
+{
+  GList *l;
+  GstMemory *mem;
+
+  for (l = framebuffersink->cached_video_memory; l != NULL; l = l->next) {
+    mem = l->data;
+    if (mem->allocator == allocator && mem->maxsize >= size) {
+      framebuffersink->cached_video_memory = g_list_delete_link (
+          framebuffersink->cached_video_memory, l);
+      framebuffersink->retiring_video_memory = g_list_remove (
+          framebuffersink->retiring_video_memory, mem);
+      if (mem->size != size)
+        gst_memory_resize (mem, - mem->offset, size);
+      framebuffersink->stats_video_memory_reused++;
+      return mem;
+    }
+  }
+
+  mem = gst_allocator_alloc (allocator, size, NULL);
+  if (mem == NULL && framebuffersink->cached_video_memory != NULL) {
+    /* Cached blocks that don't fit may be holding the memory we need. */
+    gst_framebuffersink_flush_video_memory_cache (framebuffersink, TRUE);
+    mem = gst_allocator_alloc (allocator, size, NULL);
+  }
+  return mem;
+}
+
+/* Return the overlay allocator for the current configuration, reusing the
+   one of the previous configuration when the subclass allows it. */
+
+static GstAllocator *
+gst_framebuffersink_get_overlay_allocator (GstFramebufferSink *framebuffersink,
+    GstVideoInfo *info)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+
+  if (framebuffersink->overlay_video_memory_allocator)
+    return framebuffersink->overlay_video_memory_allocator;
+
+  if (framebuffersink->previous_overlay_video_memory_allocator) {
+    if (klass->video_memory_allocator_is_reusable (framebuffersink,
+        framebuffersink->previous_overlay_video_memory_allocator, info))
+      framebuffersink->overlay_video_memory_allocator =
+          framebuffersink->previous_overlay_video_memory_allocator;
+    else
+      g_object_unref (framebuffersink->previous_overlay_video_memory_allocator);
+    framebuffersink->previous_overlay_video_memory_allocator = NULL;
+  }
+
+  if (!framebuffersink->overlay_video_memory_allocator)
+    framebuffersink->overlay_video_memory_allocator =
+        klass->video_memory_allocator_new (framebuffersink, info, FALSE, TRUE);
+  return framebuffersink->overlay_video_memory_allocator;
+}
+
+/* Calculate the output window in screen coordinates from the video size and
+   the x, y, width and height properties. When scaling is FALSE the video is
+   shown at its own size, clipped against the screen. */
+
+static void
+gst_framebuffersink_calculate_video_rectangle (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info, gboolean scaling)
+{
+  GstVideoRectangle src_video_rectangle;
+  GstVideoRectangle screen_video_rectangle;
 
   /* Set the dimensions of the source video rectangle and screen video
      rectangle. */
   src_video_rectangle.x = 0;
   src_video_rectangle.y = 0;
-  src_video_rectangle.w = info.width;
-  src_video_rectangle.h = info.height;
+  src_video_rectangle.w = info->width;
+  src_video_rectangle.h = info->height;
   screen_video_rectangle.x = 0;
   screen_video_rectangle.y = 0;
   screen_video_rectangle.w =
@@ -1831,15 +3357,27 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
       (&framebuffersink->screen_info);
 
   /* Clip and center video rectangle. */
-  if (matched_overlay_format == GST_VIDEO_FORMAT_UNKNOWN) {
-    if (framebuffersink->preserve_par && (info.par_n !=
-        framebuffersink->screen_info.par_n ||
-        info.par_d != framebuffersink->screen_info.par_d))
-      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
-          "Cannot preserve aspect ratio in non-hardware scaling mode");
+  if (!scaling) {
     /* No scaling; clip and center against the dimensions of the screen. */
     gst_video_sink_center_rect (src_video_rectangle, screen_video_rectangle,
         &framebuffersink->video_rectangle, FALSE);
+
+    /* If x y is set, use x y as the display position, clipping the video
+       against the right and bottom edges of the screen. */
+    if (framebuffersink->requested_video_x != -1) {
+      framebuffersink->video_rectangle.x =
+          MIN (MAX (framebuffersink->requested_video_x, 0),
+          screen_video_rectangle.w - 1);
+      framebuffersink->video_rectangle.w = MIN (src_video_rectangle.w,
+          screen_video_rectangle.w - framebuffersink->video_rectangle.x);
+    }
+    if (framebuffersink->requested_video_y != -1) {
+      framebuffersink->video_rectangle.y =
+          MIN (MAX (framebuffersink->requested_video_y, 0),
+          screen_video_rectangle.h - 1);
+      framebuffersink->video_rectangle.h = MIN (src_video_rectangle.h,
+          screen_video_rectangle.h - framebuffersink->video_rectangle.y);
+    }
   }
   else {
     /* Set video rectangle when hardware scaler is enabled. */
@@ -1847,21 +3385,21 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
     GstVideoRectangle temp_video_rectangle;
     dst_video_rectangle.x = 0;
     dst_video_rectangle.y = 0;
-    dst_video_rectangle.w = info.width;
-    dst_video_rectangle.h = info.height;
+    dst_video_rectangle.w = info->width;
+    dst_video_rectangle.h = info->height;
     /* When using the hardware scaler, the incoming video size may not match
        the desired window size. */
     if (framebuffersink->requested_video_width != 0 &&
-        framebuffersink->requested_video_width != info.width)
+        framebuffersink->requested_video_width != info->width)
       dst_video_rectangle.w = framebuffersink->requested_video_width;
     if (framebuffersink->requested_video_height != 0 &&
-        framebuffersink->requested_video_height != info.height)
+        framebuffersink->requested_video_height != info->height)
       dst_video_rectangle.h = framebuffersink->requested_video_height;
     /* Correct for aspect ratio if preserve_par property is set. */
     if (framebuffersink->preserve_par) {
       src_video_rectangle.w = gst_util_uint64_scale_round (
-          src_video_rectangle.w, info.par_d *
-          framebuffersink->screen_info.par_d, info.par_n *
+          src_video_rectangle.w, info->par_d *
+          framebuffersink->screen_info.par_d, info->par_n *
           framebuffersink->screen_info.par_n);
       GST_DEBUG_OBJECT (framebuffersink,
          "Source video rectangle after correction of size (%u, %u)",
@@ -1886,16 +3424,95 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
       framebuffersink->video_rectangle.x = framebuffersink->requested_video_x;
     if (framebuffersink->requested_video_y != -1)
       framebuffersink->video_rectangle.y = framebuffersink->requested_video_y;
-
-    GST_INFO_OBJECT (framebuffersink,
-        "Display rectangle at (%u, %u) of size (%u, %u)",
-        framebuffersink->video_rectangle.x, framebuffersink->video_rectangle.y,
-        framebuffersink->video_rectangle.w, framebuffersink->video_rectangle.h);
   }
 
+  GST_INFO_OBJECT (framebuffersink,
+      "Display rectangle at (%u, %u) of size (%u, %u)",
+      framebuffersink->video_rectangle.x, framebuffersink->video_rectangle.y,
+      framebuffersink->video_rectangle.w, framebuffersink->video_rectangle.h);
+
   framebuffersink->video_rectangle_width_in_bytes =
       framebuffersink->video_rectangle.w *
       GST_VIDEO_INFO_COMP_PSTRIDE (&framebuffersink->screen_info, 0);
+}
+
+/* This function is called when the GstBaseSink should prepare itself */
+/* for a given media format. It practice it may be called twice with the */
+/* same caps, so we have to detect that. */
+
+static gboolean
+gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
+{
+  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (sink);
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstVideoInfo info;
+  GstVideoFormat matched_overlay_format;
+  int i;
+
+  if (!gst_video_info_from_caps (&info, caps))
+    goto invalid_format;
+
+  GST_OBJECT_LOCK (framebuffersink);
+
+  if (gst_video_info_is_equal(&info, &framebuffersink->video_info)) {
+    GST_OBJECT_UNLOCK (framebuffersink);
+    GST_WARNING_OBJECT (framebuffersink, "set_caps called with same caps");
+    return TRUE;
+  }
+
+  /* The overlay and its preferences may change below. */
+  gst_framebuffersink_clear_caps_cache (framebuffersink);
+
+  GST_INFO_OBJECT (framebuffersink, "Negotiated caps: %" GST_PTR_FORMAT "\n",
+      caps);
+
+  if (framebuffersink->match_refresh_rate && GST_VIDEO_INFO_FPS_N (&info) > 0)
+    klass->match_display_mode (framebuffersink, &info);
+
+  /* Set the video parameters for GstVideoSink. */
+  framebuffersink->videosink.width = info.width;
+  framebuffersink->videosink.height = info.height;
+
+  if (framebuffersink->videosink.width <= 0 ||
+      framebuffersink->videosink.height <= 0)
+    goto no_display_size;
+
+  gst_framebuffersink_calculate_plane_widths(framebuffersink, &info);
+
+  matched_overlay_format = GST_VIDEO_INFO_FORMAT (&info);
+  if (!gst_framebuffersink_video_format_supported_by_overlay (framebuffersink,
+      matched_overlay_format))
+    matched_overlay_format = GST_VIDEO_FORMAT_UNKNOWN;
+
+  /* Formats the overlay doesn't support may be converted into one it does
+     while uploading. */
+  framebuffersink->overlay_convert_to_nv12 = FALSE;
+  framebuffersink->overlay_narrow_shift = 0;
+  framebuffersink->overlay_interlaced = GST_VIDEO_INFO_IS_INTERLACED (&info);
+  for (i = 0; i < G_N_ELEMENTS (overlay_upload_conversions) &&
+      matched_overlay_format == GST_VIDEO_FORMAT_UNKNOWN; i++)
+    if (GST_VIDEO_INFO_FORMAT (&info) ==
+        overlay_upload_conversions[i].format &&
+        gst_framebuffersink_video_format_supported_by_overlay (framebuffersink,
+        overlay_upload_conversions[i].overlay_format)) {
+      matched_overlay_format = overlay_upload_conversions[i].overlay_format;
+      framebuffersink->overlay_convert_to_nv12 =
+          overlay_upload_conversions[i].format == GST_VIDEO_FORMAT_I420;
+      framebuffersink->overlay_narrow_shift =
+          overlay_upload_conversions[i].narrow_shift;
+    }
+
+  if (matched_overlay_format == GST_VIDEO_FORMAT_UNKNOWN &&
+      framebuffersink->preserve_par && (info.par_n !=
+      framebuffersink->screen_info.par_n ||
+      info.par_d != framebuffersink->screen_info.par_d))
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+        "Cannot preserve aspect ratio in non-hardware scaling mode");
+
+  gst_framebuffersink_calculate_video_rectangle (framebuffersink, &info,
+      matched_overlay_format != GST_VIDEO_FORMAT_UNKNOWN);
+  framebuffersink->video_rectangle_changed = FALSE;
 
   if (framebuffersink->video_rectangle_width_in_bytes <= 0 ||
       framebuffersink->video_rectangle.h <= 0)
@@ -1919,18 +3536,23 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
     gboolean overlay_video_alignment_matches;
     int max_overlays;
     int first_overlay_offset;
+    GstVideoInfo overlay_info = info;
     /* The video dimensions are different from the requested ones, or the video
        format is not equal to the framebuffer format, and we are allowed to use
        the hardware overlay. */
-    if (!klass->get_overlay_video_alignment (framebuffersink, &info,
+    if (matched_overlay_format != GST_VIDEO_INFO_FORMAT (&info))
+      gst_video_info_set_format (&overlay_info, matched_overlay_format,
+          GST_VIDEO_INFO_WIDTH (&info), GST_VIDEO_INFO_HEIGHT (&info));
+    if (!klass->get_overlay_video_alignment (framebuffersink, &overlay_info,
         &overlay_video_alignment, &overlay_align,
         &overlay_video_alignment_matches))
       goto no_overlay;
     /* Calculate the overlay total size and alignment, and plane offsets and
        strides in video memory. */
-    gst_framebuffersink_calculate_overlay_size (framebuffersink, &info,
+    gst_framebuffersink_calculate_overlay_size (framebuffersink, &overlay_info,
         &overlay_video_alignment, overlay_align,
-        overlay_video_alignment_matches);
+        overlay_video_alignment_matches &&
+        matched_overlay_format == GST_VIDEO_INFO_FORMAT (&info));
     /* Calculate how may overlays fit in the available video memory (after the
        visible  screen). */
     first_overlay_offset = GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info);
@@ -1944,11 +3566,13 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
       max_overlays = 30;
     if (max_overlays >= 2 && klass->prepare_overlay (framebuffersink,
         matched_overlay_format)) {
+      gst_framebuffersink_retire_configuration (framebuffersink);
       /* Use the hardware overlay. */
       framebuffersink->nu_screens_used = 1;
       framebuffersink->nu_overlays_used = max_overlays;
       if (framebuffersink->use_buffer_pool) {
-        if (framebuffersink->overlay_alignment_is_native) {
+        if (framebuffersink->overlay_alignment_is_native &&
+            framebuffersink->nu_overlays_used > SCANOUT_HELD_BUFFERS) {
           GstBufferPool *pool;
           pool = gst_framebuffersink_allocate_buffer_pool (framebuffersink,
               caps, &info);
@@ -1964,10 +3588,18 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
         }
         framebuffersink->use_buffer_pool = FALSE;
         if (!framebuffersink->silent) {
-          if (!framebuffersink->overlay_alignment_is_native)
+          if (matched_overlay_format != GST_VIDEO_INFO_FORMAT (&info))
+            GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+                "Video is converted to the overlay format while uploading, "
+                "overlay buffer-pool mode is impossible");
+          else if (!framebuffersink->overlay_alignment_is_native)
             GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
                 "Alignment restrictions make overlay buffer-pool mode "
                 "impossible for this video size");
+          else
+            GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+                "Not enough video memory for an overlay buffer pool "
+                "(need at least three overlays)");
           GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
               "Falling back to non buffer-pool mode");
         }
@@ -1980,18 +3612,20 @@ gst_framebuffersink_set_caps (GstBaseSink * sink, GstCaps * caps)
     }
   }
 
-no_overlay:
-  if (framebuffersink->use_hardware_overlay) {
-    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
-        "Disabling hardware overlay");
-    framebuffersink->use_hardware_overlay = FALSE;
-  }
-
+no_overlay:
   if (matched_overlay_format != GST_VIDEO_FORMAT_UNKNOWN &&
       matched_overlay_format !=
       GST_VIDEO_INFO_FORMAT (&framebuffersink->screen_info))
     goto overlay_failed;
 
+  gst_framebuffersink_retire_configuration (framebuffersink);
+
+  if (framebuffersink->use_hardware_overlay) {
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+        "Disabling hardware overlay");
+    framebuffersink->use_hardware_overlay = FALSE;
+  }
+
 reconfigure:
 
   /* When using buffer pools, do the appropriate checks and allocate a
@@ -2005,10 +3639,10 @@ reconfigure:
     framebuffersink->use_buffer_pool = FALSE;
   }
   if (framebuffersink->use_buffer_pool &&
-      framebuffersink->max_framebuffers < 2) {
+      framebuffersink->max_framebuffers <= SCANOUT_HELD_BUFFERS) {
     GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
         "Not enough framebuffer memory to use a buffer pool "
-        "(need at least two framebuffers)");
+        "(need at least three framebuffers)");
      framebuffersink->use_buffer_pool = FALSE;
   }
   framebuffersink->nu_screens_used = 1;
@@ -2064,10 +3698,10 @@ success:
     framebuffersink->screens = g_slice_alloc (sizeof (GstMemory *) *
         framebuffersink->nu_screens_used);
     for (i = 0; i < framebuffersink->nu_screens_used; i++) {
-      framebuffersink->screens[i] = gst_allocator_alloc (
-        framebuffersink->screen_video_memory_allocator,
+      framebuffersink->screens[i] = gst_framebuffersink_alloc_video_memory (
+        framebuffersink, framebuffersink->screen_video_memory_allocator,
         GST_VIDEO_INFO_HEIGHT (&framebuffersink->screen_info) *
-        GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info, 0), NULL);
+        GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info, 0));
       if (framebuffersink->screens[i] == NULL) {
         s = g_strdup_printf ("Could only allocate %d screen buffers", i);
         GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);
@@ -2076,12 +3710,23 @@ success:
         break;
       }
     }
+    framebuffersink->screen_video_rectangles = g_slice_alloc (
+        sizeof (GstVideoRectangle) * framebuffersink->nu_screens_used);
+    for (i = 0; i < framebuffersink->nu_screens_used; i++)
+      framebuffersink->screen_video_rectangles[i] =
+          framebuffersink->video_rectangle;
   }
 
 finish:
 
   framebuffersink->video_info = info;
 
+  /* Free cached video memory that was not reused and can't be reused later.
+     In buffer-pool mode the pool allocates from the same video memory, so
+     nothing is kept. */
+  gst_framebuffersink_flush_video_memory_cache (framebuffersink,
+      framebuffersink->use_buffer_pool);
+
   /* Clear all used framebuffers to black. */
   if (framebuffersink->clear) {
     if (framebuffersink->use_hardware_overlay)
@@ -2098,18 +3743,19 @@ finish:
 success_overlay:
 
   if (!framebuffersink->use_buffer_pool) {
+    GstAllocator *overlay_allocator;
     framebuffersink->screens = g_slice_alloc (sizeof (GstMemory *));
-    framebuffersink->screens[0] = gst_allocator_alloc (
-        framebuffersink->screen_video_memory_allocator,
+    framebuffersink->screens[0] = gst_framebuffersink_alloc_video_memory (
+        framebuffersink, framebuffersink->screen_video_memory_allocator,
         GST_VIDEO_INFO_HEIGHT (&framebuffersink->screen_info) *
-        GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info, 0), NULL);
-    framebuffersink->overlay_video_memory_allocator =
-        klass->video_memory_allocator_new (framebuffersink, &info, FALSE, TRUE);
+        GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info, 0));
+    overlay_allocator = gst_framebuffersink_get_overlay_allocator (
+        framebuffersink, &info);
     framebuffersink->overlays = g_slice_alloc (sizeof (GstMemory *) *
         framebuffersink->nu_overlays_used);
     for (i = 0; i < framebuffersink->nu_overlays_used; i++) {
-      framebuffersink->overlays[i] = gst_allocator_alloc (
-          framebuffersink->overlay_video_memory_allocator, info.size, NULL);
+      framebuffersink->overlays[i] = gst_framebuffersink_alloc_video_memory (
+          framebuffersink, overlay_allocator, info.size);
       if (framebuffersink->overlays[i] == NULL) {
         framebuffersink->nu_overlays_used = i;
         break;
@@ -2124,6 +3770,11 @@ success_overlay:
         framebuffersink->nu_overlays_used,
         gst_video_format_to_string (matched_overlay_format));
     GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, s);
+    if (framebuffersink->overlay_interlaced)
+      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+          framebuffersink->use_interlaced_scan && !framebuffersink->bob ?
+          "Interlaced video is deinterlaced by the display engine" :
+          "Interlaced video is shown one field at a time (bob)");
   }
   goto finish;
 
@@ -2163,6 +3814,9 @@ static void
 gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
 {
   int i;
+
+  gst_framebuffersink_release_scanout_buffers (framebuffersink);
+
   /* Free screen buffers, but be careful because in buffer-pool mode,
      nu_screens_used will be > 0 but screens will be NULL. */
   if (framebuffersink->screens != NULL)  {
@@ -2173,6 +3827,13 @@ gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
       g_slice_free1 (sizeof (GstMemory *) * framebuffersink->nu_screens_used,
           framebuffersink->screens);
   }
+  if (framebuffersink->screen_video_rectangles != NULL) {
+    if (framebuffersink->nu_screens_used > 0)
+      g_slice_free1 (sizeof (GstVideoRectangle) *
+          framebuffersink->nu_screens_used,
+          framebuffersink->screen_video_rectangles);
+    framebuffersink->screen_video_rectangles = NULL;
+  }
 
   /* Free overlay buffers. */
   if (framebuffersink->overlays != NULL) {
@@ -2184,6 +3845,14 @@ gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
           framebuffersink->overlays);
   }
 
+  /* Free the staging blocks used in readback mode. */
+  for (i = 0; i < 3; i++)
+    if (framebuffersink->staging_memory[i] != NULL) {
+      gst_allocator_free (framebuffersink->staging_memory[i]->allocator,
+          framebuffersink->staging_memory[i]);
+      framebuffersink->staging_memory[i] = NULL;
+    }
+
   framebuffersink->current_framebuffer_index = 0;
   framebuffersink->nu_screens_used = 0;
   framebuffersink->screens = NULL;
@@ -2196,6 +3865,7 @@ gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
     gst_object_unref (framebuffersink->pool);
     framebuffersink->pool = NULL;
   }
+  gst_framebuffersink_retire_pools (framebuffersink, TRUE);
   GST_OBJECT_UNLOCK (framebuffersink);
 
   GST_VIDEO_SINK_WIDTH (framebuffersink) = 0;
@@ -2206,6 +3876,9 @@ gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
   }
 
   /* Reset variables derived from properties. */
+  GST_OBJECT_LOCK (framebuffersink);
+  gst_framebuffersink_clear_caps_cache (framebuffersink);
+  GST_OBJECT_UNLOCK (framebuffersink);
   framebuffersink->use_hardware_overlay =
       framebuffersink->use_hardware_overlay_property;
   framebuffersink->use_buffer_pool =
@@ -2218,6 +3891,14 @@ gst_framebuffersink_reset (GstFramebufferSink *framebuffersink)
     g_object_unref (framebuffersink->overlay_video_memory_allocator);
     framebuffersink->overlay_video_memory_allocator = NULL;
   }
+
+  /* Free the video memory cache. */
+  gst_framebuffersink_flush_video_memory_cache (framebuffersink, TRUE);
+  gst_framebuffersink_free_retiring_video_memory (framebuffersink);
+  if (framebuffersink->previous_overlay_video_memory_allocator) {
+    g_object_unref (framebuffersink->previous_overlay_video_memory_allocator);
+    framebuffersink->previous_overlay_video_memory_allocator = NULL;
+  }
 }
 
 /* The stop function should release resources. */
@@ -2242,11 +3923,52 @@ gst_framebuffersink_stop (GstBaseSink * sink)
       framebuffersink->stats_video_frames_video_memory +
       framebuffersink->stats_overlay_frames_video_memory);
   GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  if (framebuffersink->stats_video_memory_pools > 1 ||
+      framebuffersink->stats_system_memory_pools > 0) {
+    sprintf(s, "%d video memory pools provided, %d system memory pools "
+        "because video memory was exhausted",
+        framebuffersink->stats_video_memory_pools,
+        framebuffersink->stats_system_memory_pools);
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
+  if (g_atomic_int_get (&framebuffersink->stats_pool_buffers_released) > 0) {
+    sprintf(s, "%d unused buffer pool buffers released to video memory",
+        g_atomic_int_get (&framebuffersink->stats_pool_buffers_released));
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
+  if (framebuffersink->stats_video_memory_reused > 0) {
+    sprintf(s, "%d video memory blocks reused after renegotiation",
+        framebuffersink->stats_video_memory_reused);
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
+  if (framebuffersink->stats_readback_switches > 0) {
+    sprintf(s, "%d switches between video and system memory buffers because "
+        "of upstream reads", framebuffersink->stats_readback_switches);
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
+  if (framebuffersink->stats_second_fields > 0) {
+    sprintf(s, "%d second fields of interlaced frames shown",
+        framebuffersink->stats_second_fields);
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
+  if (framebuffersink->stats_caps_cache_hits > 0) {
+    sprintf(s, "%d caps queries answered from the caps cache",
+        framebuffersink->stats_caps_cache_hits);
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT(framebuffersink, s);
+  }
 
   gst_framebuffersink_reset (framebuffersink);
 
+  gst_framebuffersink_stop_upload_threads (framebuffersink);
+
   /* Free the screen allocator. */
   g_object_unref (framebuffersink->screen_video_memory_allocator);
+  /* Buffers still held upstream keep a reference to the staging
+     allocator. */
+  if (framebuffersink->staging_allocator) {
+    gst_object_unref (framebuffersink->staging_allocator);
+    framebuffersink->staging_allocator = NULL;
+  }
 
   klass->close_hardware (framebuffersink);
 
@@ -2257,6 +3979,137 @@ gst_framebuffersink_stop (GstBaseSink * sink)
   return TRUE;
 }
 
+/* Readback detection. Video memory is uncached or write-combined, so
+   upstream elements that read back their output buffers (decoders using
+   them as reference frames, in-place filters) run much slower on it than on
+   system memory. The map functions of the video memory allocators report
+   read mappings. When upstream reads at least half of the video memory
+   frames of a measurement interval, allocation is renegotiated to system
+   memory buffers, which are copied into rotating staging blocks in video
+   memory with a single sequential write per frame. After the probe interval
+   video memory is offered again; the probe interval doubles each time
+   upstream turns out to still read back, and is reset once it doesn't. */
+
+#define READBACK_INTERVAL (G_USEC_PER_SEC)
+#define READBACK_MIN_PROBE_INTERVAL (10 * G_USEC_PER_SEC)
+#define READBACK_MAX_PROBE_INTERVAL (320 * G_USEC_PER_SEC)
+
+void
+gst_framebuffersink_video_memory_read (GstFramebufferSink *framebuffersink)
+{
+  g_atomic_int_inc (&framebuffersink->video_memory_reads);
+}
+
+static int
+gst_framebuffersink_video_memory_frames (GstFramebufferSink *framebuffersink)
+{
+  return framebuffersink->stats_video_frames_video_memory +
+      framebuffersink->stats_overlay_frames_video_memory;
+}
+
+static void
+gst_framebuffersink_set_readback_mode (GstFramebufferSink *framebuffersink,
+    gboolean readback_mode)
+{
+  GST_OBJECT_LOCK (framebuffersink);
+  framebuffersink->readback_mode = readback_mode;
+  GST_OBJECT_UNLOCK (framebuffersink);
+  framebuffersink->stats_readback_switches++;
+
+  GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink, readback_mode ?
+      "Upstream reads back video memory, switching to system memory buffers" :
+      "Offering video memory buffers again");
+
+  /* Have upstream query the allocation again. */
+  gst_pad_push_event (GST_BASE_SINK_PAD (framebuffersink),
+      gst_event_new_reconfigure ());
+}
+
+/* Called for every frame in buffer-pool mode. */
+
+static void
+gst_framebuffersink_check_readback (GstFramebufferSink *framebuffersink)
+{
+  gint64 now = g_get_monotonic_time ();
+  int frames;
+  guint reads;
+
+  if (framebuffersink->readback_interval_start == 0) {
+    framebuffersink->readback_interval_start = now;
+    framebuffersink->readback_interval_first_frame =
+        gst_framebuffersink_video_memory_frames (framebuffersink);
+    g_atomic_int_set (&framebuffersink->video_memory_reads, 0);
+    return;
+  }
+  if (now - framebuffersink->readback_interval_start < READBACK_INTERVAL)
+    return;
+
+  frames = gst_framebuffersink_video_memory_frames (framebuffersink) -
+      framebuffersink->readback_interval_first_frame;
+  reads = g_atomic_int_and (&framebuffersink->video_memory_reads, 0);
+  GST_DEBUG_OBJECT (framebuffersink, "Readback: %u reads, %d video memory "
+      "frames", reads, frames);
+
+  if (framebuffersink->readback_mode) {
+    if (now >= framebuffersink->readback_mode_end)
+      gst_framebuffersink_set_readback_mode (framebuffersink, FALSE);
+  }
+  else if (reads > 0 && reads * 2 >= (guint) frames) {
+    framebuffersink->readback_probe_interval = CLAMP (
+        framebuffersink->readback_probe_interval * 2,
+        READBACK_MIN_PROBE_INTERVAL, READBACK_MAX_PROBE_INTERVAL);
+    framebuffersink->readback_mode_end = now +
+        framebuffersink->readback_probe_interval;
+    gst_framebuffersink_set_readback_mode (framebuffersink, TRUE);
+  }
+  else if (reads == 0 && frames > 0)
+    framebuffersink->readback_probe_interval = 0;
+
+  framebuffersink->readback_interval_start = now;
+  framebuffersink->readback_interval_first_frame =
+      gst_framebuffersink_video_memory_frames (framebuffersink);
+}
+
+/* Return the next staging block that system memory frames are copied into
+   in buffer-pool mode. With three blocks, the block returned is neither on
+   screen nor waiting for a flip. */
+
+static GstMemory *
+gst_framebuffersink_get_staging_memory (GstFramebufferSink *framebuffersink,
+    GstAllocator *allocator, gsize size)
+{
+  GstMemory **mem =
+      &framebuffersink->staging_memory[framebuffersink->staging_index];
+
+  if (*mem != NULL && ((*mem)->allocator != allocator ||
+      (*mem)->maxsize < size)) {
+    gst_allocator_free ((*mem)->allocator, *mem);
+    *mem = NULL;
+  }
+  if (*mem == NULL) {
+    *mem = gst_framebuffersink_alloc_video_memory (framebuffersink, allocator,
+        size);
+    if (*mem == NULL)
+      return NULL;
+  }
+  framebuffersink->staging_index = (framebuffersink->staging_index + 1) % 3;
+  return *mem;
+}
+
+static void
+gst_framebuffersink_put_image_staging (GstFramebufferSink *framebuffersink,
+    GstMemory *vmem, uint8_t *src, gsize size)
+{
+  GstMapInfo mapinfo;
+
+  if (!gst_memory_map (vmem, &mapinfo, GST_MAP_WRITE)) {
+    GST_ERROR_OBJECT (framebuffersink, "Could not map video memory");
+    return;
+  }
+  memcpy (mapinfo.data, src, size);
+  gst_memory_unmap (vmem, &mapinfo);
+}
+
 /* The show frame function can deal with both video memory buffers
    that require a pan and with regular buffers that need to be memcpy-ed.
    There are seperate show_frame functions for overlays (with a video memory
@@ -2267,8 +4120,6 @@ gst_framebuffersink_stop (GstBaseSink * sink)
 static GstFlowReturn
 gst_framebuffersink_show_frame_memcpy (GstFramebufferSink *framebuffersink,
     GstBuffer *buffer) {
-  GstFramebufferSinkClass *klass =
-      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
   GstMapInfo mapinfo;
   GstMemory *mem;
 
@@ -2281,16 +4132,16 @@ gst_framebuffersink_show_frame_memcpy (GstFramebufferSink *framebuffersink,
   }
   /* When not using page flipping, wait for vsync before copying. */
   if (framebuffersink->nu_screens_used == 1 && framebuffersink->vsync)
-    klass->wait_for_vsync (framebuffersink);
+    gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
   gst_framebuffersink_put_image_memcpy (framebuffersink, mapinfo.data);
   gst_memory_unmap(mem, &mapinfo);
 
   /* When using page flipping, wait for vsync after copying and then flip. */
   if (framebuffersink->nu_screens_used >= 2) {
     if (framebuffersink->vsync && !framebuffersink->pan_does_vsync)
-      klass->wait_for_vsync (framebuffersink);
-    klass->pan_display(framebuffersink, framebuffersink->screens[
-        framebuffersink->current_framebuffer_index]);
+      gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
+    gst_framebuffersink_hw_pan_display (framebuffersink,
+        framebuffersink->screens[framebuffersink->current_framebuffer_index]);
     framebuffersink->current_framebuffer_index++;
     if (framebuffersink->current_framebuffer_index >=
         framebuffersink->nu_screens_used)
@@ -2320,6 +4171,7 @@ gst_framebuffersink_show_frame_buffer_pool (
     GST_LOG_OBJECT (framebuffersink, "Video memory buffer encountered");
 
     gst_framebuffersink_put_image_pan(framebuffersink, mem);
+    gst_framebuffersink_hold_scanout_buffer (framebuffersink, buf);
 
     gst_memory_unref(mem);
 
@@ -2327,15 +4179,39 @@ gst_framebuffersink_show_frame_buffer_pool (
 
     return GST_FLOW_OK;
   } else {
-    /* This is a normal memory buffer (system memory). */
+    /* This is a normal memory buffer (system memory), provided in readback
+       mode or because video memory was exhausted. Pool buffers have the
+       layout of the screen, so copy it as a whole into a staging block and
+       pan to it. */
+    GstMemory *vmem;
+    GstMapInfo mapinfo;
 
     GST_LOG_OBJECT (framebuffersink, "Non-video memory buffer encountered");
 
+    vmem = gst_framebuffersink_get_staging_memory (framebuffersink,
+        framebuffersink->screen_video_memory_allocator,
+        GST_VIDEO_INFO_SIZE (&framebuffersink->video_info));
+    if (vmem == NULL) {
+      gst_memory_unref(mem);
+      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+          "Could not allocate video memory for system memory buffer, "
+          "ignoring");
+      return GST_FLOW_OK;
+    }
+    if (!gst_memory_map(mem, &mapinfo, GST_MAP_READ)) {
+      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+          "memory_map of system memory buffer for reading failed");
+      gst_memory_unref(mem);
+      return GST_FLOW_ERROR;
+    }
+    gst_framebuffersink_put_image_staging (framebuffersink, vmem,
+        mapinfo.data, MIN (mapinfo.size, vmem->size));
+    gst_memory_unmap(mem, &mapinfo);
     gst_memory_unref(mem);
 
-    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
-        "Unexpected system memory buffer provided in buffer-pool mode, "
-        "ignoring");
+    gst_framebuffersink_put_image_pan(framebuffersink, vmem);
+
+    framebuffersink->stats_video_frames_system_memory++;
 
     return GST_FLOW_OK;
   }
@@ -2350,17 +4226,42 @@ static GstFlowReturn
 gst_framebuffersink_show_frame_overlay (GstFramebufferSink * framebuffersink,
 GstBuffer * buf)
 {
-  GstFramebufferSinkClass *klass =
-      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstFramebufferSinkPhysicalAddressMeta *meta = NULL;
   GstMemory *mem;
   GstMapInfo mapinfo;
 
+  framebuffersink->shown_overlay_memory = NULL;
+  framebuffersink->shown_overlay_meta = NULL;
+
+  if (framebuffersink->use_physical_address_meta)
+    meta = gst_framebuffersink_buffer_get_physical_address_meta (buf);
+  if (meta != NULL) {
+    /* Foreign physically contiguous frame, shown without mapping it when its
+       layout matches the overlay. */
+    GST_LOG_OBJECT (framebuffersink,
+       "Physical address overlay buffer encountered, address = 0x%08lX",
+       (unsigned long) meta->physical_address[0]);
+
+    if (framebuffersink->vsync)
+      gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
+    if (gst_framebuffersink_hw_show_overlay_physical (framebuffersink, meta) ==
+        GST_FLOW_OK) {
+      gst_framebuffersink_hold_scanout_buffer (framebuffersink, buf);
+      framebuffersink->shown_overlay_meta = meta;
+      framebuffersink->stats_overlay_frames_video_memory++;
+      return GST_FLOW_OK;
+    }
+    GST_LOG_OBJECT (framebuffersink,
+       "Physical address layout doesn't match the overlay, copying");
+  }
+
   mem = gst_buffer_get_memory (buf, 0);
   if (!mem)
     goto invalid_memory;
 
-  if (gst_framebuffersink_is_video_memory (framebuffersink, mem) ||
-		GST_MEMORY_FLAG_IS_SET(mem, GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS)) {
+  if (meta == NULL &&
+      (gst_framebuffersink_is_video_memory (framebuffersink, mem) ||
+      GST_MEMORY_FLAG_IS_SET(mem, GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS))) {
 
     /* This a video memory buffer. */
 
@@ -2369,8 +4270,13 @@ GstBuffer * buf)
 
     /* Wait for vsync before changing the overlay address. */
     if (framebuffersink->vsync)
-      klass->wait_for_vsync(framebuffersink);
-    klass->show_overlay(framebuffersink, mem);
+      gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
+    if (gst_framebuffersink_hw_show_overlay (framebuffersink, mem) ==
+        GST_FLOW_OK) {
+      /* The held buffer keeps the memory alive for the second field. */
+      gst_framebuffersink_hold_scanout_buffer (framebuffersink, buf);
+      framebuffersink->shown_overlay_memory = mem;
+    }
 
     gst_memory_unref (mem);
 
@@ -2392,24 +4298,23 @@ GstBuffer * buf)
     }
 
     if (framebuffersink->use_buffer_pool) {
-      /* When using a buffer pool in video memory, being requested to show an
-         overlay frame from system memory (which shouldn't normally happen)
-         poses a bit of problem. We need to allocate a temporary video memory
-         area to store the overlay frame and show it. */
-      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
-          "Unexpected system memory overlay in buffer pool mode");
-
+      /* When using a buffer pool in video memory, system memory overlay
+         frames are provided in readback mode or when video memory was
+         exhausted. There are no overlay slots, so copy the frame into one of
+         the staging blocks. */
       GstMemory *vmem;
-      vmem = gst_allocator_alloc(
-          framebuffersink->overlay_video_memory_allocator, mapinfo.size, NULL);
+      vmem = gst_framebuffersink_get_staging_memory (framebuffersink,
+          framebuffersink->overlay_video_memory_allocator,
+          framebuffersink->overlay_size);
       if (vmem == NULL)
         GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
-            "Could not allocate temporary video memory buffer for overlay");
+            "Could not allocate staging video memory buffer for overlay");
       else {
+        /* Wait for vsync before changing the overlay address. */
+        if (framebuffersink->vsync)
+          gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
         gst_framebuffersink_put_overlay_image_memcpy (framebuffersink,
             vmem, mapinfo.data);
-        gst_allocator_free (framebuffersink->overlay_video_memory_allocator,
-            vmem);
       }
 
       goto end;
@@ -2440,20 +4345,323 @@ invalid_memory:
     return GST_FLOW_ERROR;
 }
 
+/* Wait until the second field of an interlaced frame is due, half a frame
+   duration after the first one, followed by vsync. Without timestamps or
+   synchronisation only vsync is waited for. Returns FALSE when the sink is
+   flushing and the second field should be skipped. */
+
+static gboolean
+gst_framebuffersink_wait_second_field (GstFramebufferSink *framebuffersink,
+    GstBuffer *buf)
+{
+  GstBaseSink *sink = GST_BASE_SINK (framebuffersink);
+  GstClockTime duration = GST_BUFFER_DURATION (buf);
+  GstClockTime running_time;
+
+  if (!GST_CLOCK_TIME_IS_VALID (duration) &&
+      GST_VIDEO_INFO_FPS_N (&framebuffersink->video_info) > 0)
+    duration = gst_util_uint64_scale_int (GST_SECOND,
+        GST_VIDEO_INFO_FPS_D (&framebuffersink->video_info),
+        GST_VIDEO_INFO_FPS_N (&framebuffersink->video_info));
+
+  if (gst_base_sink_get_sync (sink) && GST_BUFFER_PTS_IS_VALID (buf) &&
+      GST_CLOCK_TIME_IS_VALID (duration)) {
+    running_time = gst_segment_to_running_time (&sink->segment,
+        GST_FORMAT_TIME, GST_BUFFER_PTS (buf) + duration / 2);
+    if (GST_CLOCK_TIME_IS_VALID (running_time) &&
+        gst_base_sink_wait_clock (sink, running_time +
+        gst_base_sink_get_latency (sink) +
+        gst_base_sink_get_render_delay (sink), NULL) == GST_CLOCK_UNSCHEDULED)
+      return FALSE;
+  }
+
+  if (framebuffersink->vsync)
+    gst_framebuffersink_hw_wait_for_vsync (framebuffersink);
+  return TRUE;
+}
+
+/* Interlaced frames (all frames of interleaved video, flagged frames of mixed
+   video) are either handed to the subclass whole with their field order, to
+   be deinterlaced by the display engine, or shown one field at a time (bob).
+   Both fields are shown from the same overlay memory, the subclass selects a
+   field by doubling the line stride, so nothing is copied twice. */
+
+static GstFlowReturn
+gst_framebuffersink_show_frame_overlay_interlaced (GstFramebufferSink *
+    framebuffersink, GstBuffer *buf)
+{
+  GstFramebufferSinkField first, second;
+  GstFlowReturn res;
+
+  if (GST_VIDEO_INFO_INTERLACE_MODE (&framebuffersink->video_info) ==
+      GST_VIDEO_INTERLACE_MODE_MIXED &&
+      !GST_BUFFER_FLAG_IS_SET (buf, GST_VIDEO_BUFFER_FLAG_INTERLACED))
+    return gst_framebuffersink_show_frame_overlay (framebuffersink, buf);
+
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_VIDEO_BUFFER_FLAG_TFF)) {
+    first = GST_FRAMEBUFFERSINK_FIELD_TOP;
+    second = GST_FRAMEBUFFERSINK_FIELD_BOTTOM;
+  } else {
+    first = GST_FRAMEBUFFERSINK_FIELD_BOTTOM;
+    second = GST_FRAMEBUFFERSINK_FIELD_TOP;
+  }
+
+  if (framebuffersink->use_interlaced_scan && !framebuffersink->bob) {
+    framebuffersink->overlay_first_field = first;
+    res = gst_framebuffersink_show_frame_overlay (framebuffersink, buf);
+    framebuffersink->overlay_first_field = GST_FRAMEBUFFERSINK_FIELD_NONE;
+    return res;
+  }
+
+  framebuffersink->overlay_field = first;
+  res = gst_framebuffersink_show_frame_overlay (framebuffersink, buf);
+  if (res == GST_FLOW_OK && (framebuffersink->shown_overlay_memory != NULL ||
+      framebuffersink->shown_overlay_meta != NULL) &&
+      gst_framebuffersink_wait_second_field (framebuffersink, buf)) {
+    framebuffersink->overlay_field = second;
+    if (framebuffersink->shown_overlay_meta != NULL)
+      gst_framebuffersink_hw_show_overlay_physical (framebuffersink,
+          framebuffersink->shown_overlay_meta);
+    else
+      gst_framebuffersink_hw_show_overlay (framebuffersink,
+          framebuffersink->shown_overlay_memory);
+    framebuffersink->stats_second_fields++;
+  }
+  framebuffersink->overlay_field = GST_FRAMEBUFFERSINK_FIELD_NONE;
+  return res;
+}
+
+/* Hand the overlay composition attached to the buffer to the subclass when it
+   differs from the one currently shown. */
+
+static void
+gst_framebuffersink_show_overlay_composition (
+    GstFramebufferSink *framebuffersink, GstBuffer *buf)
+{
+  GstFramebufferSinkClass *klass =
+      GST_FRAMEBUFFERSINK_GET_CLASS (framebuffersink);
+  GstVideoOverlayCompositionMeta *meta;
+  GstVideoOverlayComposition *composition = NULL;
+  guint seqnum = 0;
+
+  meta = gst_buffer_get_video_overlay_composition_meta (buf);
+  if (meta != NULL &&
+      gst_video_overlay_composition_n_rectangles (meta->overlay) > 0) {
+    composition = meta->overlay;
+    seqnum = gst_video_overlay_composition_get_seqnum (composition);
+  }
+  if (seqnum == framebuffersink->overlay_composition_seqnum)
+    return;
+
+  if (klass->show_overlay_composition (framebuffersink, composition))
+    framebuffersink->overlay_composition_seqnum = seqnum;
+  else
+    GST_WARNING_OBJECT (framebuffersink, "Could not show overlay composition");
+}
+
+/* Apply a window position or size that was changed while playing. Only the
+   video rectangle changes: hardware overlays are shown at the new position
+   with the next frame, and in memcpy mode only the copy destination moves.
+   Without a scaler, only the position can change. */
+
+static void
+gst_framebuffersink_update_video_rectangle (GstFramebufferSink *
+    framebuffersink)
+{
+  GstVideoRectangle previous_video_rectangle;
+  int previous_width_in_bytes;
+
+  GST_OBJECT_LOCK (framebuffersink);
+  framebuffersink->video_rectangle_changed = FALSE;
+
+  if (framebuffersink->use_buffer_pool &&
+      !framebuffersink->use_hardware_overlay) {
+    GST_OBJECT_UNLOCK (framebuffersink);
+    /* Upstream renders into the screen buffers at a fixed position. */
+    GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+        "Cannot move the video window in screen buffer-pool mode; the new "
+        "window will be used after renegotiation");
+    return;
+  }
+
+  previous_video_rectangle = framebuffersink->video_rectangle;
+  previous_width_in_bytes = framebuffersink->video_rectangle_width_in_bytes;
+  gst_framebuffersink_calculate_video_rectangle (framebuffersink,
+      &framebuffersink->video_info, framebuffersink->use_hardware_overlay);
+  if (framebuffersink->video_rectangle_width_in_bytes <= 0 ||
+      framebuffersink->video_rectangle.h <= 0) {
+    framebuffersink->video_rectangle = previous_video_rectangle;
+    framebuffersink->video_rectangle_width_in_bytes = previous_width_in_bytes;
+    GST_OBJECT_UNLOCK (framebuffersink);
+    GST_WARNING_OBJECT (framebuffersink, "Ignoring empty video window");
+    return;
+  }
+  GST_OBJECT_UNLOCK (framebuffersink);
+
+  /* Show the overlay composition again at the new window. */
+  framebuffersink->overlay_composition_seqnum = 0;
+}
+
+/* Frame checksums, for verifying the display path without a camera. The
+   CRC-32C covers what was handed to the display for the frame: the video
+   window in the screen buffer or video memory that was panned to, or the
+   planes of the overlay as laid out in video memory. */
+
+/* Rows that would extend past the mapped memory are left out. */
+
+static guint32
+gst_framebuffersink_checksum_rows (guint32 crc, const GstMapInfo *mapinfo,
+    gsize offset, gsize stride, gsize width_in_bytes, int rows)
+{
+  int i;
+
+  for (i = 0; i < rows; i++) {
+    if (offset + i * stride + width_in_bytes > mapinfo->size)
+      break;
+    crc = gst_framebuffersink_kernels->crc32c (crc,
+        mapinfo->data + offset + i * stride, width_in_bytes);
+  }
+  return crc;
+}
+
+static gboolean
+gst_framebuffersink_is_screen_memory (GstFramebufferSink *framebuffersink,
+    GstMemory *memory)
+{
+  int i;
+
+  if (framebuffersink->screens == NULL)
+    return FALSE;
+  for (i = 0; i < framebuffersink->nu_screens_used; i++)
+    if (framebuffersink->screens[i] == memory)
+      return TRUE;
+  return FALSE;
+}
+
+static void
+gst_framebuffersink_post_frame_checksum (GstFramebufferSink *framebuffersink,
+    GstBuffer *buf)
+{
+  GstVideoInfo *info = &framebuffersink->video_info;
+  GstMemory *memory;
+  GstMapInfo mapinfo;
+  GstStructure *structure;
+  guint32 crc = 0;
+  gsize stride, offset;
+  int i, n, width_in_bytes;
+
+  if (framebuffersink->use_hardware_overlay)
+    memory = framebuffersink->shown_overlay_memory;
+  else if (framebuffersink->presented_memory != NULL)
+    memory = framebuffersink->presented_memory;
+  else if (framebuffersink->screens != NULL)
+    memory = framebuffersink->screens[
+        framebuffersink->current_framebuffer_index];
+  else
+    memory = NULL;
+  /* Frames scanned out through their physical address alone cannot be
+     read. */
+  if (memory == NULL)
+    return;
+
+  /* No map flags, so that readback detection doesn't count this. */
+  if (!gst_memory_map (memory, &mapinfo, 0)) {
+    GST_WARNING_OBJECT (framebuffersink,
+        "Could not map video memory for the frame checksum");
+    return;
+  }
+
+  if (framebuffersink->use_hardware_overlay) {
+    n = GST_VIDEO_INFO_N_PLANES (info);
+    if (framebuffersink->overlay_convert_to_nv12)
+      n = 2;
+    for (i = 0; i < n; i++) {
+      int comp = 0;
+      while (GST_VIDEO_INFO_COMP_PLANE (info, comp) != i)
+        comp++;
+      width_in_bytes = framebuffersink->source_video_width_in_bytes[i];
+      if (framebuffersink->overlay_narrow_shift > 0)
+        width_in_bytes /= 2;
+      if (framebuffersink->overlay_convert_to_nv12 && i == 1)
+        width_in_bytes *= 2;
+      crc = gst_framebuffersink_checksum_rows (crc, &mapinfo,
+          framebuffersink->overlay_plane_offset[i] +
+          framebuffersink->overlay_scanline_offset[i],
+          framebuffersink->overlay_scanline_stride[i], width_in_bytes,
+          GST_VIDEO_INFO_COMP_HEIGHT (info, comp));
+    }
+  } else {
+    stride = GST_VIDEO_INFO_COMP_STRIDE (&framebuffersink->screen_info, 0);
+    /* Screen buffers hold the video at its window position; pool buffers
+       and staging blocks hold it at the start, and are panned to directly.
+       */
+    offset = 0;
+    if (gst_framebuffersink_is_screen_memory (framebuffersink, memory))
+      offset = framebuffersink->video_rectangle.y * stride +
+          framebuffersink->video_rectangle.x * GST_VIDEO_INFO_COMP_PSTRIDE (
+          &framebuffersink->screen_info, 0);
+    crc = gst_framebuffersink_checksum_rows (crc, &mapinfo, offset, stride,
+        framebuffersink->video_rectangle_width_in_bytes,
+        framebuffersink->video_rectangle.h);
+  }
+  gst_memory_unmap (memory, &mapinfo);
+
+  structure = gst_structure_new ("framebuffersink-frame-checksum",
+      "timestamp", G_TYPE_UINT64, GST_BUFFER_PTS (buf),
+      "crc32c", G_TYPE_UINT, crc,
+      "source", G_TYPE_STRING,
+      framebuffersink->use_hardware_overlay ? "overlay" : "framebuffer",
+      NULL);
+  gst_element_post_message (GST_ELEMENT (framebuffersink),
+      gst_message_new_element (GST_OBJECT (framebuffersink), structure));
+}
+
 static GstFlowReturn
 gst_framebuffersink_show_frame (GstVideoSink * vsink, GstBuffer * buf)
 {
   GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (vsink);
   GstFlowReturn res;
+  guint presented;
+
+  if (G_UNLIKELY (framebuffersink->video_rectangle_changed))
+    gst_framebuffersink_update_video_rectangle (framebuffersink);
+
+  framebuffersink->presented_memory = NULL;
+  presented = framebuffersink->retiring_video_memory_presented;
+
+  if (framebuffersink->use_overlay_composition)
+    gst_framebuffersink_show_overlay_composition (framebuffersink, buf);
 
   if (framebuffersink->use_hardware_overlay) {
-    res = gst_framebuffersink_show_frame_overlay(framebuffersink, buf);
+    if (framebuffersink->overlay_interlaced)
+      res = gst_framebuffersink_show_frame_overlay_interlaced (framebuffersink,
+          buf);
+    else
+      res = gst_framebuffersink_show_frame_overlay(framebuffersink, buf);
 	}
   else if (framebuffersink->use_buffer_pool){
     res = gst_framebuffersink_show_frame_buffer_pool(framebuffersink, buf);
   } else {
     res = gst_framebuffersink_show_frame_memcpy(framebuffersink, buf);
 	}
+
+  if (res == GST_FLOW_OK)
+    framebuffersink->retiring_video_memory_presented++;
+
+  if (framebuffersink->frame_checksum && res == GST_FLOW_OK)
+    gst_framebuffersink_post_frame_checksum (framebuffersink, buf);
+
+  if (framebuffersink->use_buffer_pool)
+    gst_framebuffersink_check_readback (framebuffersink);
+
+  /* The display has moved off the video memory of the previous
+     configuration once a frame of the new one presented by an earlier call
+     is replaced, which means the flip to it has completed. */
+  if (G_UNLIKELY (framebuffersink->retiring_video_memory != NULL &&
+      presented > 0 &&
+      framebuffersink->retiring_video_memory_presented > presented))
+    gst_framebuffersink_free_retiring_video_memory (framebuffersink);
+
   return res;
 }
 
@@ -2466,22 +4674,17 @@ gst_framebuffersink_set_buffer_pool_query_answer (
     GstAllocator *allocator;
     GstAllocationParams params;
     gsize size;
-    int n;
+    guint min_buffers, max_buffers;
 
     GST_INFO_OBJECT (framebuffersink, "Providing video memory buffer pool");
 
     size = info->size;
-    n = framebuffersink->nu_screens_used;
-    if (framebuffersink->use_hardware_overlay)
-      n = framebuffersink->nu_overlays_used;
+    gst_framebuffersink_get_pool_buffer_range (framebuffersink, &min_buffers,
+        &max_buffers);
 
     config = gst_buffer_pool_get_config (pool);
-#ifdef HALF_POOLS
-    gst_buffer_pool_config_set_params (config, caps, size, n / 2, n / 2);
-#else
-    gst_buffer_pool_config_set_params (config, caps, size, n, n);
-
-#endif
+    gst_buffer_pool_config_set_params (config, caps, size, min_buffers,
+        max_buffers);
     if (!gst_buffer_pool_set_config (pool, config))
       return FALSE;
 
@@ -2490,14 +4693,12 @@ gst_framebuffersink_set_buffer_pool_query_answer (
     gst_buffer_pool_config_get_allocator (config, &allocator, &params);
     gst_query_add_allocation_param (query, allocator, NULL);
 
-#ifdef HALF_POOLS
-    n /= 2;
-#endif
-    gst_query_add_allocation_pool (query, pool, size, n, n);
+    gst_query_add_allocation_pool (query, pool, size, min_buffers,
+        max_buffers);
 
     GST_INFO_OBJECT (framebuffersink,
-        "propose_allocation: size = %.2lf MB, %d buffers",
-        (double) size / (1024 * 1024), n);
+        "propose_allocation: size = %.2lf MB, %d to %d buffers",
+        (double) size / (1024 * 1024), min_buffers, max_buffers);
 
     GST_INFO_OBJECT (framebuffersink,
         "propose_allocation: provide our video memory buffer pool");
@@ -2533,9 +4734,28 @@ gst_framebuffersink_propose_allocation (GstBaseSink * bsink, GstQuery * query)
 
   GST_OBJECT_LOCK (framebuffersink);
 
+  /* Overlay compositions are shown without blending them into the video
+     frames when the subclass supports it. */
+  if (framebuffersink->use_overlay_composition)
+    gst_query_add_allocation_meta (query,
+        GST_VIDEO_OVERLAY_COMPOSITION_META_API_TYPE, NULL);
+  /* Foreign physically contiguous frames can be shown without copying. */
+  if (framebuffersink->use_physical_address_meta)
+    gst_query_add_allocation_meta (query,
+        GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_API_TYPE, NULL);
+
   /* Take a look at our pre-initialized pool in video memory. */
   pool = framebuffersink->pool ? gst_object_ref (framebuffersink->pool) : NULL;
 
+  /* Upstream reads back its output; provide system memory until video
+     memory is tried again. */
+  if (framebuffersink->readback_mode && pool != NULL) {
+    GST_INFO_OBJECT (framebuffersink,
+        "propose_allocation: readback mode, not providing video memory");
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
   /* If we had a buffer pool in video memory and it has been allocated,
      we can't easily provide regular system memory buffers because
      due to the difficulty of handling page flips correctly. However,
@@ -2567,17 +4787,31 @@ gst_framebuffersink_propose_allocation (GstBaseSink * bsink, GstQuery * query)
     framebuffersink->pool = NULL;
   }
 
-#ifdef MULTIPLE_VIDEO_MEMORY_POOLS
-  if (framebuffersink->use_buffer_pool && pool == NULL && need_pool) {
-    /* Try to provide (another) pool from video memory. */
-
-    pool = gst_framebuffersink_allocate_buffer_pool (framebuffersink, caps,
-        &info);
-    if (!pool)
-      return FALSE;
-    pool = gst_object_ref (pool);
+  if (framebuffersink->multiple_pools && framebuffersink->use_buffer_pool &&
+      !framebuffersink->readback_mode && pool == NULL && need_pool) {
+    /* Try to provide (another) pool from video memory, unless the pools
+       already provided use up the video memory after the screen. */
+    guint min_buffers, max_buffers;
+    gsize available;
+
+    gst_framebuffersink_retire_pools (framebuffersink, FALSE);
+    gst_framebuffersink_get_pool_buffer_range (framebuffersink, &min_buffers,
+        &max_buffers);
+    available = 0;
+    if (framebuffersink->video_memory_size >
+        GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info))
+      available = framebuffersink->video_memory_size -
+          GST_VIDEO_INFO_SIZE (&framebuffersink->screen_info);
+    if (gst_framebuffersink_pools_video_memory_used (framebuffersink) +
+        (gsize) min_buffers * info.size <= available)
+      pool = gst_framebuffersink_allocate_buffer_pool (framebuffersink, caps,
+          &info);
+    if (pool == NULL) {
+      framebuffersink->stats_system_memory_pools++;
+      GST_FRAMEBUFFERSINK_MESSAGE_OBJECT (framebuffersink,
+          "Video memory exhausted, providing a system memory pool");
+    }
   }
-#endif
 
   /* At this point if pool is not NULL we have a video memory pool */
   /* to provide. */
@@ -2591,12 +4825,17 @@ gst_framebuffersink_propose_allocation (GstBaseSink * bsink, GstQuery * query)
   }
 
   if (!need_pool) {
+    /* Upstream uses its own buffers, for example a decoder with physically
+       contiguous frames. Ask for room for the buffers held for scanout. */
+    gst_query_add_allocation_pool (query, NULL, info.size,
+        SCANOUT_HELD_BUFFERS, 0);
     GST_OBJECT_UNLOCK (framebuffersink);
-    return FALSE;
+    return TRUE;
   }
   else {
     /* Provide a regular system memory buffer pool. */
     GstAllocator *allocator;
+    GstAllocationParams params;
     int n;
 
     n = gst_query_get_n_allocation_pools (query);
@@ -2607,18 +4846,25 @@ gst_framebuffersink_propose_allocation (GstBaseSink * bsink, GstQuery * query)
     GST_INFO_OBJECT (framebuffersink, "create new system memory pool");
     pool = gst_buffer_pool_new ();
 
-    allocator = gst_allocator_find (GST_ALLOCATOR_SYSMEM);
+    if (framebuffersink->staging_allocator == NULL)
+      framebuffersink->staging_allocator =
+          gst_framebuffersink_staging_allocator_new (framebuffersink);
+    allocator = gst_object_ref (framebuffersink->staging_allocator);
+    gst_allocation_params_init (&params);
+    params.align = STAGING_ALIGN;
 
     config = gst_buffer_pool_get_config (pool);
-    gst_buffer_pool_config_set_params (config, caps, info.size, 2, 0);
-    gst_buffer_pool_config_set_allocator (config, allocator, NULL);
+    gst_buffer_pool_config_set_params (config, caps, info.size,
+        SYSTEM_MEMORY_POOL_MIN_BUFFERS, 0);
+    gst_buffer_pool_config_set_allocator (config, allocator, &params);
     if (!gst_buffer_pool_set_config (pool, config)) {
       gst_object_unref (allocator);
       goto config_failed;
     }
 
-    gst_query_add_allocation_param (query, allocator, NULL);
-    gst_query_add_allocation_pool (query, pool, info.size, 2, 0);
+    gst_query_add_allocation_param (query, allocator, &params);
+    gst_query_add_allocation_pool (query, pool, info.size,
+        SYSTEM_MEMORY_POOL_MIN_BUFFERS, 0);
     gst_object_unref (allocator);
     gst_object_unref (pool);
   }
@@ -2699,6 +4945,45 @@ gst_framebuffersink_is_video_memory (GstFramebufferSink *framebuffersink,
   return GST_MEMORY_FLAG_IS_SET(mem, GST_MEMORY_FLAG_VIDEO_MEMORY);
 }
 
+/* GstVideoOverlay interface. Only the render rectangle is implemented; it is
+   equivalent to setting the x, y, width and height properties. A width and
+   height of -1 restore the default window. */
+
+static void
+gst_framebuffersink_video_overlay_set_render_rectangle (GstVideoOverlay *
+    overlay, gint x, gint y, gint width, gint height)
+{
+  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (overlay);
+
+  GST_DEBUG_OBJECT (framebuffersink, "set_render_rectangle (%d, %d, %d, %d)",
+      x, y, width, height);
+
+  GST_OBJECT_LOCK (framebuffersink);
+  if (width == -1 && height == -1) {
+    framebuffersink->requested_video_x = -1;
+    framebuffersink->requested_video_y = -1;
+    framebuffersink->requested_video_width = 0;
+    framebuffersink->requested_video_height = 0;
+  }
+  else {
+    framebuffersink->requested_video_x = MAX (x, 0);
+    framebuffersink->requested_video_y = MAX (y, 0);
+    framebuffersink->requested_video_width = MAX (width, 0);
+    framebuffersink->requested_video_height = MAX (height, 0);
+  }
+  framebuffersink->video_rectangle_changed = TRUE;
+  /* The preferred caps follow the requested window. */
+  gst_framebuffersink_clear_caps_cache (framebuffersink);
+  GST_OBJECT_UNLOCK (framebuffersink);
+}
+
+static void
+gst_framebuffersink_video_overlay_init (GstVideoOverlayInterface *iface)
+{
+  iface->set_render_rectangle =
+      gst_framebuffersink_video_overlay_set_render_rectangle;
+}
+
 GType
 gst_framebuffersink_get_type (void)
 {
@@ -2717,8 +5002,16 @@ gst_framebuffersink_get_type (void)
       (GInstanceInitFunc) gst_framebuffersink_init,
     };
 
+    static const GInterfaceInfo video_overlay_info = {
+      (GInterfaceInitFunc) gst_framebuffersink_video_overlay_init,
+      NULL,
+      NULL,
+    };
+
     framebuffersink_type = g_type_register_static( GST_TYPE_VIDEO_SINK,
         "GstFramebufferSink", &framebuffersink_info, 0);
+    g_type_add_interface_static (framebuffersink_type, GST_TYPE_VIDEO_OVERLAY,
+        &video_overlay_info);
   }
 
   return framebuffersink_type;
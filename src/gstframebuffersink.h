@@ -24,6 +24,7 @@
 #include <linux/fb.h>
 #include <gst/video/gstvideosink.h>
 #include <gst/video/video.h>
+#include "gstframebuffersinkmeta.h"
 
 G_BEGIN_DECLS
 
@@ -41,6 +42,13 @@ struct _GstFramebufferSinkOverlayVideoAlignment {
   guint stride_align[GST_VIDEO_MAX_PLANES];
 };
 
+/* Field of an interlaced frame. */
+typedef enum {
+  GST_FRAMEBUFFERSINK_FIELD_NONE,
+  GST_FRAMEBUFFERSINK_FIELD_TOP,
+  GST_FRAMEBUFFERSINK_FIELD_BOTTOM
+} GstFramebufferSinkField;
+
 /* Main class. */
 
 #define GST_TYPE_FRAMEBUFFERSINK (gst_framebuffersink_get_type())
@@ -82,12 +90,29 @@ struct _GstFramebufferSink
   gint rotate_angle_property;
   gchar *preferred_overlay_format_str;
   gboolean benchmark;
+  gboolean adaptive_pool;
+  gint min_pool_buffers;
+  gboolean multiple_pools;
+  gboolean match_refresh_rate;
+  gboolean staging_hugepages;
+  gint upload_threads_property;
+  gboolean bob;
+  gboolean frame_checksum;
 
   /* Variables (derived from properties) that may be altered when
      the element starts processing a stream. */
   gboolean use_hardware_overlay;
   gboolean use_buffer_pool;
   gboolean vsync;
+  /* Set by the subclass in open_hardware when it implements
+     show_overlay_composition. */
+  gboolean use_overlay_composition;
+  /* Set by the subclass in open_hardware when it implements
+     show_overlay_physical. */
+  gboolean use_physical_address_meta;
+  /* Set by the subclass in open_hardware when the overlay layer can
+     deinterlace, i.e. it honours overlay_first_field. */
+  gboolean use_interlaced_scan;
 
   /* Invariant device parameters. */
   GstVideoInfo screen_info;
@@ -104,10 +129,20 @@ struct _GstFramebufferSink
   GstAllocationParams *screen_allocation_params;
   int nu_screens_used;
   GstMemory **screens;
+  /* Video rectangle each screen buffer was last drawn with (memcpy mode). */
+  GstVideoRectangle *screen_video_rectangles;
   GstAllocator *overlay_video_memory_allocator;
   GstAllocationParams *overlay_allocation_params;
   int nu_overlays_used;
   GstMemory **overlays;
+  /* Video memory of earlier configurations kept for reuse after
+     renegotiation, and the blocks among them that were on screen when the
+     caps changed. */
+  GList *cached_video_memory;
+  GList *retiring_video_memory;
+  /* Frames of the new configuration presented since the caps changed. */
+  guint retiring_video_memory_presented;
+  GstAllocator *previous_overlay_video_memory_allocator;
 
   /* Video information. */
   GstVideoInfo video_info;
@@ -117,6 +152,8 @@ struct _GstFramebufferSink
   GstVideoRectangle video_rectangle;
   /* Precalculated video rectangle width * framebuffer bytes per pixel. */
   int video_rectangle_width_in_bytes;
+  /* Set when the window was changed while playing. */
+  gboolean video_rectangle_changed;
 
   /* Overlay alignment restriction in video memory. */
   gint overlay_align;
@@ -128,15 +165,79 @@ struct _GstFramebufferSink
   /* Whether the video format provided by GStreamer matches the native */
   /* alignment requirements. */
   gboolean overlay_alignment_is_native;
+  /* I420 video shown on an NV12 overlay; the chroma planes are interleaved
+     while uploading. */
+  gboolean overlay_convert_to_nv12;
+  /* 10-bit video shown on an 8-bit overlay; the samples are shifted right by
+     this amount while uploading. 0 otherwise. */
+  int overlay_narrow_shift;
+  /* The negotiated video is interlaced or mixed. */
+  gboolean overlay_interlaced;
+  /* Read by show_overlay and show_overlay_physical. When overlay_field is
+     set, only that field of the frame is shown (every second line, stretched
+     to the full height). Otherwise, when overlay_first_field is set, the
+     frame is interlaced and is shown deinterlaced with that field first. */
+  GstFramebufferSinkField overlay_first_field;
+  GstFramebufferSinkField overlay_field;
+  /* Overlay memory or physical address meta of the frame last shown, so that
+     the second field can be shown from the same frame. */
+  GstMemory *shown_overlay_memory;
+  GstFramebufferSinkPhysicalAddressMeta *shown_overlay_meta;
+  /* Worker threads for overlay upload, NULL when uploading on the streaming
+     thread only. */
+  GThreadPool *upload_pool;
+  int upload_stripes;
+  GMutex upload_lock;
+  GCond upload_cond;
+  int uploads_pending;
 
   GstBufferPool *pool;
   GstCaps *caps;
+  /* Cached get_caps results, see gstframebuffersink.c. */
+  GstCaps *default_caps_cache;
+  GList *caps_cache;
+  /* Video memory pools provided upstream that are still alive. */
+  GList *video_memory_pools;
+  /* Allocator of the system memory pools. */
+  GstAllocator *staging_allocator;
+  /* Buffers the display may still be reading from: the last one shown and
+     the one shown before it, which stays on screen until the flip to the
+     last one completes. */
+  GstBuffer *scanout_buffers[2];
+  /* Readback detection. Read mappings of video memory reported by the
+     subclass allocators since the start of the measurement interval. In
+     readback mode upstream gets system memory buffers, which are copied into
+     the rotating staging blocks in video memory. */
+  volatile guint video_memory_reads;
+  int readback_interval_first_frame;
+  gint64 readback_interval_start;
+  gboolean readback_mode;
+  gint64 readback_mode_end;
+  gint64 readback_probe_interval;
+  GstMemory *staging_memory[3];
+  int staging_index;
 
   /* Stats. */
   int stats_video_frames_video_memory;
   int stats_video_frames_system_memory;
   int stats_overlay_frames_video_memory;
   int stats_overlay_frames_system_memory;
+  int stats_video_memory_reused;
+  /* Updated atomically from upstream threads by the buffer pool. */
+  gint stats_pool_buffers_released;
+  int stats_video_memory_pools;
+  int stats_system_memory_pools;
+  int stats_readback_switches;
+  int stats_second_fields;
+  int stats_caps_cache_hits;
+
+  /* Screen buffer or video memory the display was last panned to, for the
+     frame checksum. Only valid during show_frame. */
+  GstMemory *presented_memory;
+
+  /* Sequence number of the overlay composition currently shown, 0 if
+     none. */
+  guint overlay_composition_seqnum;
 
   gint requested_video_x;
   gint requested_video_y;
@@ -156,6 +257,17 @@ struct _GstFramebufferSinkClass
   void (*close_hardware) (GstFramebufferSink *framebuffersink);
   void (*pan_display) (GstFramebufferSink *framebuffersink, GstMemory *vmem);
   void (*wait_for_vsync) (GstFramebufferSink *framebuffersink);
+  /* Return FALSE if the last pan_display or show_overlay call did not queue
+     the frame for scanout (for example because a flip was still pending), in
+     which case the display keeps reading from the buffers it was using
+     before. */
+  gboolean (*frame_queued_for_scanout) (GstFramebufferSink *framebuffersink);
+  /* Switch to the display mode with the current resolution whose refresh
+     rate best matches the frame rate described by info. Only called when
+     the match-refresh-rate property is set. The original mode should be
+     restored by close_hardware. */
+  void (*match_display_mode) (GstFramebufferSink *framebuffersink,
+      GstVideoInfo *info);
   GstVideoFormat * (*get_supported_overlay_formats) (
       GstFramebufferSink *framebuffersink);
   /* Return the video alignment (top/bottom/left/right padding and stride
@@ -172,16 +284,35 @@ struct _GstFramebufferSinkClass
       GstVideoFormat format);
   GstFlowReturn (*show_overlay) (GstFramebufferSink *framebuffersink,
       GstMemory *memory);
+  /* Show an overlay frame in foreign physically contiguous memory described
+     by meta, without mapping it. Should return GST_FLOW_NOT_SUPPORTED when
+     the plane layout doesn't match the overlay, in which case the frame is
+     copied instead. Only called when the subclass has set
+     use_physical_address_meta. */
+  GstFlowReturn (*show_overlay_physical) (GstFramebufferSink *framebuffersink,
+      GstFramebufferSinkPhysicalAddressMeta *meta);
   GstAllocator * (*video_memory_allocator_new) (
       GstFramebufferSink *framebuffersink, GstVideoInfo *info,
       gboolean pannable, gboolean is_overlay);
+  /* Return TRUE if an overlay allocator created by video_memory_allocator_new
+     for an earlier configuration, and the memory allocated from it, can be
+     used for overlays described by info. */
+  gboolean (*video_memory_allocator_is_reusable) (
+      GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+      GstVideoInfo *info);
+  /* Show the rectangles of an overlay composition (subtitles, OSD) on top of
+     the video without touching the video frame, or hide them when
+     composition is NULL. Only called when the subclass has set
+     use_overlay_composition, and only when the composition changes. */
+  gboolean (*show_overlay_composition) (GstFramebufferSink *framebuffersink,
+      GstVideoOverlayComposition *composition);
 };
 
 GType gst_framebuffersink_get_type (void);
 
 #define GST_MEMORY_FLAG_VIDEO_MEMORY GST_MEMORY_FLAG_LAST
 
-/* Utility function. */
+/* Utility functions. */
 
 void gst_framebuffersink_set_overlay_video_alignment_from_scanline_alignment (
     GstFramebufferSink *framebuffersink, GstVideoInfo *video_info,
@@ -189,6 +320,27 @@ void gst_framebuffersink_set_overlay_video_alignment_from_scanline_alignment (
     GstFramebufferSinkOverlayVideoAlignment *video_alignment,
     gboolean *video_alignment_matches);
 
+/* To be called by the map function of a video memory allocator when memory
+   is mapped read-only (GST_MAP_READ without GST_MAP_WRITE). Maps that also
+   write are taken for producers writing a frame, and the sink's own maps of
+   video memory pass no flags, so neither is counted as a readback. */
+void gst_framebuffersink_video_memory_read (GstFramebufferSink *
+    framebuffersink);
+
+/* Drop the results cached by get_caps. To be called with the object lock
+   held by subclasses when a property that affects the caps changes. */
+void gst_framebuffersink_clear_caps_cache (GstFramebufferSink *
+    framebuffersink);
+
+/* Trace points around a hardware interaction (an ioctl, page flip or blit)
+   named name, for profiling the display path without debug logging. Pass
+   the value returned by gst_framebuffersink_trace_begin to
+   gst_framebuffersink_trace_end. */
+GstClockTime gst_framebuffersink_trace_begin (GstFramebufferSink *
+    framebuffersink, const char *name);
+void gst_framebuffersink_trace_end (GstFramebufferSink *framebuffersink,
+    const char *name, GstClockTime begin);
+
 G_END_DECLS
 
 #endif
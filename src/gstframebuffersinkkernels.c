@@ -0,0 +1,501 @@
+/* GStreamer GstFramebufferSink pixel kernels
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Each implementation is compiled when the compiler can generate it, and is
+   selected at run time when the CPU supports it: NEON when the plugin is
+   built for a NEON capable ARM target and the kernel reports NEON (always on
+   AArch64), SSE2 when building for x86 with SSE2, and AVX2 on x86 with GCC or
+   clang when the CPU has it. The selected implementation is checked against
+   the scalar one before it is used. Copies and fills go through the C
+   library, which already picks the widest instructions at run time. The
+   checksum uses the CRC-32C instructions of SSE4.2 (with AVX2) and of ARMv8
+   when the target has them. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__arm__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+#if defined(__SSE2__)
+#define HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+#include <gst/gst.h>
+#include "gstframebuffersinkkernels.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_framebuffersink_kernels_debug_category);
+#define GST_CAT_DEFAULT gst_framebuffersink_kernels_debug_category
+
+/* Scalar reference implementations. */
+
+static void
+gst_framebuffersink_copy_libc (guint8 *dest, const guint8 *src, gsize size)
+{
+  memcpy (dest, src, size);
+}
+
+static void
+gst_framebuffersink_clear_libc (guint8 *dest, gsize size)
+{
+  memset (dest, 0, size);
+}
+
+static void
+gst_framebuffersink_interleave_row_scalar (guint8 *dest, const guint8 *u,
+    const guint8 *v, int width)
+{
+  int i;
+
+  for (i = 0; i < width; i++) {
+    dest[2 * i] = u[i];
+    dest[2 * i + 1] = v[i];
+  }
+}
+
+static void
+gst_framebuffersink_narrow_row_scalar (guint8 *dest, const guint8 *src,
+    int width, int shift)
+{
+  int i;
+
+  for (i = 0; i < width; i++)
+    dest[i] = MIN ((src[2 * i] | (src[2 * i + 1] << 8)) >> shift, 255);
+}
+
+/* Reflected CRC-32C (Castagnoli) table, filled in by
+   gst_framebuffersink_kernels_init. */
+static guint32 crc32c_table[256];
+
+static void
+gst_framebuffersink_crc32c_init_table (void)
+{
+  guint32 crc;
+  int i, bit;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+    crc32c_table[i] = crc;
+  }
+}
+
+static guint32
+gst_framebuffersink_crc32c_scalar (guint32 crc, const guint8 *data,
+    gsize size)
+{
+  gsize i;
+
+  crc = ~crc;
+  for (i = 0; i < size; i++)
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xFF];
+  return ~crc;
+}
+
+static const GstFramebufferSinkKernels kernels_scalar = {
+  "scalar",
+  gst_framebuffersink_copy_libc,
+  gst_framebuffersink_clear_libc,
+  gst_framebuffersink_interleave_row_scalar,
+  gst_framebuffersink_narrow_row_scalar,
+  gst_framebuffersink_crc32c_scalar
+};
+
+#ifdef HAVE_NEON_KERNELS
+
+static void
+gst_framebuffersink_interleave_row_neon (guint8 *dest, const guint8 *u,
+    const guint8 *v, int width)
+{
+  int i = 0;
+
+  for (; i + 16 <= width; i += 16) {
+    uint8x16x2_t uv;
+    uv.val[0] = vld1q_u8 (u + i);
+    uv.val[1] = vld1q_u8 (v + i);
+    vst2q_u8 (dest + 2 * i, uv);
+  }
+  gst_framebuffersink_interleave_row_scalar (dest + 2 * i, u + i, v + i,
+      width - i);
+}
+
+static void
+gst_framebuffersink_narrow_row_neon (guint8 *dest, const guint8 *src,
+    int width, int shift)
+{
+  int16x8_t s = vdupq_n_s16 (- shift);
+  int i = 0;
+
+  for (; i + 16 <= width; i += 16) {
+    uint16x8_t a = vshlq_u16 (vld1q_u16 ((const uint16_t *) (src + 2 * i)),
+        s);
+    uint16x8_t b = vshlq_u16 (vld1q_u16 ((const uint16_t *) (src + 2 * i +
+        16)), s);
+    vst1q_u8 (dest + i, vcombine_u8 (vqmovn_u16 (a), vqmovn_u16 (b)));
+  }
+  gst_framebuffersink_narrow_row_scalar (dest + i, src + 2 * i, width - i,
+      shift);
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+static guint32
+gst_framebuffersink_crc32c_armv8 (guint32 crc, const guint8 *data,
+    gsize size)
+{
+  gsize i = 0;
+
+  crc = ~crc;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy (&word, data + i, 8);
+    crc = __crc32cd (crc, word);
+  }
+  for (; i < size; i++)
+    crc = __crc32cb (crc, data[i]);
+  return ~crc;
+}
+#define gst_framebuffersink_crc32c_neon gst_framebuffersink_crc32c_armv8
+#else
+#define gst_framebuffersink_crc32c_neon gst_framebuffersink_crc32c_scalar
+#endif
+
+static gboolean
+gst_framebuffersink_cpu_has_neon (void)
+{
+#if defined(__arm__)
+  return (getauxval (AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+  return TRUE;
+#endif
+}
+
+static const GstFramebufferSinkKernels kernels_neon = {
+  "neon",
+  gst_framebuffersink_copy_libc,
+  gst_framebuffersink_clear_libc,
+  gst_framebuffersink_interleave_row_neon,
+  gst_framebuffersink_narrow_row_neon,
+  gst_framebuffersink_crc32c_neon
+};
+
+#endif
+
+#ifdef HAVE_SSE2_KERNELS
+
+static void
+gst_framebuffersink_interleave_row_sse2 (guint8 *dest, const guint8 *u,
+    const guint8 *v, int width)
+{
+  int i = 0;
+
+  for (; i + 16 <= width; i += 16) {
+    __m128i uu = _mm_loadu_si128 ((const __m128i *) (u + i));
+    __m128i vv = _mm_loadu_si128 ((const __m128i *) (v + i));
+    _mm_storeu_si128 ((__m128i *) (dest + 2 * i),
+        _mm_unpacklo_epi8 (uu, vv));
+    _mm_storeu_si128 ((__m128i *) (dest + 2 * i + 16),
+        _mm_unpackhi_epi8 (uu, vv));
+  }
+  gst_framebuffersink_interleave_row_scalar (dest + 2 * i, u + i, v + i,
+      width - i);
+}
+
+static void
+gst_framebuffersink_narrow_row_sse2 (guint8 *dest, const guint8 *src,
+    int width, int shift)
+{
+  __m128i s = _mm_cvtsi32_si128 (shift);
+  int i = 0;
+
+  /* The pack saturates signed words, so samples of 0x8000 and up would
+     become 0 rather than 255; they only survive a shift of 0. */
+  if (shift < 1) {
+    gst_framebuffersink_narrow_row_scalar (dest, src, width, shift);
+    return;
+  }
+  for (; i + 16 <= width; i += 16) {
+    __m128i a = _mm_srl_epi16 (_mm_loadu_si128 ((const __m128i *) (src +
+        2 * i)), s);
+    __m128i b = _mm_srl_epi16 (_mm_loadu_si128 ((const __m128i *) (src +
+        2 * i + 16)), s);
+    _mm_storeu_si128 ((__m128i *) (dest + i), _mm_packus_epi16 (a, b));
+  }
+  gst_framebuffersink_narrow_row_scalar (dest + i, src + 2 * i, width - i,
+      shift);
+}
+
+static gboolean
+gst_framebuffersink_cpu_has_sse2 (void)
+{
+  return TRUE;
+}
+
+static const GstFramebufferSinkKernels kernels_sse2 = {
+  "sse2",
+  gst_framebuffersink_copy_libc,
+  gst_framebuffersink_clear_libc,
+  gst_framebuffersink_interleave_row_sse2,
+  gst_framebuffersink_narrow_row_sse2,
+  gst_framebuffersink_crc32c_scalar
+};
+
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+
+/* The 256-bit unpack and pack instructions work within 128-bit lanes, so the
+   lanes are put back in order with a permute. */
+
+__attribute__ ((target ("avx2"))) static void
+gst_framebuffersink_interleave_row_avx2 (guint8 *dest, const guint8 *u,
+    const guint8 *v, int width)
+{
+  int i = 0;
+
+  for (; i + 32 <= width; i += 32) {
+    __m256i uu = _mm256_loadu_si256 ((const __m256i *) (u + i));
+    __m256i vv = _mm256_loadu_si256 ((const __m256i *) (v + i));
+    __m256i lo = _mm256_unpacklo_epi8 (uu, vv);
+    __m256i hi = _mm256_unpackhi_epi8 (uu, vv);
+    _mm256_storeu_si256 ((__m256i *) (dest + 2 * i),
+        _mm256_permute2x128_si256 (lo, hi, 0x20));
+    _mm256_storeu_si256 ((__m256i *) (dest + 2 * i + 32),
+        _mm256_permute2x128_si256 (lo, hi, 0x31));
+  }
+  gst_framebuffersink_interleave_row_scalar (dest + 2 * i, u + i, v + i,
+      width - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+gst_framebuffersink_narrow_row_avx2 (guint8 *dest, const guint8 *src,
+    int width, int shift)
+{
+  __m128i s = _mm_cvtsi32_si128 (shift);
+  int i = 0;
+
+  /* See the SSE2 version. */
+  if (shift < 1) {
+    gst_framebuffersink_narrow_row_scalar (dest, src, width, shift);
+    return;
+  }
+  for (; i + 32 <= width; i += 32) {
+    __m256i a = _mm256_srl_epi16 (_mm256_loadu_si256 ((const __m256i *)
+        (src + 2 * i)), s);
+    __m256i b = _mm256_srl_epi16 (_mm256_loadu_si256 ((const __m256i *)
+        (src + 2 * i + 32)), s);
+    _mm256_storeu_si256 ((__m256i *) (dest + i),
+        _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b), 0xD8));
+  }
+  gst_framebuffersink_narrow_row_scalar (dest + i, src + 2 * i, width - i,
+      shift);
+}
+
+/* CPUs with AVX2 also have the SSE4.2 crc32 instruction. */
+
+__attribute__ ((target ("sse4.2"))) static guint32
+gst_framebuffersink_crc32c_sse42 (guint32 crc, const guint8 *data,
+    gsize size)
+{
+  gsize i = 0;
+
+  crc = ~crc;
+#if defined(__x86_64__)
+  for (; i + 8 <= size; i += 8) {
+    guint64 word;
+    memcpy (&word, data + i, 8);
+    crc = (guint32) _mm_crc32_u64 (crc, word);
+  }
+#else
+  for (; i + 4 <= size; i += 4) {
+    guint32 word;
+    memcpy (&word, data + i, 4);
+    crc = _mm_crc32_u32 (crc, word);
+  }
+#endif
+  for (; i < size; i++)
+    crc = _mm_crc32_u8 (crc, data[i]);
+  return ~crc;
+}
+
+static gboolean
+gst_framebuffersink_cpu_has_avx2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("sse4.2");
+}
+
+static const GstFramebufferSinkKernels kernels_avx2 = {
+  "avx2",
+  gst_framebuffersink_copy_libc,
+  gst_framebuffersink_clear_libc,
+  gst_framebuffersink_interleave_row_avx2,
+  gst_framebuffersink_narrow_row_avx2,
+  gst_framebuffersink_crc32c_sse42
+};
+
+#endif
+
+/* Implementations in order of preference. */
+static const struct {
+  const GstFramebufferSinkKernels *kernels;
+  gboolean (*cpu_supported) (void);
+} kernel_implementations[] = {
+#ifdef HAVE_AVX2_KERNELS
+  { &kernels_avx2, gst_framebuffersink_cpu_has_avx2 },
+#endif
+#ifdef HAVE_SSE2_KERNELS
+  { &kernels_sse2, gst_framebuffersink_cpu_has_sse2 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+  { &kernels_neon, gst_framebuffersink_cpu_has_neon },
+#endif
+  { &kernels_scalar, NULL }
+};
+
+const GstFramebufferSinkKernels *gst_framebuffersink_kernels =
+    &kernels_scalar;
+
+/* Compare the kernels with the scalar ones for all widths up to a few
+   vector lengths, so that the tails are covered as well, and for unaligned
+   sources. */
+
+#define SELF_TEST_WIDTH 100
+
+static gboolean
+gst_framebuffersink_kernels_self_test (const GstFramebufferSinkKernels *
+    kernels)
+{
+  guint8 src[2 * SELF_TEST_WIDTH + 1];
+  guint8 dest[2 * SELF_TEST_WIDTH];
+  guint8 reference[2 * SELF_TEST_WIDTH];
+  gsize i;
+  int width, shift;
+
+  for (i = 0; i < sizeof (src); i++)
+    src[i] = (i * 151 + 17) ^ (i >> 3);
+
+  for (width = 0; width <= SELF_TEST_WIDTH; width++) {
+    memset (dest, 0xAA, sizeof (dest));
+    memset (reference, 0xAA, sizeof (reference));
+    kernels->copy (dest, src + 1, width);
+    if (memcmp (dest, src + 1, width) != 0) {
+      GST_ERROR ("%s copy kernel failed for width %d", kernels->name, width);
+      return FALSE;
+    }
+    kernels->clear (dest, width);
+    if (width > 0 && (dest[0] != 0 || dest[width - 1] != 0 ||
+        dest[width] != 0xAA)) {
+      GST_ERROR ("%s clear kernel failed for width %d", kernels->name, width);
+      return FALSE;
+    }
+
+    kernels->interleave_row (dest, src + 1, src + SELF_TEST_WIDTH, width);
+    gst_framebuffersink_interleave_row_scalar (reference, src + 1,
+        src + SELF_TEST_WIDTH, width);
+    if (memcmp (dest, reference, sizeof (dest)) != 0) {
+      GST_ERROR ("%s interleave kernel failed for width %d", kernels->name,
+          width);
+      return FALSE;
+    }
+
+    for (shift = 0; shift <= 16; shift++) {
+      kernels->narrow_row (dest, src, width, shift);
+      gst_framebuffersink_narrow_row_scalar (reference, src, width, shift);
+      if (memcmp (dest, reference, sizeof (dest)) != 0) {
+        GST_ERROR ("%s narrow kernel failed for width %d, shift %d",
+            kernels->name, width, shift);
+        return FALSE;
+      }
+    }
+
+    if (kernels->crc32c (0, src + 1, width) !=
+        gst_framebuffersink_crc32c_scalar (0, src + 1, width)) {
+      GST_ERROR ("%s checksum kernel failed for size %d", kernels->name,
+          width);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+void
+gst_framebuffersink_kernels_init (void)
+{
+  static gsize initialized = 0;
+  const GstFramebufferSinkKernels *kernels = NULL;
+  const char *override;
+  guint i;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  GST_DEBUG_CATEGORY_INIT (gst_framebuffersink_kernels_debug_category,
+      "framebuffersinkkernels", 0, "framebuffersink pixel kernels");
+
+  gst_framebuffersink_crc32c_init_table ();
+
+  override = g_getenv ("GST_FRAMEBUFFERSINK_KERNELS");
+  for (i = 0; i < G_N_ELEMENTS (kernel_implementations); i++) {
+    if (override != NULL &&
+        strcmp (override, kernel_implementations[i].kernels->name) != 0)
+      continue;
+    if (kernel_implementations[i].cpu_supported != NULL &&
+        !kernel_implementations[i].cpu_supported ()) {
+      if (override != NULL)
+        GST_WARNING ("%s kernels requested but not supported by the CPU",
+            override);
+      continue;
+    }
+    kernels = kernel_implementations[i].kernels;
+    break;
+  }
+  if (kernels == NULL) {
+    if (override != NULL)
+      GST_WARNING ("Unknown or unavailable kernels %s requested", override);
+    kernels = &kernels_scalar;
+  }
+
+  if (kernels != &kernels_scalar &&
+      !gst_framebuffersink_kernels_self_test (kernels))
+    kernels = &kernels_scalar;
+
+  gst_framebuffersink_kernels = kernels;
+  GST_INFO ("Using %s pixel kernels", kernels->name);
+
+  g_once_init_leave (&initialized, 1);
+}
@@ -0,0 +1,59 @@
+/* GStreamer GstFramebufferSink pixel kernels
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_FRAMEBUFFERSINK_KERNELS_H_
+#define _GST_FRAMEBUFFERSINK_KERNELS_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The CPU pixel kernels used by GstFramebufferSink and its subclasses. One
+   implementation (scalar, NEON, SSE2 or AVX2) is selected for the CPU the
+   plugin runs on by gst_framebuffersink_kernels_init(), which every plugin
+   calls from plugin_init. The selection can be overridden with the
+   GST_FRAMEBUFFERSINK_KERNELS environment variable, set to the name of an
+   implementation. */
+
+typedef struct _GstFramebufferSinkKernels GstFramebufferSinkKernels;
+
+struct _GstFramebufferSinkKernels {
+  const char *name;
+  /* Copy and fill size bytes. */
+  void (*copy) (guint8 *dest, const guint8 *src, gsize size);
+  void (*clear) (guint8 *dest, gsize size);
+  /* Interleave width bytes of the U and V planes into dest (I420 to NV12). */
+  void (*interleave_row) (guint8 *dest, const guint8 *u, const guint8 *v,
+      int width);
+  /* Narrow width little-endian 16-bit samples to 8 bits by shifting them
+     right by 0 to 16 bits, saturating (10-bit to 8-bit). */
+  void (*narrow_row) (guint8 *dest, const guint8 *src, int width, int shift);
+  /* Continue the CRC-32C of earlier data, crc (0 to start), over size
+     bytes. */
+  guint32 (*crc32c) (guint32 crc, const guint8 *data, gsize size);
+};
+
+/* The selected kernels; the scalar ones until gst_framebuffersink_kernels_init
+   has been called. */
+extern const GstFramebufferSinkKernels *gst_framebuffersink_kernels;
+
+void gst_framebuffersink_kernels_init (void);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,90 @@
+/* GStreamer GstFramebufferSink physical address meta
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gstframebuffersinkmeta.h"
+
+GType
+gst_framebuffersink_physical_address_meta_api_get_type (void)
+{
+  static volatile GType type = 0;
+  static const gchar *tags[] = { GST_META_TAG_VIDEO_STR,
+      GST_META_TAG_MEMORY_STR, NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register (
+        "GstFramebufferSinkPhysicalAddressMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+static gboolean
+gst_framebuffersink_physical_address_meta_init (GstMeta *meta,
+    gpointer params, GstBuffer *buffer)
+{
+  GstFramebufferSinkPhysicalAddressMeta *pmeta =
+      (GstFramebufferSinkPhysicalAddressMeta *) meta;
+
+  pmeta->n_planes = 0;
+  memset (pmeta->physical_address, 0, sizeof (pmeta->physical_address));
+  memset (pmeta->stride, 0, sizeof (pmeta->stride));
+  pmeta->virtual_address = NULL;
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_framebuffersink_physical_address_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) &meta_info)) {
+    const GstMetaInfo *mi = gst_meta_register (
+        GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_API_TYPE,
+        "GstFramebufferSinkPhysicalAddressMeta",
+        sizeof (GstFramebufferSinkPhysicalAddressMeta),
+        gst_framebuffersink_physical_address_meta_init, NULL, NULL);
+    g_once_init_leave ((GstMetaInfo **) &meta_info, (GstMetaInfo *) mi);
+  }
+  return meta_info;
+}
+
+GstFramebufferSinkPhysicalAddressMeta *
+gst_framebuffersink_buffer_add_physical_address_meta (GstBuffer *buffer,
+    guint n_planes, const guintptr *physical_address, const gint *stride)
+{
+  GstFramebufferSinkPhysicalAddressMeta *meta;
+  guint i;
+
+  g_return_val_if_fail (n_planes <= GST_VIDEO_MAX_PLANES, NULL);
+
+  meta = (GstFramebufferSinkPhysicalAddressMeta *) gst_buffer_add_meta (
+      buffer, GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_INFO, NULL);
+  if (meta == NULL)
+    return NULL;
+  meta->n_planes = n_planes;
+  for (i = 0; i < n_planes; i++) {
+    meta->physical_address[i] = physical_address[i];
+    meta->stride[i] = stride[i];
+  }
+  return meta;
+}
@@ -0,0 +1,68 @@
+/* GStreamer GstFramebufferSink physical address meta
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_FRAMEBUFFERSINK_META_H_
+#define _GST_FRAMEBUFFERSINK_META_H_
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/* Physical addresses of the planes of a frame in physically contiguous
+   memory. Producers such as hardware decoders attach it to their buffers so
+   that the frame can be scanned out by an overlay without mapping it. The
+   meta is dropped when the buffer memory is copied.
+
+   This header is installed with libgstframebuffersink. A producer includes
+   <gst/framebuffersink/gstframebuffersinkmeta.h>, links with
+   -lgstframebuffersink and calls
+   gst_framebuffersink_buffer_add_physical_address_meta() on each buffer
+   when the sink lists the meta API in its allocation query. The planes must
+   be laid out with the offsets and strides the sink's overlay expects;
+   frames that don't match are copied instead. */
+typedef struct _GstFramebufferSinkPhysicalAddressMeta
+    GstFramebufferSinkPhysicalAddressMeta;
+
+struct _GstFramebufferSinkPhysicalAddressMeta {
+  GstMeta meta;
+  guint n_planes;
+  guintptr physical_address[GST_VIDEO_MAX_PLANES];
+  gint stride[GST_VIDEO_MAX_PLANES];
+  /* CPU address of the first plane when the producer wrote the frame through
+     a cached mapping, NULL otherwise. */
+  gpointer virtual_address;
+};
+
+GType gst_framebuffersink_physical_address_meta_api_get_type (void);
+#define GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_API_TYPE \
+    (gst_framebuffersink_physical_address_meta_api_get_type())
+const GstMetaInfo *gst_framebuffersink_physical_address_meta_get_info (void);
+#define GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_INFO \
+    (gst_framebuffersink_physical_address_meta_get_info())
+
+#define gst_framebuffersink_buffer_get_physical_address_meta(b) \
+    ((GstFramebufferSinkPhysicalAddressMeta *) gst_buffer_get_meta ((b), \
+    GST_FRAMEBUFFERSINK_PHYSICAL_ADDRESS_META_API_TYPE))
+GstFramebufferSinkPhysicalAddressMeta *
+gst_framebuffersink_buffer_add_physical_address_meta (GstBuffer *buffer,
+    guint n_planes, const guintptr *physical_address, const gint *stride);
+
+G_END_DECLS
+
+#endif
@@ -123,6 +123,7 @@
 #include <gst/video/video.h>
 #include <gst/video/video-info.h>
 #include "gstsunxifbsink.h"
+#include "gstframebuffersinkkernels.h"
 #include <ion_mem_alloc.h>
 #include "sunxi_tr.h"
 #include "g2d_driver_enh.h"
@@ -146,6 +147,16 @@ const gchar *message) {
     GST_INFO_OBJECT (sunxifbsink,"%"GST_PTR_FORMAT, message);
 }
 
+/* When LAZY_ALLOCATION is defined, physically contiguous overlay buffers
+   are only allocated from ION when they are mapped or shown for the first
+   time, so that a pool that is replaced before use doesn't pin CMA memory. */
+#define LAZY_ALLOCATION
+
+/* Define OMX_PRIVATE_BUFFER for decoders that write an OmxPrivateBuffer
+   descriptor of their frame into the start of video memory buffers instead
+   of the frame itself, and don't attach a physical address meta. */
+/* #define OMX_PRIVATE_BUFFER */
+
 #define ALIGNMENT_GET_ALIGN_BYTES(offset, align) \
     (((align) + 1 - ((offset) & (align))) & (align))
 #define ALIGNMENT_GET_ALIGNED(offset, align) \
@@ -153,7 +164,21 @@ const gchar *message) {
 #define ALIGNMENT_APPLY(offset, align) \
     offset = ALIGNMENT_GET_ALIGNED(offset, align);
 
+/* Where the planes of an overlay frame are, and how many of their scanlines
+   are displayed. */
+typedef struct
+{
+  int n_planes;
+  int offset[4];
+  int stride[4];
+  int height[4];
+} GstSunxifbsinkPlaneLayout;
+
 /* Class function prototypes. */
+static void gst_sunxifbsink_set_property (GObject * object,
+    guint property_id, const GValue * value, GParamSpec * pspec);
+static void gst_sunxifbsink_get_property (GObject * object,
+    guint property_id, GValue * value, GParamSpec * pspec);
 static gboolean gst_sunxifbsink_open_hardware (
     GstFramebufferSink *framebuffersink, GstVideoInfo *info,
     gsize *video_memory_size, gsize *pannable_video_memory_size);
@@ -169,15 +194,52 @@ static gboolean gst_sunxifbsink_prepare_overlay (
     GstFramebufferSink *framebuffersink, GstVideoFormat format);
 static GstFlowReturn gst_sunxifbsink_show_overlay (
     GstFramebufferSink *framebuffersink, GstMemory *memory);
-
+static GstFlowReturn gst_sunxifbsink_show_overlay_physical (
+    GstFramebufferSink *framebuffersink,
+    GstFramebufferSinkPhysicalAddressMeta *meta);
+static GstAllocator *gst_sunxifbsink_video_memory_allocator_new (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info, gboolean pannable,
+    gboolean is_overlay);
+static gboolean gst_sunxifbsink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info);
+
+static gboolean gst_sunxifbsink_claim_layer (GstSunxifbsink *sunxifbsink,
+    int *layer_id, int *channel, int *zorder);
+static void gst_sunxifbsink_unclaim_layer (GstSunxifbsink *sunxifbsink,
+    int layer_id, int channel);
 static gboolean gst_sunxifbsink_reserve_layer (GstSunxifbsink *sunxifbsink);
 static void gst_sunxifbsink_release_layer (GstSunxifbsink *sunxifbsink);
 static gboolean gst_sunxifbsink_show_layer (GstSunxifbsink *sunxifbsink);
 static void gst_sunxifbsink_hide_layer (GstSunxifbsink *sunxifbsink);
+static void gst_sunxifbsink_free_g2d_buffers (GstSunxifbsink *sunxifbsink);
+static gboolean gst_sunxifbsink_show_overlay_composition (
+    GstFramebufferSink *framebuffersink,
+    GstVideoOverlayComposition *composition);
+static void gst_sunxifbsink_release_composition_layer (
+    GstSunxifbsink *sunxifbsink);
+
+/* Physically contiguous memory allocator. */
+static GstAllocator *gst_sunxifbsink_allocator_new (
+    GstSunxifbsink *sunxifbsink, GstVideoInfo *info);
+static guintptr gst_sunxifbsink_memory_get_physical_address (GstMemory *mem);
+static void gst_sunxifbsink_memory_flush (GstSunxifbsink *sunxifbsink,
+    GstMemory *mem);
+static void gst_sunxifbsink_get_plane_layout (
+    GstFramebufferSink *framebuffersink, GstVideoInfo *info,
+    GstSunxifbsinkPlaneLayout *layout);
+static void gst_sunxifbsink_flush_planes (GstSunxifbsink *sunxifbsink,
+    gpointer data, const GstSunxifbsinkPlaneLayout *layout);
+static void gst_sunxifbsink_flush_cache (GstSunxifbsink *sunxifbsink,
+    gpointer data, gsize size);
 
 enum
 {
   PROP_0,
+  PROP_CONTIGUOUS_MEMORY,
+  PROP_FLUSH_DECODER_BUFFERS,
+  PROP_G2D,
+  PROP_COMPOSITION_LAYER,
 };
 
 #define GST_SUNXIFBSINK_TEMPLATE_CAPS \
@@ -194,7 +256,22 @@ enum
         "; " GST_VIDEO_CAPS_MAKE ("YUY2") \
         "; " GST_VIDEO_CAPS_MAKE ("UYVY") \
         "; " GST_VIDEO_CAPS_MAKE ("Y444") \
-        "; " GST_VIDEO_CAPS_MAKE ("AYUV") ", " \
+        "; " GST_VIDEO_CAPS_MAKE ("AYUV") \
+        "; " GST_VIDEO_CAPS_MAKE ("RGB16") \
+        "; " GST_VIDEO_CAPS_MAKE ("BGR16") \
+        "; " GST_VIDEO_CAPS_MAKE ("BGRA") \
+        "; " GST_VIDEO_CAPS_MAKE ("RGBA") \
+        "; " GST_VIDEO_CAPS_MAKE ("ARGB") \
+        "; " GST_VIDEO_CAPS_MAKE ("ABGR") \
+        "; " GST_VIDEO_CAPS_MAKE ("YVYU") \
+        "; " GST_VIDEO_CAPS_MAKE ("VYUY") \
+        "; " GST_VIDEO_CAPS_MAKE ("NV16") \
+        "; " GST_VIDEO_CAPS_MAKE ("NV61") \
+        "; " GST_VIDEO_CAPS_MAKE ("Y42B") \
+        "; " GST_VIDEO_CAPS_MAKE ("Y41B") \
+        "; " GST_VIDEO_CAPS_MAKE ("GRAY8") \
+        "; " GST_VIDEO_CAPS_MAKE ("P010_10LE") \
+        "; " GST_VIDEO_CAPS_MAKE ("Y444_10LE") ", " \
         "framerate = (fraction) [ 0, MAX ], " \
         "width = (int) [ 1, MAX ], " "height = (int) [ 1, MAX ]"
 
@@ -220,6 +297,86 @@ static GstVideoFormat sunxifbsink_supported_overlay_formats_table[] = {
   GST_VIDEO_FORMAT_UNKNOWN
 };
 
+/* When G2D is available, formats the display layer can't show are converted
+   to BGRx by G2D. They are listed after the formats the layer supports
+   directly so that the latter are preferred. */
+static GstVideoFormat sunxifbsink_g2d_overlay_formats_table[] = {
+  GST_VIDEO_FORMAT_YV12,
+  GST_VIDEO_FORMAT_I420,
+  GST_VIDEO_FORMAT_NV12,
+  GST_VIDEO_FORMAT_NV21,
+  GST_VIDEO_FORMAT_AYUV,
+  GST_VIDEO_FORMAT_BGRx,
+  GST_VIDEO_FORMAT_YUY2,
+  GST_VIDEO_FORMAT_UYVY,
+  GST_VIDEO_FORMAT_Y444,
+  /* Formats converted by G2D. */
+  GST_VIDEO_FORMAT_BGRA,
+  GST_VIDEO_FORMAT_RGBx,
+  GST_VIDEO_FORMAT_RGBA,
+  GST_VIDEO_FORMAT_xRGB,
+  GST_VIDEO_FORMAT_ARGB,
+  GST_VIDEO_FORMAT_xBGR,
+  GST_VIDEO_FORMAT_ABGR,
+  GST_VIDEO_FORMAT_NV16,
+  GST_VIDEO_FORMAT_NV61,
+  GST_VIDEO_FORMAT_Y42B,
+  GST_VIDEO_FORMAT_YVYU,
+  GST_VIDEO_FORMAT_VYUY,
+  GST_VIDEO_FORMAT_Y41B,
+  GST_VIDEO_FORMAT_RGB,
+  GST_VIDEO_FORMAT_BGR,
+  GST_VIDEO_FORMAT_RGB16,
+  GST_VIDEO_FORMAT_BGR16,
+  GST_VIDEO_FORMAT_GRAY8,
+  GST_VIDEO_FORMAT_UNKNOWN
+};
+
+/* G2D source formats. The G2D format names give the components from the most
+   significant bit down, so e.g. G2D_FORMAT_XRGB8888 is BGRx in memory. */
+typedef struct {
+  GstVideoFormat format;
+  g2d_fmt_enh g2d_format;
+  /* Whether the second and third planes are stored as V, U. */
+  gboolean swap_uv;
+} SunxifbsinkG2dFormat;
+
+static const SunxifbsinkG2dFormat sunxifbsink_g2d_formats_table[] = {
+  { GST_VIDEO_FORMAT_BGRA, G2D_FORMAT_ARGB8888, FALSE },
+  { GST_VIDEO_FORMAT_RGBA, G2D_FORMAT_ABGR8888, FALSE },
+  { GST_VIDEO_FORMAT_ABGR, G2D_FORMAT_RGBA8888, FALSE },
+  { GST_VIDEO_FORMAT_ARGB, G2D_FORMAT_BGRA8888, FALSE },
+  { GST_VIDEO_FORMAT_BGRx, G2D_FORMAT_XRGB8888, FALSE },
+  { GST_VIDEO_FORMAT_RGBx, G2D_FORMAT_XBGR8888, FALSE },
+  { GST_VIDEO_FORMAT_xBGR, G2D_FORMAT_RGBX8888, FALSE },
+  { GST_VIDEO_FORMAT_xRGB, G2D_FORMAT_BGRX8888, FALSE },
+  { GST_VIDEO_FORMAT_BGR, G2D_FORMAT_RGB888, FALSE },
+  { GST_VIDEO_FORMAT_RGB, G2D_FORMAT_BGR888, FALSE },
+  { GST_VIDEO_FORMAT_RGB16, G2D_FORMAT_RGB565, FALSE },
+  { GST_VIDEO_FORMAT_BGR16, G2D_FORMAT_BGR565, FALSE },
+  { GST_VIDEO_FORMAT_YUY2, G2D_FORMAT_IYUV422_V0Y1U0Y0, FALSE },
+  { GST_VIDEO_FORMAT_UYVY, G2D_FORMAT_IYUV422_Y1V0Y0U0, FALSE },
+  { GST_VIDEO_FORMAT_YVYU, G2D_FORMAT_IYUV422_U0Y1V0Y0, FALSE },
+  { GST_VIDEO_FORMAT_VYUY, G2D_FORMAT_IYUV422_Y1U0Y0V0, FALSE },
+  { GST_VIDEO_FORMAT_NV16, G2D_FORMAT_YUV422UVC_V1U1V0U0, FALSE },
+  { GST_VIDEO_FORMAT_NV61, G2D_FORMAT_YUV422UVC_U1V1U0V0, FALSE },
+  { GST_VIDEO_FORMAT_Y42B, G2D_FORMAT_YUV422_PLANAR, FALSE },
+  { GST_VIDEO_FORMAT_NV12, G2D_FORMAT_YUV420UVC_V1U1V0U0, FALSE },
+  { GST_VIDEO_FORMAT_NV21, G2D_FORMAT_YUV420UVC_U1V1U0V0, FALSE },
+  { GST_VIDEO_FORMAT_I420, G2D_FORMAT_YUV420_PLANAR, FALSE },
+  { GST_VIDEO_FORMAT_YV12, G2D_FORMAT_YUV420_PLANAR, TRUE },
+  { GST_VIDEO_FORMAT_Y41B, G2D_FORMAT_YUV411_PLANAR, FALSE },
+  { GST_VIDEO_FORMAT_GRAY8, G2D_FORMAT_Y8, FALSE },
+  /* P010_10LE is not converted by G2D: the driver only has the V-first
+     G2D_FORMAT_YVU10_P010, and swapping the plane addresses can't reorder
+     interleaved chroma. The base class narrows it to NV12 instead. */
+  { GST_VIDEO_FORMAT_UNKNOWN, G2D_FORMAT_MAX, FALSE }
+};
+
+/* The largest downscaling factor handed to the display layer scaler. Larger
+   factors are handled by G2D. */
+#define SUNXIFBSINK_LAYER_MAX_DOWNSCALE 4
+
 #define TRANSFORM_DEV_TIMEOUT 200
 #define ALIGN_32B(x) (((x) + (31)) & ~(31))
 #define ALIGN_16B(x) (((x) + (15)) & ~(15))
@@ -235,12 +392,12 @@ G_DEFINE_TYPE_WITH_CODE (GstSunxifbsink, gst_sunxifbsink,
 static void
 gst_sunxifbsink_class_init (GstSunxifbsinkClass* klass)
 {
-/*  GObjectClass *gobject_class = G_OBJECT_CLASS (klass); */
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GstFramebufferSinkClass *framebuffer_sink_class =
       GST_FRAMEBUFFERSINK_CLASS (klass);
 
-/*  gobject_class->set_property = gst_sunxifbsink_set_property;
-    gobject_class->get_property = gst_sunxifbsink_get_property; */
+  gobject_class->set_property = gst_sunxifbsink_set_property;
+  gobject_class->get_property = gst_sunxifbsink_get_property;
 
   /* Setting up pads and setting metadata should be moved to
      base_class_init if you intend to subclass this class. */
@@ -253,6 +410,36 @@ gst_sunxifbsink_class_init (GstSunxifbsinkClass* klass)
       "sunxi framebuffer sink",
       "Harm Hanemaaijer <fgenfb@yahoo.com>");
 
+  g_object_class_install_property (gobject_class, PROP_CONTIGUOUS_MEMORY,
+      g_param_spec_boolean ("contiguous-memory",
+      "Physically contiguous overlay memory",
+      "Allocate overlay buffers (including the buffer pool offered upstream "
+      "in buffer-pool mode) from physically contiguous ION memory so that "
+      "the display layer can scan them out directly for every overlay "
+      "format. Requires video-memory > 0. Not compatible with decoders "
+      "that pass an OmxPrivateBuffer descriptor in video memory buffers.",
+      FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FLUSH_DECODER_BUFFERS,
+      g_param_spec_boolean ("flush-decoder-buffers",
+      "Flush decoder buffers",
+      "Write back the CPU cache for frames described by a physical address "
+      "meta (or a decoder OmxPrivateBuffer) before showing them. Frames "
+      "produced by the hardware decoder don't need this; disable it to skip "
+      "the cache flush when the decoder never writes frames with the CPU.",
+      TRUE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_G2D,
+      g_param_spec_boolean ("g2d",
+      "Use G2D",
+      "Use the G2D engine to convert and scale frames in formats or at "
+      "scaling ratios the display layer can't handle",
+      TRUE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_COMPOSITION_LAYER,
+      g_param_spec_boolean ("composition-layer",
+      "Composition layer",
+      "Show subtitles and other overlay compositions on a display layer of "
+      "their own instead of letting upstream blend them into the video frames",
+      FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   framebuffer_sink_class->open_hardware =
       GST_DEBUG_FUNCPTR (gst_sunxifbsink_open_hardware);
   framebuffer_sink_class->close_hardware =
@@ -265,6 +452,14 @@ gst_sunxifbsink_class_init (GstSunxifbsinkClass* klass)
       GST_DEBUG_FUNCPTR (gst_sunxifbsink_prepare_overlay);
   framebuffer_sink_class->show_overlay =
       GST_DEBUG_FUNCPTR (gst_sunxifbsink_show_overlay);
+  framebuffer_sink_class->show_overlay_physical =
+      GST_DEBUG_FUNCPTR (gst_sunxifbsink_show_overlay_physical);
+  framebuffer_sink_class->video_memory_allocator_new =
+      GST_DEBUG_FUNCPTR (gst_sunxifbsink_video_memory_allocator_new);
+  framebuffer_sink_class->video_memory_allocator_is_reusable =
+      GST_DEBUG_FUNCPTR (gst_sunxifbsink_video_memory_allocator_is_reusable);
+  framebuffer_sink_class->show_overlay_composition =
+      GST_DEBUG_FUNCPTR (gst_sunxifbsink_show_overlay_composition);
 }
 
 /* Class member functions. */
@@ -272,6 +467,76 @@ gst_sunxifbsink_class_init (GstSunxifbsinkClass* klass)
 static void
 gst_sunxifbsink_init (GstSunxifbsink *sunxifbsink) {
 	GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, "-->sunxifbsink init");
+
+  sunxifbsink->layer_id = -1;
+  sunxifbsink->fd_g2d = -1;
+  sunxifbsink->composition_layer_id = -1;
+
+  /* Set the initial values of the properties.*/
+  sunxifbsink->use_contiguous_memory = FALSE;
+  sunxifbsink->flush_decoder_buffers = TRUE;
+  sunxifbsink->use_g2d = TRUE;
+  sunxifbsink->use_composition_layer = FALSE;
+}
+
+static void
+gst_sunxifbsink_set_property (GObject * object, guint property_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (object);
+
+  GST_DEBUG_OBJECT (sunxifbsink, "set_property");
+  g_return_if_fail (GST_IS_SUNXIFBSINK (object));
+
+  switch (property_id) {
+    case PROP_CONTIGUOUS_MEMORY:
+      sunxifbsink->use_contiguous_memory = g_value_get_boolean (value);
+      break;
+    case PROP_FLUSH_DECODER_BUFFERS:
+      sunxifbsink->flush_decoder_buffers = g_value_get_boolean (value);
+      break;
+    case PROP_G2D:
+      sunxifbsink->use_g2d = g_value_get_boolean (value);
+      break;
+    case PROP_COMPOSITION_LAYER:
+      sunxifbsink->use_composition_layer = g_value_get_boolean (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+  }
+
+  GST_OBJECT_LOCK (sunxifbsink);
+  gst_framebuffersink_clear_caps_cache (GST_FRAMEBUFFERSINK (sunxifbsink));
+  GST_OBJECT_UNLOCK (sunxifbsink);
+}
+
+static void
+gst_sunxifbsink_get_property (GObject * object, guint property_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (object);
+
+  GST_DEBUG_OBJECT (sunxifbsink, "get_property");
+  g_return_if_fail (GST_IS_SUNXIFBSINK (object));
+
+  switch (property_id) {
+    case PROP_CONTIGUOUS_MEMORY:
+      g_value_set_boolean (value, sunxifbsink->use_contiguous_memory);
+      break;
+    case PROP_FLUSH_DECODER_BUFFERS:
+      g_value_set_boolean (value, sunxifbsink->flush_decoder_buffers);
+      break;
+    case PROP_G2D:
+      g_value_set_boolean (value, sunxifbsink->use_g2d);
+      break;
+    case PROP_COMPOSITION_LAYER:
+      g_value_set_boolean (value, sunxifbsink->use_composition_layer);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+  }
 }
 
 static gboolean
@@ -294,6 +559,11 @@ gst_sunxifbsink_open_hardware (GstFramebufferSink *framebuffersink,
 
   sunxifbsink->hardware_overlay_available = FALSE;
 
+  sunxifbsink->stats_cache_flushes = 0;
+  sunxifbsink->stats_cache_flushes_skipped = 0;
+  sunxifbsink->stats_cache_flush_bytes = 0;
+  sunxifbsink->stats_cache_flush_time = 0;
+
   if (framebuffersink->use_hardware_overlay == FALSE)
     return TRUE;
 
@@ -327,18 +597,26 @@ gst_sunxifbsink_open_hardware (GstFramebufferSink *framebuffersink,
     }
   }
 
-#ifdef __SUNXI_G2D_ROTATE__
+  /* G2D is used for rotation and for conversions the layer can't do. */
   sunxifbsink->fd_g2d = open ("/dev/g2d", O_RDWR);
   if (sunxifbsink->fd_g2d < 0){
       GST_SUNXIFBSINK_ERROR_OBJECT (sunxifbsink,
           "-->open /dev/g2d error.");
+#ifdef __SUNXI_G2D_ROTATE__
       return TRUE;
-  }
 #endif
+  }
+  sunxifbsink->g2d_buffer[0] = NULL;
+  sunxifbsink->g2d_buffer[1] = NULL;
+  sunxifbsink->g2d_buffer_size = 0;
+  sunxifbsink->g2d_buffer_index = 0;
 
   if (!gst_sunxifbsink_reserve_layer(sunxifbsink)) {
     GST_SUNXIFBSINK_ERROR_OBJECT (sunxifbsink, "-->sunxifbsink reserver layer failed.");
     close(sunxifbsink->fd_disp);
+    sunxifbsink->fd_disp = -1;
+    /* Render into the framebuffer instead of a hardware overlay. */
+    framebuffersink->use_hardware_overlay = FALSE;
     return TRUE;
   }
 
@@ -346,7 +624,30 @@ gst_sunxifbsink_open_hardware (GstFramebufferSink *framebuffersink,
   sunxifbsink->hardware_overlay_available = TRUE;
   GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, "-->Hardware overlay available");
 
+  /* Claim a second layer for subtitles and OSD, if one is free. */
+  sunxifbsink->composition_layer_id = -1;
+  sunxifbsink->composition_layer_is_visible = FALSE;
+  sunxifbsink->composition_buffer[0] = NULL;
+  sunxifbsink->composition_buffer[1] = NULL;
+  sunxifbsink->composition_buffer_size = 0;
+  sunxifbsink->composition_buffer_index = 0;
+  if (sunxifbsink->use_composition_layer &&
+      gst_sunxifbsink_claim_layer(sunxifbsink,
+          &sunxifbsink->composition_layer_id,
+          &sunxifbsink->composition_layer_channel,
+          &sunxifbsink->composition_layer_zorder))
+    framebuffersink->use_overlay_composition = TRUE;
+
+#ifdef OMX_PRIVATE_BUFFER
   sunxifbsink->sBuffer= g_new0(OmxPrivateBuffer, 1);
+#endif
+  if (sunxifbsink->hardware_overlay_available)
+    framebuffersink->use_physical_address_meta = TRUE;
+#if defined(__SUNXI_DISPLAY2__) || defined(CONFIG_HOMLET_PLATFORM)
+  /* The layer deinterlaces given the field order. */
+  if (sunxifbsink->hardware_overlay_available)
+    framebuffersink->use_interlaced_scan = TRUE;
+#endif
 
   return TRUE;
 }
@@ -356,16 +657,27 @@ gst_sunxifbsink_close_hardware (GstFramebufferSink *framebuffersink) {
   GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
   GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, "-->sunxifbsink close");
   struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  gchar s[256];
+
+  g_sprintf (s, "%u cache flushes (%.2lf MB) taking %.3lf ms, %u skipped",
+      sunxifbsink->stats_cache_flushes,
+      (double) sunxifbsink->stats_cache_flush_bytes / (1024 * 1024),
+      (double) sunxifbsink->stats_cache_flush_time / 1000,
+      sunxifbsink->stats_cache_flushes_skipped);
+  GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, s);
 
+#ifdef OMX_PRIVATE_BUFFER
   g_free(sunxifbsink->sBuffer);
+#endif
 
   if (sunxifbsink->hardware_overlay_available) {
+    gst_sunxifbsink_release_composition_layer(sunxifbsink);
     gst_sunxifbsink_hide_layer(sunxifbsink);
     gst_sunxifbsink_release_layer(sunxifbsink);
   }
   /* Before calling close_hardware, use_hardware_overlay is expected to have
      been reset to the original value it had when open_hardware was called. */
-  if (framebuffersink->use_hardware_overlay)
+  if (framebuffersink->use_hardware_overlay && sunxifbsink->fd_disp >= 0)
     close(sunxifbsink->fd_disp);
 
   if(sunxifbsink->rotate_addr_phy[0] != NULL)
@@ -377,22 +689,25 @@ gst_sunxifbsink_close_hardware (GstFramebufferSink *framebuffersink) {
   {
 	SunxiMemPfree(ops,sunxifbsink->rotate_addr_phy[1]);
   }
+  gst_sunxifbsink_free_g2d_buffers(sunxifbsink);
   gst_fbdevframebuffersink_close_hardware (framebuffersink);
 
   if(sunxifbsink->fd_transform >= 0)
 	close(sunxifbsink->fd_transform);
 
-#ifdef __SUNXI_G2D_ROTATE__
   if(sunxifbsink->fd_g2d >= 0)
 	close(sunxifbsink->fd_g2d);
-#endif
+  sunxifbsink->fd_g2d = -1;
 }
 
 static GstVideoFormat *
 gst_sunxifbsink_get_supported_overlay_formats (
     GstFramebufferSink *framebuffersink)
 {
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
 
+  if (sunxifbsink->use_g2d && sunxifbsink->fd_g2d >= 0)
+    return sunxifbsink_g2d_overlay_formats_table;
   return sunxifbsink_supported_overlay_formats_table;
 }
 
@@ -432,6 +747,13 @@ gst_sunxifbsink_get_overlay_video_alignment(GstFramebufferSink *framebuffersink,
   gst_framebuffersink_set_overlay_video_alignment_from_scanline_alignment (
       framebuffersink, video_info, 3, TRUE, video_alignment,
       video_alignment_matches);
+  /* G2D takes the source pitch in pixels, so for 24-bit formats (which are
+     only shown through G2D) the word-aligned scanline stride must be a whole
+     number of pixels. */
+  if (GST_VIDEO_INFO_COMP_PSTRIDE (video_info, 0) == 3 &&
+      ALIGNMENT_GET_ALIGNED (GST_VIDEO_INFO_WIDTH (video_info) * 3, 3) % 3
+      != 0)
+    return FALSE;
   return TRUE;
 }
 
@@ -473,6 +795,13 @@ gst_sunxifbsink_prepare_overlay (GstFramebufferSink *framebuffersink,
   if (sunxifbsink->layer_is_visible)
     gst_sunxifbsink_hide_layer(sunxifbsink);
 
+  /* Hide the overlay composition as well; it will be shown again in the new
+     video window with the next frame that carries one. */
+  if (sunxifbsink->composition_layer_is_visible) {
+    gst_sunxifbsink_show_overlay_composition (framebuffersink, NULL);
+    framebuffersink->overlay_composition_seqnum = 0;
+  }
+
   sunxifbsink->overlay_format = format;
 
   return TRUE;
@@ -524,6 +853,106 @@ setup_tr:
     return ret;
 }
 
+/* The display engine, transform and G2D calls, with trace points around
+   them. */
+
+static int
+gst_sunxifbsink_set_layer_config (GstSunxifbsink *sunxifbsink, int layer_id,
+    luapi_layer_config *luapiconfig)
+{
+  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (sunxifbsink);
+  GstClockTime begin;
+  int ret;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink,
+      "DispSetLayerConfig");
+  ret = DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id,
+      layer_id, 1, luapiconfig);
+  gst_framebuffersink_trace_end (framebuffersink, "DispSetLayerConfig",
+      begin);
+  return ret;
+}
+
+static int
+gst_sunxifbsink_rotate (GstSunxifbsink *sunxifbsink, tr_info *info)
+{
+  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (sunxifbsink);
+  GstClockTime begin;
+  int ret;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink,
+      "hwRotateVideoPicture");
+  ret = hwRotateVideoPicture(sunxifbsink, info);
+  gst_framebuffersink_trace_end (framebuffersink, "hwRotateVideoPicture",
+      begin);
+  return ret;
+}
+
+static int
+gst_sunxifbsink_g2d_blit (GstSunxifbsink *sunxifbsink, g2d_blt_h *blit)
+{
+  GstFramebufferSink *framebuffersink = GST_FRAMEBUFFERSINK (sunxifbsink);
+  GstClockTime begin;
+  int ret;
+
+  begin = gst_framebuffersink_trace_begin (framebuffersink,
+      "G2D_CMD_BITBLT_H");
+  ret = ioctl(sunxifbsink->fd_g2d, G2D_CMD_BITBLT_H, (unsigned long)blit);
+  gst_framebuffersink_trace_end (framebuffersink, "G2D_CMD_BITBLT_H", begin);
+  return ret;
+}
+
+/* Select what the layer scans out of the frame described by a layer
+   configuration. A single field (bob) is shown by doubling the line pitch,
+   which turns the frame into a picture of half the height holding the top
+   field in its left half and the bottom field in its right half, and
+   cropping the field from it. A whole interlaced frame is deinterlaced by
+   the display engine given its field order. */
+
+static void
+gst_sunxifbsink_set_layer_scan (GstFramebufferSink *framebuffersink,
+    luapi_layer_config *luapiconfig)
+{
+#ifdef __SUNXI_DISPLAY2__
+  disp_fb_info *fb = &luapiconfig->layerConfig.info.fb;
+  int i;
+
+  if (framebuffersink->overlay_field != GST_FRAMEBUFFERSINK_FIELD_NONE) {
+    for (i = 0; i < 3; i++) {
+      fb->size[i].width *= 2;
+      fb->size[i].height /= 2;
+    }
+    if (framebuffersink->overlay_field == GST_FRAMEBUFFERSINK_FIELD_BOTTOM)
+      fb->crop.x = (unsigned long long)(fb->size[0].width / 2) << 32;
+    fb->crop.height = (unsigned long long)((fb->crop.height >> 32) / 2) << 32;
+  }
+  else if (framebuffersink->overlay_first_field ==
+      GST_FRAMEBUFFERSINK_FIELD_TOP)
+    fb->scan = DISP_SCAN_INTERLACED_ODD_FLD_FIRST;
+  else if (framebuffersink->overlay_first_field ==
+      GST_FRAMEBUFFERSINK_FIELD_BOTTOM)
+    fb->scan = DISP_SCAN_INTERLACED_EVEN_FLD_FIRST;
+#else
+  disp_fb_info *fb = &luapiconfig->layerConfig.fb;
+
+  if (framebuffersink->overlay_field != GST_FRAMEBUFFERSINK_FIELD_NONE) {
+    fb->size.width *= 2;
+    fb->size.height /= 2;
+    if (framebuffersink->overlay_field == GST_FRAMEBUFFERSINK_FIELD_BOTTOM)
+      fb->src_win.x += fb->size.width / 2;
+    fb->src_win.height /= 2;
+  }
+#if defined(CONFIG_HOMLET_PLATFORM)
+  else if (framebuffersink->overlay_first_field !=
+      GST_FRAMEBUFFERSINK_FIELD_NONE) {
+    fb->interlace = 1;
+    fb->top_field_first = framebuffersink->overlay_first_field ==
+        GST_FRAMEBUFFERSINK_FIELD_TOP;
+  }
+#endif
+#endif
+}
+
 static GstFlowReturn
 gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
 	GstVideoFormat format,GstMemory *mem)
@@ -720,7 +1149,7 @@ gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
 		}
 
         if(sunxifbsink->fd_transform > 0)
-            hwRotateVideoPicture(sunxifbsink, &trans_info);
+            gst_sunxifbsink_rotate(sunxifbsink, &trans_info);
 
 		luapiconfig.layerConfig.info.fb.addr[0] = (unsigned long long )SunxiMemGetPhysicAddressCpu(ops,sunxifbsink->rotate_addr_phy[0]);
 		luapiconfig.layerConfig.info.fb.addr[1] = (unsigned long long )trans_info.dst_frame.laddr[1];
@@ -736,7 +1165,7 @@ gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
 	}
 	//initialize layer info
 	luapiconfig.layerConfig.info.mode = LAYER_MODE_BUFFER;
-	luapiconfig.layerConfig.info.zorder = 11;
+	luapiconfig.layerConfig.info.zorder = sunxifbsink->layer_zorder;
 	luapiconfig.layerConfig.info.alpha_mode = 1;
 	luapiconfig.layerConfig.info.alpha_value = 0xff;
 
@@ -761,13 +1190,13 @@ gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
 
 	luapiconfig.layerConfig.enable = TRUE;
 	luapiconfig.layerConfig.layer_id = sunxifbsink->layer_id;
-	luapiconfig.layerConfig.channel = sunxifbsink->framebuffer_id;
+	luapiconfig.layerConfig.channel = sunxifbsink->layer_channel;
 
 	luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
 	luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
 #else
     DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-                                        sunxifbsink->framebuffer_id, 1, &luapiconfig);
+                                        sunxifbsink->layer_channel, 1, &luapiconfig);
 
     if (format == GST_VIDEO_FORMAT_Y444) {
       luapiconfig.layerConfig.fb.addr[0] = (unsigned int)phymem_start;
@@ -905,7 +1334,7 @@ gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
 		}
 
         if(sunxifbsink->fd_transform > 0)
-            hwRotateVideoPicture(sunxifbsink, &trans_info);
+            gst_sunxifbsink_rotate(sunxifbsink, &trans_info);
 
 		luapiconfig.layerConfig.fb.addr[0] = (unsigned int)SunxiMemGetPhysicAddressCpu(ops,sunxifbsink->rotate_addr_phy[0]);
 		luapiconfig.layerConfig.fb.addr[1] = (unsigned int)trans_info.dst_frame.laddr[1];
@@ -942,16 +1371,18 @@ gst_sunxifbsink_show_memory_yuv_planar (GstFramebufferSink *framebuffersink,
     luapiconfig.layerConfig.alpha_mode = 0;
     luapiconfig.layerConfig.fb.pre_multiply = 0;
     luapiconfig.layerConfig.alpha_value = 0xff;
-    luapiconfig.layerConfig.zorder = 3;
+    luapiconfig.layerConfig.zorder = sunxifbsink->layer_zorder;
     luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
     luapiconfig.layerConfig.pipe = 0;
 
 #endif
 
-    if (DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                1, &luapiconfig) < 0){
+    if (!rotate_enable)
+      gst_sunxifbsink_set_layer_scan (framebuffersink, &luapiconfig);
+    if (gst_sunxifbsink_set_layer_config(sunxifbsink, sunxifbsink->layer_id,
+		                                &luapiconfig) < 0){
         gst_memory_unmap(mem, &mapinfo);
-		return FALSE;
+		return GST_FLOW_ERROR;
     }
 
 	gst_sunxifbsink_show_layer(sunxifbsink);
@@ -1187,7 +1618,7 @@ gst_sunxifbsink_show_overlay_yuv_planar (GstFramebufferSink *framebuffersink,
             blit.dst_image_h.clip_rect.w = luapiconfig.layerConfig.info.fb.size[0].width;
             blit.dst_image_h.clip_rect.h = luapiconfig.layerConfig.info.fb.size[0].height;
         }
-        if (ioctl(sunxifbsink->fd_g2d,G2D_CMD_BITBLT_H,(unsigned long)&blit) < 0)
+        if (gst_sunxifbsink_g2d_blit(sunxifbsink, &blit) < 0)
         {
             GST_SUNXIFBSINK_ERROR_OBJECT(sunxifbsink, "---->g2d G2D_CMD_BITBLT_H fail!");
             return GST_FLOW_ERROR;
@@ -1208,7 +1639,7 @@ gst_sunxifbsink_show_overlay_yuv_planar (GstFramebufferSink *framebuffersink,
 
     //initialize layer info
     luapiconfig.layerConfig.info.mode = LAYER_MODE_BUFFER;
-    luapiconfig.layerConfig.info.zorder = 11;
+    luapiconfig.layerConfig.info.zorder = sunxifbsink->layer_zorder;
     luapiconfig.layerConfig.info.alpha_mode = 1;
     luapiconfig.layerConfig.info.alpha_value = 0xff;
 
@@ -1250,13 +1681,13 @@ gst_sunxifbsink_show_overlay_yuv_planar (GstFramebufferSink *framebuffersink,
 
 	luapiconfig.layerConfig.enable = TRUE;
 	luapiconfig.layerConfig.layer_id = sunxifbsink->layer_id;
-	luapiconfig.layerConfig.channel = sunxifbsink->framebuffer_id;
+	luapiconfig.layerConfig.channel = sunxifbsink->layer_channel;
 
 	luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
 	luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
 #else
     DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                sunxifbsink->framebuffer_id, 1, &luapiconfig);
+		                                sunxifbsink->layer_channel, 1, &luapiconfig);
 
     if (format == GST_VIDEO_FORMAT_Y444) {
       luapiconfig.layerConfig.fb.addr[0] = framebuffer_offset;
@@ -1326,13 +1757,15 @@ gst_sunxifbsink_show_overlay_yuv_planar (GstFramebufferSink *framebuffersink,
     luapiconfig.layerConfig.alpha_mode = 0;
     luapiconfig.layerConfig.fb.pre_multiply = 0;
     luapiconfig.layerConfig.alpha_value = 0xff;
-    luapiconfig.layerConfig.zorder = 3;
+    luapiconfig.layerConfig.zorder = sunxifbsink->layer_zorder;
     luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
     luapiconfig.layerConfig.pipe = 0;
 #endif
 
-    if (DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                1, &luapiconfig) < 0)
+    if (!rotate_enable)
+      gst_sunxifbsink_set_layer_scan (framebuffersink, &luapiconfig);
+    if (gst_sunxifbsink_set_layer_config(sunxifbsink, sunxifbsink->layer_id,
+		                                &luapiconfig) < 0)
 		return FALSE;
 
     gst_sunxifbsink_show_layer(sunxifbsink);
@@ -1368,7 +1801,7 @@ gst_sunxifbsink_show_overlay_yuv_packed (GstFramebufferSink *framebuffersink,
 
     //initialize layer info
 	luapiconfig.layerConfig.info.mode = LAYER_MODE_BUFFER;
-	luapiconfig.layerConfig.info.zorder = 11;
+	luapiconfig.layerConfig.info.zorder = sunxifbsink->layer_zorder;
 	luapiconfig.layerConfig.info.alpha_mode = 1;
 	luapiconfig.layerConfig.info.alpha_value = 0xff;
 
@@ -1385,13 +1818,13 @@ gst_sunxifbsink_show_overlay_yuv_packed (GstFramebufferSink *framebuffersink,
 
 	luapiconfig.layerConfig.enable = TRUE;
 	luapiconfig.layerConfig.layer_id = sunxifbsink->layer_id;
-	luapiconfig.layerConfig.channel = sunxifbsink->framebuffer_id;
+	luapiconfig.layerConfig.channel = sunxifbsink->layer_channel;
 
 	luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
 	luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
 #else
     DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                sunxifbsink->framebuffer_id, 1, &luapiconfig);
+		                                sunxifbsink->layer_channel, 1, &luapiconfig);
 
     luapiconfig.layerConfig.fb.addr[0] = framebuffer_offset;
     luapiconfig.layerConfig.fb.size.width = framebuffersink->overlay_scanline_stride[0]
@@ -1424,13 +1857,14 @@ gst_sunxifbsink_show_overlay_yuv_packed (GstFramebufferSink *framebuffersink,
     luapiconfig.layerConfig.alpha_mode = 0;
     luapiconfig.layerConfig.fb.pre_multiply = 0;
     luapiconfig.layerConfig.alpha_value = 0xff;
-    luapiconfig.layerConfig.zorder = 3;
+    luapiconfig.layerConfig.zorder = sunxifbsink->layer_zorder;
     luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
     luapiconfig.layerConfig.pipe = 0;
 #endif
 
-    if (DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                1, &luapiconfig) < 0)
+    gst_sunxifbsink_set_layer_scan (framebuffersink, &luapiconfig);
+    if (gst_sunxifbsink_set_layer_config(sunxifbsink, sunxifbsink->layer_id,
+		                                &luapiconfig) < 0)
 		return FALSE;
 
     gst_sunxifbsink_show_layer(sunxifbsink);
@@ -1440,7 +1874,7 @@ gst_sunxifbsink_show_overlay_yuv_packed (GstFramebufferSink *framebuffersink,
 
 static GstFlowReturn
 gst_sunxifbsink_show_overlay_bgrx32 (GstFramebufferSink *framebuffersink,
-    guintptr framebuffer_offset)
+    guintptr framebuffer_offset, guint stride, guint width, guint height)
 {
   GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
     luapi_layer_config luapiconfig;
@@ -1452,19 +1886,19 @@ gst_sunxifbsink_show_overlay_bgrx32 (GstFramebufferSink *framebuffersink,
 #ifdef __SUNXI_DISPLAY2__
     /* BGRX layer. */
 	luapiconfig.layerConfig.info.mode = LAYER_MODE_BUFFER;
-	luapiconfig.layerConfig.info.zorder = 11;
+	luapiconfig.layerConfig.info.zorder = sunxifbsink->layer_zorder;
 	luapiconfig.layerConfig.info.alpha_mode = 1;
 	luapiconfig.layerConfig.info.alpha_value = 0xff;
 
     luapiconfig.layerConfig.info.fb.addr[0] = framebuffer_offset;
-    luapiconfig.layerConfig.info.fb.size[sunxifbsink->framebuffer_id].width = framebuffersink->overlay_scanline_stride[0] >> 2;
-    luapiconfig.layerConfig.info.fb.size[sunxifbsink->framebuffer_id].height = framebuffersink->videosink.height;
+    luapiconfig.layerConfig.info.fb.size[sunxifbsink->framebuffer_id].width = stride >> 2;
+    luapiconfig.layerConfig.info.fb.size[sunxifbsink->framebuffer_id].height = height;
     luapiconfig.layerConfig.info.fb.format = DISP_FORMAT_ARGB_8888;
 
 	luapiconfig.layerConfig.info.fb.crop.x = 0;
     luapiconfig.layerConfig.info.fb.crop.y = 0;
-    luapiconfig.layerConfig.info.fb.crop.width = (unsigned long long)framebuffersink->videosink.width << 32;
-    luapiconfig.layerConfig.info.fb.crop.height = (unsigned long long)framebuffersink->videosink.height << 32;
+    luapiconfig.layerConfig.info.fb.crop.width = (unsigned long long)width << 32;
+    luapiconfig.layerConfig.info.fb.crop.height = (unsigned long long)height << 32;
 	luapiconfig.layerConfig.info.fb.color_space = (framebuffersink->video_rectangle.h < 720) ? DISP_BT601 : DISP_BT709;
 
     luapiconfig.layerConfig.info.screen_win.x = framebuffersink->video_rectangle.x;
@@ -1474,24 +1908,24 @@ gst_sunxifbsink_show_overlay_bgrx32 (GstFramebufferSink *framebuffersink,
 
 	luapiconfig.layerConfig.enable = TRUE;
 	luapiconfig.layerConfig.layer_id = sunxifbsink->layer_id;
-	luapiconfig.layerConfig.channel = sunxifbsink->framebuffer_id;
+	luapiconfig.layerConfig.channel = sunxifbsink->layer_channel;
 	luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
 	luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
 #else
 
     DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                sunxifbsink->framebuffer_id, 1, &luapiconfig);
+		                                sunxifbsink->layer_channel, 1, &luapiconfig);
 
     luapiconfig.layerConfig.fb.addr[0] = framebuffer_offset;
-    luapiconfig.layerConfig.fb.size.width = framebuffersink->overlay_scanline_stride[0] >> 2;
-    luapiconfig.layerConfig.fb.size.height = framebuffersink->videosink.height;
+    luapiconfig.layerConfig.fb.size.width = stride >> 2;
+    luapiconfig.layerConfig.fb.size.height = height;
     luapiconfig.layerConfig.fb.format = DISP_FORMAT_ARGB_8888;
 
     /* Source size (can be cropped) */
     luapiconfig.layerConfig.fb.src_win.x = 0;
     luapiconfig.layerConfig.fb.src_win.y = 0;
-    luapiconfig.layerConfig.fb.src_win.width = framebuffersink->videosink.width;
-    luapiconfig.layerConfig.fb.src_win.height = framebuffersink->videosink.height;
+    luapiconfig.layerConfig.fb.src_win.width = width;
+    luapiconfig.layerConfig.fb.src_win.height = height;
 
     /* Display position and size */
     luapiconfig.layerConfig.screen_win.x = framebuffersink->video_rectangle.x;
@@ -1502,13 +1936,14 @@ gst_sunxifbsink_show_overlay_bgrx32 (GstFramebufferSink *framebuffersink,
     luapiconfig.layerConfig.alpha_mode = 0;
     luapiconfig.layerConfig.fb.pre_multiply = 0;
     luapiconfig.layerConfig.alpha_value = 0xff;
-    luapiconfig.layerConfig.zorder = 3;
+    luapiconfig.layerConfig.zorder = sunxifbsink->layer_zorder;
     luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
     luapiconfig.layerConfig.pipe = 0;
 #endif
 
-    if (DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                1, &luapiconfig) < 0)
+    gst_sunxifbsink_set_layer_scan (framebuffersink, &luapiconfig);
+    if (gst_sunxifbsink_set_layer_config(sunxifbsink, sunxifbsink->layer_id,
+		                                &luapiconfig) < 0)
 		return FALSE;
 
     gst_sunxifbsink_show_layer(sunxifbsink);
@@ -1516,6 +1951,204 @@ gst_sunxifbsink_show_overlay_bgrx32 (GstFramebufferSink *framebuffersink,
   return GST_FLOW_OK;
 }
 
+/* G2D blit stage. Frames in a format the display layer can't show, or that
+   would have to be scaled down further than the layer scaler can, are
+   converted (and if necessary scaled) by G2D into a BGRx buffer that is then
+   shown on the layer. */
+
+static const SunxifbsinkG2dFormat *
+gst_sunxifbsink_g2d_format (GstVideoFormat format)
+{
+  const SunxifbsinkG2dFormat *f;
+
+  for (f = sunxifbsink_g2d_formats_table; f->format !=
+      GST_VIDEO_FORMAT_UNKNOWN; f++)
+    if (f->format == format)
+      return f;
+  return NULL;
+}
+
+static gboolean
+gst_sunxifbsink_overlay_needs_g2d (GstFramebufferSink *framebuffersink)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+  GstVideoFormat *f;
+
+  if (!sunxifbsink->use_g2d || sunxifbsink->fd_g2d < 0 ||
+      gst_sunxifbsink_g2d_format (sunxifbsink->overlay_format) == NULL)
+    return FALSE;
+
+  if (framebuffersink->videosink.width > framebuffersink->video_rectangle.w *
+      SUNXIFBSINK_LAYER_MAX_DOWNSCALE ||
+      framebuffersink->videosink.height > framebuffersink->video_rectangle.h *
+      SUNXIFBSINK_LAYER_MAX_DOWNSCALE)
+    return TRUE;
+
+  for (f = sunxifbsink_supported_overlay_formats_table;
+      *f != GST_VIDEO_FORMAT_UNKNOWN; f++)
+    if (*f == sunxifbsink->overlay_format)
+      return FALSE;
+  return TRUE;
+}
+
+static void
+gst_sunxifbsink_free_g2d_buffers (GstSunxifbsink *sunxifbsink)
+{
+  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (sunxifbsink->g2d_buffer[i] != NULL)
+      SunxiMemPfree(ops, sunxifbsink->g2d_buffer[i]);
+    sunxifbsink->g2d_buffer[i] = NULL;
+  }
+  sunxifbsink->g2d_buffer_size = 0;
+}
+
+static GstFlowReturn
+gst_sunxifbsink_show_overlay_g2d (GstFramebufferSink *framebuffersink,
+    guintptr framebuffer_offset)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  const SunxifbsinkG2dFormat *g2d_format;
+  g2d_blt_h blit;
+  guint dst_width, dst_height, dst_stride;
+  guintptr dst_offset;
+  gsize size;
+  int i;
+
+  g2d_format = gst_sunxifbsink_g2d_format (sunxifbsink->overlay_format);
+
+  /* Leave scaling to the layer, unless the downscaling factor is too
+     large for it. */
+  dst_width = framebuffersink->videosink.width;
+  dst_height = framebuffersink->videosink.height;
+  if (dst_width > framebuffersink->video_rectangle.w *
+      SUNXIFBSINK_LAYER_MAX_DOWNSCALE)
+    dst_width = framebuffersink->video_rectangle.w;
+  if (dst_height > framebuffersink->video_rectangle.h *
+      SUNXIFBSINK_LAYER_MAX_DOWNSCALE)
+    dst_height = framebuffersink->video_rectangle.h;
+  dst_stride = ALIGN_16B(dst_width) * 4;
+
+  /* The layer scans out one buffer while G2D writes the other one. */
+  size = dst_stride * dst_height;
+  if (size > sunxifbsink->g2d_buffer_size) {
+    gst_sunxifbsink_free_g2d_buffers (sunxifbsink);
+    for (i = 0; i < 2; i++) {
+      sunxifbsink->g2d_buffer[i] = (char *)SunxiMemPalloc(ops, size);
+      if (sunxifbsink->g2d_buffer[i] == NULL) {
+        gst_sunxifbsink_free_g2d_buffers (sunxifbsink);
+        GST_SUNXIFBSINK_ERROR_OBJECT(sunxifbsink,
+            "-->no physical memory for g2d output!");
+        return GST_FLOW_ERROR;
+      }
+    }
+    sunxifbsink->g2d_buffer_size = size;
+  }
+  dst_offset = (guintptr)SunxiMemGetPhysicAddressCpu(ops,
+      sunxifbsink->g2d_buffer[sunxifbsink->g2d_buffer_index]);
+  sunxifbsink->g2d_buffer_index ^= 1;
+
+  memset(&blit, 0, sizeof(g2d_blt_h));
+  blit.flag_h = G2D_BLT_NONE_H;
+
+  blit.src_image_h.format = g2d_format->g2d_format;
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (&framebuffersink->video_info); i++)
+    blit.src_image_h.laddr[i] = framebuffer_offset +
+        framebuffersink->overlay_plane_offset[i];
+  if (g2d_format->swap_uv) {
+    blit.src_image_h.laddr[1] = framebuffer_offset +
+        framebuffersink->overlay_plane_offset[2];
+    blit.src_image_h.laddr[2] = framebuffer_offset +
+        framebuffersink->overlay_plane_offset[1];
+  }
+  /* The source pitch in pixels; get_overlay_video_alignment() only accepts
+     strides that are a whole number of pixels. */
+  blit.src_image_h.width = framebuffersink->overlay_scanline_stride[0] /
+      GST_VIDEO_INFO_COMP_PSTRIDE (&framebuffersink->video_info, 0);
+  blit.src_image_h.height = framebuffersink->videosink.height;
+  blit.src_image_h.clip_rect.x = 0;
+  blit.src_image_h.clip_rect.y = 0;
+  blit.src_image_h.clip_rect.w = framebuffersink->videosink.width;
+  blit.src_image_h.clip_rect.h = framebuffersink->videosink.height;
+  blit.src_image_h.bbuff = 1;
+  blit.src_image_h.use_phy_addr = 1;
+  blit.src_image_h.color = 0xff;
+  /* Use the colorimetry of the source when it is known, otherwise guess
+     from the source height. */
+  if (GST_VIDEO_INFO_COLORIMETRY (&framebuffersink->video_info).matrix ==
+      GST_VIDEO_COLOR_MATRIX_BT709)
+    blit.src_image_h.gamut = G2D_BT709;
+  else if (GST_VIDEO_INFO_COLORIMETRY (&framebuffersink->video_info).matrix ==
+      GST_VIDEO_COLOR_MATRIX_BT601)
+    blit.src_image_h.gamut = G2D_BT601;
+  else
+    blit.src_image_h.gamut = (GST_VIDEO_INFO_HEIGHT (
+        &framebuffersink->video_info) < 720) ? G2D_BT601 : G2D_BT709;
+  blit.src_image_h.bpremul = 0;
+  blit.src_image_h.alpha = 0xff;
+  blit.src_image_h.mode = G2D_GLOBAL_ALPHA;
+
+  blit.dst_image_h.format = G2D_FORMAT_XRGB8888;
+  blit.dst_image_h.laddr[0] = dst_offset;
+  blit.dst_image_h.width = dst_stride >> 2;
+  blit.dst_image_h.height = dst_height;
+  blit.dst_image_h.clip_rect.x = 0;
+  blit.dst_image_h.clip_rect.y = 0;
+  blit.dst_image_h.clip_rect.w = dst_width;
+  blit.dst_image_h.clip_rect.h = dst_height;
+  blit.dst_image_h.bbuff = 1;
+  blit.dst_image_h.use_phy_addr = 1;
+  blit.dst_image_h.color = 0xff;
+  blit.dst_image_h.gamut = blit.src_image_h.gamut;
+  blit.dst_image_h.bpremul = 0;
+  blit.dst_image_h.alpha = 0xff;
+  blit.dst_image_h.mode = G2D_GLOBAL_ALPHA;
+
+  if (gst_sunxifbsink_g2d_blit (sunxifbsink, &blit) < 0) {
+    GST_SUNXIFBSINK_ERROR_OBJECT(sunxifbsink,
+        "---->g2d G2D_CMD_BITBLT_H fail!");
+    return GST_FLOW_ERROR;
+  }
+
+  return gst_sunxifbsink_show_overlay_bgrx32 (framebuffersink, dst_offset,
+      dst_stride, dst_width, dst_height);
+}
+
+/* Show the overlay stored at the given physical address, dispatching on the
+   negotiated overlay format. */
+
+static GstFlowReturn
+gst_sunxifbsink_show_overlay_at_address (GstFramebufferSink *framebuffersink,
+    guintptr framebuffer_offset)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+
+  if (gst_sunxifbsink_overlay_needs_g2d (framebuffersink))
+    return gst_sunxifbsink_show_overlay_g2d (framebuffersink,
+        framebuffer_offset);
+
+  if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_I420 ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_YV12 ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_Y444 ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_NV12 ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_NV21)
+    return gst_sunxifbsink_show_overlay_yuv_planar (framebuffersink,
+        framebuffer_offset, sunxifbsink->overlay_format);
+  else if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_YUY2 ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_UYVY ||
+      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_AYUV)
+    return gst_sunxifbsink_show_overlay_yuv_packed (framebuffersink,
+        framebuffer_offset, sunxifbsink->overlay_format);
+  else if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_BGRx)
+    return gst_sunxifbsink_show_overlay_bgrx32 (framebuffersink,
+        framebuffer_offset, framebuffersink->overlay_scanline_stride[0],
+        framebuffersink->videosink.width, framebuffersink->videosink.height);
+  return GST_FLOW_ERROR;
+}
+
 static GstFlowReturn
 gst_sunxifbsink_show_overlay (GstFramebufferSink *framebuffersink,
     GstMemory *memory)
@@ -1524,59 +2157,243 @@ gst_sunxifbsink_show_overlay (GstFramebufferSink *framebuffersink,
   GstFbdevFramebufferSink *fbdevframebuffersink =
       GST_FBDEVFRAMEBUFFERSINK (framebuffersink);
   GstMapInfo mapinfo;
-  guintptr framebuffer_offset, framebuffer_vir;
+  guintptr framebuffer_offset;
+#ifdef OMX_PRIVATE_BUFFER
+  guintptr framebuffer_vir;
+#endif
   GstFlowReturn res;
-  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
 
+  if (GST_IS_SUNXIFBSINK_ALLOCATOR (memory->allocator)) {
+    /* Physically contiguous overlay memory allocated by ourselves; the
+       layer can scan it out directly. */
+    framebuffer_offset = gst_sunxifbsink_memory_get_physical_address (memory);
+    if (framebuffer_offset == 0)
+      return GST_FLOW_ERROR;
+    gst_sunxifbsink_memory_flush (sunxifbsink, memory);
+    GST_LOG_OBJECT (sunxifbsink,
+        "Show contiguous overlay called (physical address = 0x%08lX)",
+        framebuffer_offset);
+    return gst_sunxifbsink_show_overlay_at_address (framebuffersink,
+        framebuffer_offset);
+  }
+
+  if(GST_MEMORY_FLAG_IS_SET(memory, GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS))
+  {
+		return gst_sunxifbsink_show_memory_yuv_planar(framebuffersink,
+			sunxifbsink->overlay_format,memory);
+  }
+
+#ifdef OMX_PRIVATE_BUFFER
   gst_memory_map(memory, &mapinfo, GST_MAP_READ);
   memcpy(sunxifbsink->sBuffer, mapinfo.data, sizeof(OmxPrivateBuffer));
   gst_memory_unmap(memory, &mapinfo);
 
-  framebuffer_offset = sunxifbsink->sBuffer->pAddrPhyY;
-  framebuffer_vir = sunxifbsink->sBuffer->pAddrVirY;
+  framebuffer_offset = (guintptr) sunxifbsink->sBuffer->pAddrPhyY;
+  framebuffer_vir = (guintptr) sunxifbsink->sBuffer->pAddrVirY;
 
  GST_LOG_OBJECT (sunxifbsink, "Show overlay called (offset = 0x%08lX)",
       framebuffer_offset);
 
-  res = GST_FLOW_ERROR;
-  if(GST_MEMORY_FLAG_IS_SET(memory, GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS))
-  {
-		gst_sunxifbsink_show_memory_yuv_planar(framebuffersink,
-			sunxifbsink->overlay_format,memory);
-  }
-  else
   {
 	  if(framebuffersink->max_video_memory_property <= 0)
 	  {
 		framebuffer_offset+=fbdevframebuffersink->fixinfo.smem_start;
 	  }
-	  else
+	  else if (sunxifbsink->flush_decoder_buffers)
 	  {
-	    SunxiMemFlushCache(ops, framebuffer_vir, framebuffersink->video_info.size);
+	    /* The decoder's frame is not our memory, so there is no dirty
+	       tracking; write back the displayed scanlines only. */
+	    GstSunxifbsinkPlaneLayout layout;
+	    gst_sunxifbsink_get_plane_layout (framebuffersink,
+	        &framebuffersink->video_info, &layout);
+	    gst_sunxifbsink_flush_planes (sunxifbsink, (gpointer) framebuffer_vir,
+	        &layout);
 		//framebuffer_offset = (guintptr)SunxiMemGetPhysicAddressCpu(ops, framebuffer_vir);
 	  }
+	  else
+	    /* The frame was written by the hardware decoder, so the CPU cache
+	       holds no dirty lines for it. */
+	    sunxifbsink->stats_cache_flushes_skipped++;
 
-	  if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_I420 ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_YV12 ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_Y444 ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_NV12 ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_NV21)
-	    res =  gst_sunxifbsink_show_overlay_yuv_planar (framebuffersink,
-	        framebuffer_offset, sunxifbsink->overlay_format);
-	  else if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_YUY2 ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_UYVY ||
-	      sunxifbsink->overlay_format == GST_VIDEO_FORMAT_AYUV)
-	    res =  gst_sunxifbsink_show_overlay_yuv_packed (framebuffersink,
-	        framebuffer_offset, sunxifbsink->overlay_format);
-	  else if (sunxifbsink->overlay_format == GST_VIDEO_FORMAT_BGRx)
-	    res = gst_sunxifbsink_show_overlay_bgrx32 (framebuffersink,
-	        framebuffer_offset);
+	  res = gst_sunxifbsink_show_overlay_at_address (framebuffersink,
+	      framebuffer_offset);
   }
+#else
+  /* Our own video memory, holding the frame itself. */
+  mapinfo.data = NULL;
+  if (!gst_memory_map (memory, &mapinfo, 0) || mapinfo.data == NULL)
+    return GST_FLOW_ERROR;
+  if (framebuffersink->max_video_memory_property <= 0)
+    framebuffer_offset = fbdevframebuffersink->fixinfo.smem_start +
+        (mapinfo.data - fbdevframebuffersink->framebuffer);
+  else {
+    /* ION memory written through a cached mapping. */
+    struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+    framebuffer_offset = (guintptr)SunxiMemGetPhysicAddressCpu(ops,
+        mapinfo.data);
+    /* Only memory the CPU wrote since it was last shown needs the cache
+       written back. The memory may have been laid out for an earlier
+       configuration, so flush all of it rather than the current planes. */
+    if (gst_fbdevframebuffersink_video_memory_take_dirty (memory))
+      gst_sunxifbsink_flush_cache (sunxifbsink, mapinfo.data, mapinfo.size);
+    else
+      sunxifbsink->stats_cache_flushes_skipped++;
+  }
+  gst_memory_unmap (memory, &mapinfo);
+
+  GST_LOG_OBJECT (sunxifbsink, "Show overlay called (offset = 0x%08lX)",
+      framebuffer_offset);
+
+  res = gst_sunxifbsink_show_overlay_at_address (framebuffersink,
+      framebuffer_offset);
+#endif
 
-  //gst_memory_unmap(memory, &mapinfo);
   return res;
 }
 
+/* Show a foreign frame described by a physical address meta. The planes
+   have to be laid out as they are in our own overlay buffers, since the
+   layer is programmed from the overlay plane offsets and strides. */
+
+static GstFlowReturn
+gst_sunxifbsink_show_overlay_physical (GstFramebufferSink *framebuffersink,
+    GstFramebufferSinkPhysicalAddressMeta *meta)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+  guint i;
+
+  if (GST_VIDEO_INFO_FORMAT (&framebuffersink->video_info) !=
+      sunxifbsink->overlay_format ||
+      meta->n_planes != GST_VIDEO_INFO_N_PLANES (&framebuffersink->video_info))
+    return GST_FLOW_NOT_SUPPORTED;
+  for (i = 0; i < meta->n_planes; i++)
+    if (meta->physical_address[i] - meta->physical_address[0] !=
+        framebuffersink->overlay_plane_offset[i] ||
+        meta->stride[i] != framebuffersink->overlay_scanline_stride[i] ||
+        framebuffersink->overlay_scanline_offset[i] != 0)
+      return GST_FLOW_NOT_SUPPORTED;
+
+  if (sunxifbsink->flush_decoder_buffers && meta->virtual_address != NULL) {
+    /* The layout was checked to match the overlay above. */
+    GstSunxifbsinkPlaneLayout layout;
+    gst_sunxifbsink_get_plane_layout (framebuffersink,
+        &framebuffersink->video_info, &layout);
+    gst_sunxifbsink_flush_planes (sunxifbsink, meta->virtual_address,
+        &layout);
+  }
+  else
+    /* The frame was written by the hardware, so the CPU cache holds no
+       dirty lines for it. */
+    sunxifbsink->stats_cache_flushes_skipped++;
+
+  GST_LOG_OBJECT (sunxifbsink,
+      "Show physical overlay called (physical address = 0x%08lX)",
+      (unsigned long) meta->physical_address[0]);
+  return gst_sunxifbsink_show_overlay_at_address (framebuffersink,
+      meta->physical_address[0]);
+}
+
+/* The display layers of a screen are shared by all sunxifbsink instances in
+   the process. Each instance claims a layer of its own, so that several
+   streams (e.g. a camera wall) are each scaled by the display engine into
+   their own window given by the x, y, width and height properties, without
+   any CPU compositing. Instances that don't get a layer fall back to
+   rendering into the framebuffer.
+
+   On DE2 the layers of a channel share the channel's scaler and pixel
+   format, so each claimed layer is the first layer of a channel of its own.
+   On DE1 every layer has its own scaler. The layers that exist are probed
+   from the display engine when the first layer is claimed; those that are
+   already enabled at that point (e.g. the console framebuffer) are left
+   alone. Each layer gets its own zorder, so that the windows of several
+   streams stack in a defined order. */
+#define SUNXIFBSINK_MAX_LAYERS 16
+
+#ifdef __SUNXI_DISPLAY2__
+#define SUNXIFBSINK_LAYER_ZORDER 11
+#else
+#define SUNXIFBSINK_LAYER_ZORDER 3
+#endif
+
+typedef struct {
+  int layer_id;
+  int channel;
+  GstSunxifbsink *owner;
+} SunxifbsinkLayer;
+
+G_LOCK_DEFINE_STATIC (layers);
+static SunxifbsinkLayer layers[SUNXIFBSINK_MAX_LAYERS];
+static int nu_layers = -1;
+
+static void
+gst_sunxifbsink_probe_layers(GstSunxifbsink *sunxifbsink) {
+  luapi_layer_config luapiconfig;
+  int i;
+  gchar s[256];
+
+  nu_layers = 0;
+  for (i = 0; i < SUNXIFBSINK_MAX_LAYERS; i++) {
+    int layer_id, channel;
+#ifdef __SUNXI_DISPLAY2__
+    layer_id = 0;
+    channel = i;
+#else
+    layer_id = i;
+    channel = 0;
+#endif
+    memset(&luapiconfig, 0, sizeof(luapiconfig));
+    if (DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id,
+        layer_id, channel, 1, &luapiconfig) < 0)
+      break;
+    if (luapiconfig.layerConfig.enable)
+      continue;
+    layers[nu_layers].layer_id = layer_id;
+    layers[nu_layers].channel = channel;
+    layers[nu_layers].owner = NULL;
+    nu_layers++;
+  }
+
+  g_sprintf(s, "-->%d free display layers", nu_layers);
+  GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, s);
+}
+
+/* Claim a free layer, returning its layer id, channel and zorder, or FALSE
+   if all layers are in use. */
+
+static gboolean
+gst_sunxifbsink_claim_layer(GstSunxifbsink *sunxifbsink, int *layer_id,
+    int *channel, int *zorder) {
+  int i;
+
+  G_LOCK (layers);
+  if (nu_layers < 0)
+    gst_sunxifbsink_probe_layers(sunxifbsink);
+  for (i = 0; i < nu_layers; i++)
+    if (layers[i].owner == NULL) {
+      layers[i].owner = sunxifbsink;
+      *layer_id = layers[i].layer_id;
+      *channel = layers[i].channel;
+      *zorder = SUNXIFBSINK_LAYER_ZORDER + i;
+      break;
+    }
+  G_UNLOCK (layers);
+
+  return i < nu_layers;
+}
+
+static void
+gst_sunxifbsink_unclaim_layer(GstSunxifbsink *sunxifbsink, int layer_id,
+    int channel) {
+  int i;
+
+  G_LOCK (layers);
+  for (i = 0; i < nu_layers; i++)
+    if (layers[i].layer_id == layer_id && layers[i].channel == channel &&
+        layers[i].owner == sunxifbsink)
+      layers[i].owner = NULL;
+  G_UNLOCK (layers);
+}
+
 static gboolean
 gst_sunxifbsink_reserve_layer(GstSunxifbsink *sunxifbsink) {
 
@@ -1596,7 +2413,16 @@ gst_sunxifbsink_reserve_layer(GstSunxifbsink *sunxifbsink) {
         GST_SUNXIFBSINK_ERROR_OBJECT (sunxifbsink, s);
     }
 
-	 g_sprintf(s,"-->reserver layer called (screen = %d x %d)",screen_w, screen_h);
+    if (!gst_sunxifbsink_claim_layer(sunxifbsink, &sunxifbsink->layer_id,
+        &sunxifbsink->layer_channel, &sunxifbsink->layer_zorder)) {
+        sunxifbsink->layer_id = -1;
+        GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink,
+            "-->all display layers are in use by other instances");
+        return FALSE;
+    }
+
+	 g_sprintf(s,"-->reserver layer %d channel %d called (screen = %d x %d)",
+	     sunxifbsink->layer_id, sunxifbsink->layer_channel, screen_w, screen_h);
 	 GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, s);
 
     /* try to allocate a layer */
@@ -1614,12 +2440,12 @@ gst_sunxifbsink_reserve_layer(GstSunxifbsink *sunxifbsink) {
 
 	luapiconfig.layerConfig.enable = FALSE;
 	luapiconfig.layerConfig.layer_id = sunxifbsink->layer_id;
-	luapiconfig.layerConfig.channel = sunxifbsink->framebuffer_id;
+	luapiconfig.layerConfig.channel = sunxifbsink->layer_channel;
 	luapiconfig.layerConfig.info.mode= LAYER_MODE_BUFFER;
 	luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
 	luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
 	luapiconfig.layerConfig.info.fb.format = DISP_FORMAT_ARGB_8888;
-	luapiconfig.layerConfig.info.zorder = 11;
+	luapiconfig.layerConfig.info.zorder = sunxifbsink->layer_zorder;
 	luapiconfig.layerConfig.info.alpha_mode = 1;
 	luapiconfig.layerConfig.info.alpha_value = 0xff;
 #else
@@ -1636,14 +2462,18 @@ gst_sunxifbsink_reserve_layer(GstSunxifbsink *sunxifbsink) {
 	luapiconfig.layerConfig.alpha_mode = 0;
 	luapiconfig.layerConfig.fb.pre_multiply = 0;
 	luapiconfig.layerConfig.alpha_value = 0xff;
-	luapiconfig.layerConfig.zorder = 3;
+	luapiconfig.layerConfig.zorder = sunxifbsink->layer_zorder;
 	luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
 	luapiconfig.layerConfig.pipe = 0;
 #endif
 
-    if (DispSetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-		                                1, &luapiconfig) < 0)
+    if (gst_sunxifbsink_set_layer_config(sunxifbsink, sunxifbsink->layer_id,
+		                                &luapiconfig) < 0) {
+		gst_sunxifbsink_unclaim_layer(sunxifbsink, sunxifbsink->layer_id,
+		    sunxifbsink->layer_channel);
+		sunxifbsink->layer_id = -1;
 		return FALSE;
+    }
 
     sunxifbsink->layer_has_scaler = TRUE;
   return TRUE;
@@ -1656,9 +2486,11 @@ gst_sunxifbsink_release_layer(GstSunxifbsink *sunxifbsink) {
 
     if(sunxifbsink->layer_is_visible){
         DispSetLayerEnable(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-          sunxifbsink->framebuffer_id, 1, 0);
+          sunxifbsink->layer_channel, 1, 0);
         sunxifbsink->layer_is_visible = FALSE;
     }
+    gst_sunxifbsink_unclaim_layer(sunxifbsink, sunxifbsink->layer_id,
+        sunxifbsink->layer_channel);
     sunxifbsink->layer_id = -1;
     sunxifbsink->layer_has_scaler = 0;
 }
@@ -1677,7 +2509,7 @@ static gboolean gst_sunxifbsink_show_layer(GstSunxifbsink *sunxifbsink) {
   GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, s);
 
   if (DispSetLayerEnable(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-          sunxifbsink->framebuffer_id, 1, 1)){
+          sunxifbsink->layer_channel, 1, 1)){
         return FALSE;
     }
 
@@ -1693,16 +2525,571 @@ static void gst_sunxifbsink_hide_layer(GstSunxifbsink *sunxifbsink) {
     return;
 
   if (DispSetLayerEnable(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id, sunxifbsink->layer_id,
-          sunxifbsink->framebuffer_id, 1, 0)){
+          sunxifbsink->layer_channel, 1, 0)){
         return;
     }
 
   sunxifbsink->layer_is_visible = FALSE;
 }
 
+/* Overlay compositions (subtitles, OSD) are rendered into an ARGB canvas of
+   the size of the video that is shown on a layer of its own on top of the
+   video layer, with the same screen window. The video frames themselves are
+   never touched, and the canvas is only redrawn when the composition
+   changes. */
+
+static void
+gst_sunxifbsink_set_composition_layer_enable (GstSunxifbsink *sunxifbsink,
+    gboolean enable)
+{
+  if (sunxifbsink->composition_layer_is_visible == enable)
+    return;
+
+  if (DispSetLayerEnable(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id,
+          sunxifbsink->composition_layer_id, sunxifbsink->composition_layer_channel, 1,
+          enable))
+    return;
+
+  sunxifbsink->composition_layer_is_visible = enable;
+}
+
+static void
+gst_sunxifbsink_free_composition_buffers (GstSunxifbsink *sunxifbsink)
+{
+  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (sunxifbsink->composition_buffer[i] != NULL)
+      SunxiMemPfree(ops, sunxifbsink->composition_buffer[i]);
+    sunxifbsink->composition_buffer[i] = NULL;
+  }
+  sunxifbsink->composition_buffer_size = 0;
+}
+
+static void
+gst_sunxifbsink_release_composition_layer (GstSunxifbsink *sunxifbsink)
+{
+  if (sunxifbsink->composition_layer_id < 0)
+    return;
+
+  gst_sunxifbsink_set_composition_layer_enable (sunxifbsink, FALSE);
+  gst_sunxifbsink_unclaim_layer(sunxifbsink, sunxifbsink->composition_layer_id,
+      sunxifbsink->composition_layer_channel);
+  sunxifbsink->composition_layer_id = -1;
+  gst_sunxifbsink_free_composition_buffers (sunxifbsink);
+}
+
+static gboolean
+gst_sunxifbsink_show_composition_layer (GstFramebufferSink *framebuffersink,
+    guintptr framebuffer_offset, guint width, guint height)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+  luapi_layer_config luapiconfig;
+
+  memset(&luapiconfig, 0, sizeof(luapiconfig));
+
+#ifdef __SUNXI_DISPLAY2__
+  /* ARGB layer with per-pixel alpha, above the video layer. */
+  luapiconfig.layerConfig.info.mode = LAYER_MODE_BUFFER;
+  luapiconfig.layerConfig.info.zorder = sunxifbsink->composition_layer_zorder;
+  luapiconfig.layerConfig.info.alpha_mode = 0;
+  luapiconfig.layerConfig.info.alpha_value = 0xff;
+
+  luapiconfig.layerConfig.info.fb.addr[0] = framebuffer_offset;
+  luapiconfig.layerConfig.info.fb.size[0].width = width;
+  luapiconfig.layerConfig.info.fb.size[0].height = height;
+  luapiconfig.layerConfig.info.fb.format = DISP_FORMAT_ARGB_8888;
+  luapiconfig.layerConfig.info.fb.pre_multiply = 0;
+
+  luapiconfig.layerConfig.info.fb.crop.x = 0;
+  luapiconfig.layerConfig.info.fb.crop.y = 0;
+  luapiconfig.layerConfig.info.fb.crop.width = (unsigned long long)width << 32;
+  luapiconfig.layerConfig.info.fb.crop.height = (unsigned long long)height << 32;
+
+  luapiconfig.layerConfig.info.screen_win.x = framebuffersink->video_rectangle.x;
+  luapiconfig.layerConfig.info.screen_win.y = framebuffersink->video_rectangle.y;
+  luapiconfig.layerConfig.info.screen_win.width = framebuffersink->video_rectangle.w;
+  luapiconfig.layerConfig.info.screen_win.height = framebuffersink->video_rectangle.h;
+
+  luapiconfig.layerConfig.enable = TRUE;
+  luapiconfig.layerConfig.layer_id = sunxifbsink->composition_layer_id;
+  luapiconfig.layerConfig.channel = sunxifbsink->composition_layer_channel;
+  luapiconfig.layerConfig.info.fb.flags= DISP_BF_NORMAL;
+  luapiconfig.layerConfig.info.fb.scan= DISP_SCAN_PROGRESSIVE;
+#else
+  DispGetLayerConfig(sunxifbsink->fd_disp, sunxifbsink->framebuffer_id,
+      sunxifbsink->composition_layer_id, sunxifbsink->composition_layer_channel, 1,
+      &luapiconfig);
+
+  luapiconfig.layerConfig.fb.addr[0] = framebuffer_offset;
+  luapiconfig.layerConfig.fb.size.width = width;
+  luapiconfig.layerConfig.fb.size.height = height;
+  luapiconfig.layerConfig.fb.format = DISP_FORMAT_ARGB_8888;
+
+  luapiconfig.layerConfig.fb.src_win.x = 0;
+  luapiconfig.layerConfig.fb.src_win.y = 0;
+  luapiconfig.layerConfig.fb.src_win.width = width;
+  luapiconfig.layerConfig.fb.src_win.height = height;
+
+  luapiconfig.layerConfig.screen_win.x = framebuffersink->video_rectangle.x;
+  luapiconfig.layerConfig.screen_win.y = framebuffersink->video_rectangle.y;
+  luapiconfig.layerConfig.screen_win.width = framebuffersink->video_rectangle.w;
+  luapiconfig.layerConfig.screen_win.height = framebuffersink->video_rectangle.h;
+
+  luapiconfig.layerConfig.alpha_mode = 0;
+  luapiconfig.layerConfig.fb.pre_multiply = 0;
+  luapiconfig.layerConfig.alpha_value = 0xff;
+  luapiconfig.layerConfig.zorder = sunxifbsink->composition_layer_zorder;
+  luapiconfig.layerConfig.mode = DISP_LAYER_WORK_MODE_SCALER;
+  luapiconfig.layerConfig.pipe = 0;
+#endif
+
+  if (gst_sunxifbsink_set_layer_config (sunxifbsink,
+      sunxifbsink->composition_layer_id, &luapiconfig) < 0)
+    return FALSE;
+
+  gst_sunxifbsink_set_composition_layer_enable (sunxifbsink, TRUE);
+  return TRUE;
+}
+
+static gboolean
+gst_sunxifbsink_show_overlay_composition (GstFramebufferSink *framebuffersink,
+    GstVideoOverlayComposition *composition)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  guint width = framebuffersink->videosink.width;
+  guint height = framebuffersink->videosink.height;
+  guint stride = width * 4;
+  gsize size = (gsize) stride * height;
+  char *canvas;
+  guint i, n;
+
+  if (composition == NULL) {
+    gst_sunxifbsink_set_composition_layer_enable (sunxifbsink, FALSE);
+    return TRUE;
+  }
+
+  if (size > sunxifbsink->composition_buffer_size) {
+    gst_sunxifbsink_free_composition_buffers (sunxifbsink);
+    for (i = 0; i < 2; i++) {
+      sunxifbsink->composition_buffer[i] = (char *)SunxiMemPalloc(ops, size);
+      if (sunxifbsink->composition_buffer[i] == NULL) {
+        gst_sunxifbsink_free_composition_buffers (sunxifbsink);
+        GST_SUNXIFBSINK_ERROR_OBJECT(sunxifbsink,
+            "-->no physical memory for overlay composition!");
+        return FALSE;
+      }
+    }
+    sunxifbsink->composition_buffer_size = size;
+  }
+  /* Draw into the canvas that is not being scanned out. */
+  canvas = sunxifbsink->composition_buffer[
+      sunxifbsink->composition_buffer_index];
+  sunxifbsink->composition_buffer_index ^= 1;
+  gst_framebuffersink_kernels->clear ((guint8 *) canvas, size);
+
+  /* The pixels are ARGB in native endianness, which matches
+     DISP_FORMAT_ARGB_8888. Rectangles are copied rather than blended, which
+     is fine for the non-overlapping rectangles produced by subtitle and OSD
+     renderers. */
+  n = gst_video_overlay_composition_n_rectangles (composition);
+  for (i = 0; i < n; i++) {
+    GstVideoOverlayRectangle *rectangle =
+        gst_video_overlay_composition_get_rectangle (composition, i);
+    GstBuffer *pixels;
+    GstVideoMeta *vmeta;
+    GstMapInfo mapinfo;
+    gint x, y;
+    guint w, h, src_x, src_y, row;
+
+    gst_video_overlay_rectangle_get_render_rectangle (rectangle, &x, &y,
+        &w, &h);
+    pixels = gst_video_overlay_rectangle_get_pixels_argb (rectangle,
+        GST_VIDEO_OVERLAY_FORMAT_FLAG_NONE);
+    vmeta = gst_buffer_get_video_meta (pixels);
+    if (vmeta == NULL || !gst_buffer_map (pixels, &mapinfo, GST_MAP_READ))
+      continue;
+
+    /* Clip against the video frame. */
+    src_x = x < 0 ? - x : 0;
+    src_y = y < 0 ? - y : 0;
+    x = MAX (x, 0);
+    y = MAX (y, 0);
+    if (x < width && y < height && src_x < vmeta->width &&
+        src_y < vmeta->height) {
+      w = MIN (vmeta->width - src_x, width - x);
+      h = MIN (vmeta->height - src_y, height - y);
+      for (row = 0; row < h; row++)
+        gst_framebuffersink_kernels->copy (
+            (guint8 *) canvas + (y + row) * stride + x * 4,
+            mapinfo.data + vmeta->offset[0] +
+            (src_y + row) * vmeta->stride[0] + src_x * 4, w * 4);
+    }
+    gst_buffer_unmap (pixels, &mapinfo);
+  }
+
+  SunxiMemFlushCache(ops, canvas, size);
+
+  return gst_sunxifbsink_show_composition_layer (framebuffersink,
+      (guintptr)SunxiMemGetPhysicAddressCpu(ops, canvas), width, height);
+}
+
+/* Overlays are allocated from physically contiguous ION memory when the
+   contiguous-memory property is set and the framebuffer itself lives in ION
+   memory (video-memory > 0). Otherwise the fbdev video memory allocator of
+   the parent class is used. */
+
+static GstAllocator *
+gst_sunxifbsink_video_memory_allocator_new (GstFramebufferSink *framebuffersink,
+    GstVideoInfo *info, gboolean pannable, gboolean is_overlay)
+{
+  GstSunxifbsink *sunxifbsink = GST_SUNXIFBSINK (framebuffersink);
+
+  if (is_overlay && sunxifbsink->use_contiguous_memory &&
+      sunxifbsink->hardware_overlay_available &&
+      framebuffersink->max_video_memory_property > 0)
+    return gst_sunxifbsink_allocator_new (sunxifbsink, info);
+
+  return GST_FRAMEBUFFERSINK_CLASS (gst_sunxifbsink_parent_class)->
+      video_memory_allocator_new (framebuffersink, info, pannable, is_overlay);
+}
+
+/* Physically contiguous memory allocator using the SunxiMem (ION) ops. */
+
+struct _GstSunxifbsinkAllocator
+{
+  GstAllocator parent;
+  struct SunxiMemOpsS *ops;
+  GstAllocationParams params;
+  /* Plane layout of the configuration the allocator serves, copied into
+     memory when it is written. Protected by the object lock. */
+  GstSunxifbsinkPlaneLayout layout;
+  /* The amount of physically contiguous memory allocated. */
+  gsize total_allocated;
+};
+
+typedef struct
+{
+  GstAllocatorClass parent_class;
+} GstSunxifbsinkAllocatorClass;
+
+typedef struct
+{
+  GstMemory mem;
+  /* CPU address as returned by SunxiMemPalloc. */
+  gpointer data;
+  /* Physical address passed to the display layer. */
+  guintptr physical_address;
+  gboolean allocated;
+  /* Set when the memory has been mapped for writing by the CPU since it was
+     last flushed. */
+  gboolean dirty;
+  /* Plane layout of the data last written, which is what memory_flush
+     writes back. */
+  GstSunxifbsinkPlaneLayout layout;
+} GstSunxifbsinkMemory;
+
+G_DEFINE_TYPE (GstSunxifbsinkAllocator, gst_sunxifbsink_allocator,
+    GST_TYPE_ALLOCATOR);
+
+/* The contiguous allocator only depends on the overlay alignment. When it is
+   reused, it takes over the plane layout of the new configuration. */
+
+static gboolean
+gst_sunxifbsink_video_memory_allocator_is_reusable (
+    GstFramebufferSink *framebuffersink, GstAllocator *allocator,
+    GstVideoInfo *info)
+{
+  GstSunxifbsinkAllocator *sunxifbsink_allocator;
+
+  if (!G_TYPE_CHECK_INSTANCE_TYPE (allocator,
+      GST_TYPE_SUNXIFBSINK_ALLOCATOR))
+    return GST_FRAMEBUFFERSINK_CLASS (gst_sunxifbsink_parent_class)->
+        video_memory_allocator_is_reusable (framebuffersink, allocator, info);
+
+  sunxifbsink_allocator = (GstSunxifbsinkAllocator *) allocator;
+  if ((framebuffersink->overlay_align &
+      ~sunxifbsink_allocator->params.align) != 0)
+    return FALSE;
+  GST_OBJECT_LOCK (allocator);
+  gst_sunxifbsink_get_plane_layout (framebuffersink, info,
+      &sunxifbsink_allocator->layout);
+  GST_OBJECT_UNLOCK (allocator);
+  return TRUE;
+}
+
+static gboolean
+gst_sunxifbsink_allocator_alloc_actual (GstSunxifbsinkAllocator *allocator,
+    GstSunxifbsinkMemory *mem)
+{
+  gsize size = mem->mem.maxsize;
+
+  GST_OBJECT_LOCK (allocator);
+
+  mem->data = SunxiMemPalloc (allocator->ops, size);
+  if (mem->data == NULL) {
+    GST_OBJECT_UNLOCK (allocator);
+    GST_ERROR_OBJECT (allocator,
+        "Out of physically contiguous memory (requested %zd bytes)", size);
+    return FALSE;
+  }
+  mem->physical_address = (guintptr) SunxiMemGetPhysicAddressCpu (
+      allocator->ops, mem->data);
+  /* ION allocations are page-aligned, which satisfies any overlay alignment
+     requirement of the display engine. */
+  if (mem->physical_address & allocator->params.align)
+    GST_WARNING_OBJECT (allocator,
+        "Contiguous buffer at 0x%08lX does not satisfy alignment %zd",
+        mem->physical_address, allocator->params.align);
+  mem->allocated = TRUE;
+  allocator->total_allocated += size;
+
+  GST_OBJECT_UNLOCK (allocator);
+
+  GST_INFO_OBJECT (allocator,
+      "Allocated contiguous buffer of size %zd at %p (physical 0x%08lX), "
+      "mem = %p", size, mem->data, mem->physical_address, mem);
+  return TRUE;
+}
+
+static GstMemory *
+gst_sunxifbsink_allocator_alloc (GstAllocator *allocator, gsize size,
+    GstAllocationParams *allocation_params)
+{
+  GstSunxifbsinkAllocator *sunxifbsink_allocator =
+      (GstSunxifbsinkAllocator *) allocator;
+  GstSunxifbsinkMemory *mem;
+
+  /* Always ignore allocation_params, but use our own specific alignment. */
+  mem = g_slice_new (GstSunxifbsinkMemory);
+  gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_NO_SHARE |
+      GST_MEMORY_FLAG_VIDEO_MEMORY | GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS,
+      allocator, NULL, size, sunxifbsink_allocator->params.align, 0, size);
+  mem->data = NULL;
+  mem->physical_address = 0;
+  mem->allocated = FALSE;
+  mem->dirty = FALSE;
+  GST_OBJECT_LOCK (allocator);
+  mem->layout = sunxifbsink_allocator->layout;
+  GST_OBJECT_UNLOCK (allocator);
+
+#ifndef LAZY_ALLOCATION
+  if (!gst_sunxifbsink_allocator_alloc_actual (sunxifbsink_allocator, mem)) {
+    g_slice_free (GstSunxifbsinkMemory, mem);
+    return NULL;
+  }
+#endif
+
+  return GST_MEMORY_CAST (mem);
+}
+
+static void
+gst_sunxifbsink_allocator_free (GstAllocator *allocator, GstMemory *mem)
+{
+  GstSunxifbsinkAllocator *sunxifbsink_allocator =
+      (GstSunxifbsinkAllocator *) allocator;
+  GstSunxifbsinkMemory *smem = (GstSunxifbsinkMemory *) mem;
+
+  if (smem->allocated) {
+    GST_OBJECT_LOCK (allocator);
+    SunxiMemPfree (sunxifbsink_allocator->ops, smem->data);
+    sunxifbsink_allocator->total_allocated -= mem->maxsize;
+    GST_OBJECT_UNLOCK (allocator);
+    GST_INFO ("Freed contiguous buffer of size %zd at %p", mem->maxsize,
+        smem->data);
+  }
+
+  g_slice_free (GstSunxifbsinkMemory, smem);
+}
+
+static gpointer
+gst_sunxifbsink_memory_map (GstMemory *mem, gsize maxsize, GstMapFlags flags)
+{
+  GstSunxifbsinkMemory *smem = (GstSunxifbsinkMemory *) mem;
+
+  GST_DEBUG ("contiguous memory_map called, mem = %p, maxsize = %lu, "
+      "flags = %d, data = %p", mem, maxsize, flags, smem->data);
+
+  if (!smem->allocated && !gst_sunxifbsink_allocator_alloc_actual (
+      (GstSunxifbsinkAllocator *) mem->allocator, smem))
+    return NULL;
+
+  if (flags & GST_MAP_WRITE) {
+    /* The data is written in the layout of the current configuration. */
+    GST_OBJECT_LOCK (mem->allocator);
+    smem->layout = ((GstSunxifbsinkAllocator *) mem->allocator)->layout;
+    GST_OBJECT_UNLOCK (mem->allocator);
+    smem->dirty = TRUE;
+  }
+
+  return smem->data;
+}
+
+static void
+gst_sunxifbsink_memory_unmap (GstMemory *mem)
+{
+  return;
+}
+
+/* Return the physical address of a memory object allocated by the
+   contiguous memory allocator, allocating it first if necessary. Returns 0
+   on failure. */
+
+static guintptr
+gst_sunxifbsink_memory_get_physical_address (GstMemory *mem)
+{
+  GstSunxifbsinkMemory *smem = (GstSunxifbsinkMemory *) mem;
+
+  if (!smem->allocated && !gst_sunxifbsink_allocator_alloc_actual (
+      (GstSunxifbsinkAllocator *) mem->allocator, smem))
+    return 0;
+
+  return smem->physical_address + mem->offset;
+}
+
+/* Write back the CPU cache for a contiguous memory object so that the
+   display engine sees the data written by the CPU. Memory that hasn't been
+   mapped for writing since the last flush (for example because it was
+   filled by a hardware block) is skipped. Only the scanlines of each plane
+   that are actually displayed are written back, not the alignment gaps,
+   using the layout the memory was written in. */
+
+static void
+gst_sunxifbsink_memory_flush (GstSunxifbsink *sunxifbsink, GstMemory *mem)
+{
+  GstSunxifbsinkMemory *smem = (GstSunxifbsinkMemory *) mem;
+
+  if (!smem->dirty) {
+    sunxifbsink->stats_cache_flushes_skipped++;
+    return;
+  }
+
+  gst_sunxifbsink_flush_planes (sunxifbsink,
+      (guint8 *) smem->data + mem->offset, &smem->layout);
+  smem->dirty = FALSE;
+}
+
+/* Plane offsets, strides and displayed heights of overlay frames of the
+   given format in the current overlay configuration. */
+
+static void
+gst_sunxifbsink_get_plane_layout (GstFramebufferSink *framebuffersink,
+    GstVideoInfo *info, GstSunxifbsinkPlaneLayout *layout)
+{
+  int i;
+  int c;
+
+  layout->n_planes = GST_VIDEO_INFO_N_PLANES (info);
+  for (i = 0; i < layout->n_planes; i++) {
+    for (c = 0; c < GST_VIDEO_INFO_N_COMPONENTS (info) - 1; c++)
+      if (GST_VIDEO_INFO_COMP_PLANE (info, c) == i)
+        break;
+    layout->offset[i] = framebuffersink->overlay_plane_offset[i];
+    layout->stride[i] = framebuffersink->overlay_scanline_stride[i];
+    layout->height[i] = GST_VIDEO_INFO_COMP_HEIGHT (info, c);
+  }
+}
+
+/* Write back the displayed scanlines of each plane of a frame at data. */
+
+static void
+gst_sunxifbsink_flush_planes (GstSunxifbsink *sunxifbsink, gpointer data,
+    const GstSunxifbsinkPlaneLayout *layout)
+{
+  int i;
+
+  for (i = 0; i < layout->n_planes; i++)
+    gst_sunxifbsink_flush_cache (sunxifbsink, (guint8 *) data +
+        layout->offset[i], (gsize) layout->stride[i] * layout->height[i]);
+}
+
+/* Write back a range of the CPU cache and account for it in the
+   statistics. */
+
+static void
+gst_sunxifbsink_flush_cache (GstSunxifbsink *sunxifbsink, gpointer data,
+    gsize size)
+{
+  struct SunxiMemOpsS* ops =  GetMemAdapterOpsS();
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  SunxiMemFlushCache (ops, data, size);
+  sunxifbsink->stats_cache_flush_time += g_get_monotonic_time () - start;
+  sunxifbsink->stats_cache_flush_bytes += size;
+  sunxifbsink->stats_cache_flushes++;
+}
+
+static void
+gst_sunxifbsink_allocator_finalize (GObject *object)
+{
+  GstSunxifbsinkAllocator *sunxifbsink_allocator =
+      (GstSunxifbsinkAllocator *) object;
+
+  SunxiMemClose (sunxifbsink_allocator->ops);
+
+  G_OBJECT_CLASS (gst_sunxifbsink_allocator_parent_class)->finalize (object);
+}
+
+static void
+gst_sunxifbsink_allocator_class_init (GstSunxifbsinkAllocatorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  gobject_class->finalize = gst_sunxifbsink_allocator_finalize;
+  allocator_class->alloc = gst_sunxifbsink_allocator_alloc;
+  allocator_class->free = gst_sunxifbsink_allocator_free;
+}
+
+static void
+gst_sunxifbsink_allocator_init (GstSunxifbsinkAllocator *sunxifbsink_allocator)
+{
+  GstAllocator *alloc = GST_ALLOCATOR_CAST (sunxifbsink_allocator);
+
+  alloc->mem_type = "sunxifbsink_contiguous_memory";
+  alloc->mem_map = gst_sunxifbsink_memory_map;
+  alloc->mem_unmap = gst_sunxifbsink_memory_unmap;
+}
+
+static GstAllocator *
+gst_sunxifbsink_allocator_new (GstSunxifbsink *sunxifbsink, GstVideoInfo *info)
+{
+  GstSunxifbsinkAllocator *sunxifbsink_allocator =
+      g_object_new (GST_TYPE_SUNXIFBSINK_ALLOCATOR, NULL);
+  gchar *str;
+
+  sunxifbsink_allocator->ops = GetMemAdapterOpsS ();
+  SunxiMemOpen (sunxifbsink_allocator->ops);
+  sunxifbsink_allocator->total_allocated = 0;
+  gst_allocation_params_init (&sunxifbsink_allocator->params);
+  /* Use the alignment required by the display engine for overlays. */
+  sunxifbsink_allocator->params.align =
+      sunxifbsink->fbdevframebuffersink.framebuffersink.overlay_align;
+  gst_sunxifbsink_get_plane_layout (GST_FRAMEBUFFERSINK (sunxifbsink), info,
+      &sunxifbsink_allocator->layout);
+
+  /* The allocator is not registered globally: the registry would keep it
+     alive forever and the SunxiMem ops would never be closed. The element
+     keeps the only reference in overlay_video_memory_allocator, and each
+     memory holds one until it is freed, so memory can be allocated lazily
+     after the element is gone; the allocator therefore keeps no pointer to
+     the element and logs against itself. */
+  str = g_strdup_printf ("Created contiguous memory allocator %p (format %s)",
+      sunxifbsink_allocator,
+      gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (info)));
+  GST_SUNXIFBSINK_MESSAGE_OBJECT (sunxifbsink, str);
+  g_free (str);
+  return GST_ALLOCATOR_CAST (sunxifbsink_allocator);
+}
+
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  gst_framebuffersink_kernels_init ();
+
   /* Remember to set the rank if it's an element that is meant
      to be autoplugged by decodebin. */
   return gst_element_register (plugin, "sunxifbsink", GST_RANK_SECONDARY,
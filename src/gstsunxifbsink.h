@@ -71,12 +71,37 @@ struct _GstSunxifbsink
   int framebuffer_id;
   int gfx_layer_id;
   int layer_id;
+  int layer_channel;
+  int layer_zorder;
   gboolean layer_has_scaler;
   gboolean layer_is_visible;
   GstVideoFormat overlay_format;
   char *rotate_addr_phy[2];
   unsigned long transform_channel;
   OmxPrivateBuffer* sBuffer; /*private buffer that contains buffer fd and other info, which is defined by omx.*/
+  /* Configurable properties. */
+  gboolean use_contiguous_memory;
+  gboolean flush_decoder_buffers;
+  gboolean use_g2d;
+  gboolean use_composition_layer;
+  /* Double-buffered BGRx output of the G2D blit stage. */
+  char *g2d_buffer[2];
+  gsize g2d_buffer_size;
+  int g2d_buffer_index;
+  /* Layer showing overlay compositions (subtitles, OSD) and its
+     double-buffered ARGB canvas. */
+  int composition_layer_id;
+  int composition_layer_channel;
+  int composition_layer_zorder;
+  gboolean composition_layer_is_visible;
+  char *composition_buffer[2];
+  gsize composition_buffer_size;
+  int composition_buffer_index;
+  /* Cache maintenance statistics. */
+  guint stats_cache_flushes;
+  guint stats_cache_flushes_skipped;
+  guint64 stats_cache_flush_bytes;
+  gint64 stats_cache_flush_time;
 };
 
 struct _GstSunxifbsinkClass
@@ -86,6 +111,14 @@ struct _GstSunxifbsinkClass
 
 GType gst_sunxifbsink_get_type (void);
 
+/* Physically contiguous (ION) overlay memory allocator. */
+
+#define GST_TYPE_SUNXIFBSINK_ALLOCATOR (gst_sunxifbsink_allocator_get_type ())
+#define GST_IS_SUNXIFBSINK_ALLOCATOR(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_SUNXIFBSINK_ALLOCATOR))
+
+GType gst_sunxifbsink_allocator_get_type (void);
+
 G_END_DECLS
 
 #endif